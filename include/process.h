@@ -44,12 +44,16 @@
 #include "xdefines.h"
 #include "xthread.h"
 #include "xqueue.h"
+#include "xdeque.h"
+#include "xevent.h"
 #include "xmemory.h"
 #include "internalheap.h"
 
 class process {
 public:
   process () {
+    sliceticks = 0;
+    clonestack = NULL;
   } 
 
   // process is not an actual singleton in the whole system,
@@ -62,7 +66,7 @@ public:
 
   void initialize(int pid, int coreid);
 
-  void bindToCpu(int cpuid);
+  void bindToCpu(int coreid);
 
   // Run specified thread.
   static void runTask(process & proc, xthread * task);
@@ -78,6 +82,12 @@ public:
   // Create a new process
   void create(int id);
 
+  // Entry of a new process, which is running on the clone stack.
+  void start(int coreid);
+
+  // Release the clone stack after switching to the scheduler.
+  void freeCloneStack(void);
+
   // Setup private and share queues for current process   
   void setQueues(int id);
 
@@ -104,17 +114,45 @@ public:
     return squeue;
   }
 
+  xdeque * getDeque(void) {
+    return deque;
+  }
+
+  // Post an event to the scheduler. Only the running user thread can post it,
+  // right before switching to the scheduler.
+  xevent * postEvent(e_event_type type) {
+    assert(event.type == E_EVENT_NONE);
+    event.type = type;
+    return &event;
+  }
+
+  // A new thread is switched in, start a new timeslice.
+  void startSlice(void) {
+    sliceticks = 0;
+  }
+
+  // Called on each timer tick, return true if current thread has run for a whole tick.
+  bool sliceExpired(void) {
+    return sliceticks++ > 0;
+  }
+
+  // Take the pending event, called by the scheduler after switching back.
+  bool takeEvent(xevent * taken) {
+    if(event.type == E_EVENT_NONE) {
+      return false;
+    }
+
+    *taken = event;
+    event.type = E_EVENT_NONE;
+    return true;
+  }
+
 #if 0
   xqueue * getDQueue(void) {
     return dqueue;
   }
 #endif
 
-private:
-  int forkShareFS(void) {
-    return syscall(SYS_clone, CLONE_FS|CLONE_FILES|SIGCHLD, (void*) 0 );
-  } 
-
 public:  
   void setCoreId(int id);
 
@@ -139,12 +177,22 @@ public:
 
   xqueue * pqueue;
   xqueue * squeue;
+  xdeque * deque;
   //xqueue * dqueue;
 
   // Current thread??
   xthread * current;
 
   xthread * scheduler; // One scheduler thread
+
+  // The only pending event to the scheduler, see xevent.h.
+  xevent event;
+
+  // Timer ticks since current thread was switched in.
+  volatile int sliceticks;
+
+  // Private stack of a new process before it switches to the scheduler.
+  void * clonestack;
 };
 
 #endif
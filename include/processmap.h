@@ -33,13 +33,108 @@
 #include "xdefines.h"
 #include "xatomic.h"
 #include "xplock.h"
+#include "xdeque.h"
+#include "xidle.h"
+#include "xtimerwheel.h"
+#include "xpoller.h"
+#include "xcpus.h"
+
+// Counters of the affinity policy on one core. 
+// Only the process of this core updates them, so no atomic operation is needed.
+class affinitystats {
+public:
+  affinitystats() {
+    hits = 0;
+    misses = 0;
+    wakeaffine = 0;
+    wakemigrate = 0;
+    trapmigrate = 0;
+  }
+
+  void printStatistics(int coreid) {
+    unsigned long runs = hits + misses;
+
+    fprintf(stderr, "core %d: affinity hits %lu, misses %lu (%.1f%% hit), wakeups to last core %lu, migrated %lu, "
+            "moved to page owners %lu\n", coreid, hits, misses, runs ? (100.0 * hits / runs) : 0.0, 
+            wakeaffine, wakemigrate, trapmigrate);
+  }
+
+  // A thread runs on the same core as last time, or on a different one. 
+  unsigned long hits;
+  unsigned long misses;
+
+  // A woken thread is sent back to its last core, or kept by the waker because of imbalance.
+  unsigned long wakeaffine;
+  unsigned long wakemigrate;
+
+  // A thread has touched a page owned by another core and is moved there, see xprotect.cpp.
+  unsigned long trapmigrate;
+
+  char padding[64];
+};
+
+// Life cycle of the process serving one core, see the elastic pool in xscheduler.cpp.
+// Inactive: no process has been created. Starting: a process is being created or 
+// unparked. Parked: the process has retired and sleeps on the futex of state.
+// A spare process is active only while it has adopted a core.
+enum e_core_state {
+  CORE_INACTIVE = 0,
+  CORE_STARTING,
+  CORE_ACTIVE,
+  CORE_PARKED
+};
+
+// It must be in shared memory, since processes are created by any process.
+class corestate {
+public:
+  corestate() {
+    state = CORE_INACTIVE;
+    pid = 0;
+  }
+
+  volatile unsigned long state;
+  volatile pid_t pid;
+  char padding[64];
+};
+
+// The blocking syscall of the process serving one core, and the spare process
+// which has adopted the core meanwhile, see the syscall handoff in xscheduler.cpp.
+class syscallstate {
+public:
+  enum { NO_ADOPTER = -1 };
+
+  syscallstate() {
+    since = 0;
+    adopter = (unsigned long)NO_ADOPTER;
+    adoptions = 0;
+  }
+
+  void printStatistics(int coreid) {
+    fprintf(stderr, "core %d: adopted by spares %lu times\n", coreid, adoptions);
+  }
+
+  // When the syscall started, in microseconds. 0 if the process is not in one.
+  volatile unsigned long since;
+  volatile unsigned long adopter;
+
+  // Only updated by the spare which has adopted the core.
+  unsigned long adoptions;
+  char padding[64];
+};
 
 class processmap {
 
   class pqmap{
   public:
-    pid_t pid;
+    corestate * core;
     xqueue * pqueue;
+    xqueue * aqueue;
+    xdeque * deque;
+    xidle  * idle;
+    xtimerwheel * timers;
+    xpoller * poller;
+    affinitystats * stats;
+    syscallstate * syscall;
   };  
 
 public:
@@ -63,35 +158,123 @@ public:
 #endif
   }
 
+  // Spare processes have the same tables as cores, after them.
   void initPrivateQueues(void) {
     void * ptr;
 
     // Malloc a block of share memory to hold private queues.
-    ptr = MALLOC_SHARED(sizeof(xqueue) * CPU_CORES);
-    for(int i = 0; i < CPU_CORES; i++) {
+    ptr = MALLOC_SHARED(sizeof(xqueue) * PROCESS_SLOTS);
+    for(int i = 0; i < PROCESS_SLOTS; i++) {
       void * qptr;
       qptr = (void *)((intptr_t)ptr + i * sizeof(xqueue));
 //      fprintf(stderr, "core %d: pqueue %p\n", i, qptr);
       map[i].pqueue = new (qptr) xqueue;
+      map[i].pqueue->setOwner(i);
+    }
+
+    // Woken threads that prefer a core wait in its affinity queue. Unlike
+    // private queues, other processes steal from it when they are idle.
+    ptr = MALLOC_SHARED(sizeof(xqueue) * PROCESS_SLOTS);
+    for(int i = 0; i < PROCESS_SLOTS; i++) {
+      void * aptr;
+      aptr = (void *)((intptr_t)ptr + i * sizeof(xqueue));
+      map[i].aqueue = new (aptr) xqueue;
+      map[i].aqueue->setOwner(i);
     }
+
+    // Work-stealing deques are in the shared space too, 
+    // idle processes will steal threads from others.
+    ptr = MALLOC_SHARED(sizeof(xdeque) * PROCESS_SLOTS);
+    for(int i = 0; i < PROCESS_SLOTS; i++) {
+      void * dptr;
+      dptr = (void *)((intptr_t)ptr + i * sizeof(xdeque));
+      map[i].deque = new (dptr) xdeque;
+    }
+
+    // Idle states are touched by wakers on other processes.
+    ptr = MALLOC_SHARED(sizeof(xidle) * PROCESS_SLOTS);
+    for(int i = 0; i < PROCESS_SLOTS; i++) {
+      void * iptr;
+      iptr = (void *)((intptr_t)ptr + i * sizeof(xidle));
+      map[i].idle = new (iptr) xidle;
+    }
+
+    // Timers are cancelled and expired by other processes too.
+    ptr = MALLOC_SHARED(sizeof(xtimerwheel) * PROCESS_SLOTS);
+    for(int i = 0; i < PROCESS_SLOTS; i++) {
+      void * tptr;
+      tptr = (void *)((intptr_t)ptr + i * sizeof(xtimerwheel));
+      map[i].timers = new (tptr) xtimerwheel;
+    }
+
+    // Sockets are registered on the poller of any core, and all processes share the fds.
+    ptr = MALLOC_SHARED(sizeof(xpoller) * PROCESS_SLOTS);
+    for(int i = 0; i < PROCESS_SLOTS; i++) {
+      void * pptr;
+      pptr = (void *)((intptr_t)ptr + i * sizeof(xpoller));
+      map[i].poller = new (pptr) xpoller;
+      map[i].poller->initialize();
+      map[i].idle->setWakeFd(map[i].poller->getWakeFd());
+    }
+
+    ptr = MALLOC_SHARED(sizeof(affinitystats) * PROCESS_SLOTS);
+    for(int i = 0; i < PROCESS_SLOTS; i++) {
+      void * sptr;
+      sptr = (void *)((intptr_t)ptr + i * sizeof(affinitystats));
+      map[i].stats = new (sptr) affinitystats;
+    }
+
+    sleepers = (volatile unsigned long *)MALLOC_SHARED(sizeof(unsigned long));
+    *sleepers = 0;
+
+    ptr = MALLOC_SHARED(sizeof(corestate) * PROCESS_SLOTS);
+    for(int i = 0; i < PROCESS_SLOTS; i++) {
+      void * cptr;
+      cptr = (void *)((intptr_t)ptr + i * sizeof(corestate));
+      map[i].core = new (cptr) corestate;
+    }
+
+    // Spares look at the syscalls of all processes.
+    ptr = MALLOC_SHARED(sizeof(syscallstate) * PROCESS_SLOTS);
+    for(int i = 0; i < PROCESS_SLOTS; i++) {
+      void * yptr;
+      yptr = (void *)((intptr_t)ptr + i * sizeof(syscallstate));
+      map[i].syscall = new (yptr) syscallstate;
+    }
+
+    // Only the initial process is running now.
+    map[0].core->state = CORE_ACTIVE;
+    activecores = (volatile unsigned long *)MALLOC_SHARED(sizeof(unsigned long));
+    *activecores = 1;
+
+    // Read the settings of the pool. Children processes will inherit them.
+    char * env = getenv("PROTO_MIN_CORES");
+    mincores = (env && atoi(env) > 0) ? atoi(env) : xdefines::POOL_MIN_CORES;
+    if(mincores > CPU_CORES) {
+      mincores = CPU_CORES;
+    }
+
+    env = getenv("PROTO_RETIRE_MSECS");
+    retirens = (env ? atol(env) : xdefines::POOL_RETIRE_MSECS) * 1000000ULL;
   }
 
-  // This function will be called only by the main pqueue
-  // So there is no need for a lock.
+  // Processes can be created by any process now, 
+  // so the pid is saved in the shared space.
   void registerProcess(int coreid, int pid) {
-    map[coreid].pid = pid;
+    map[coreid].core->pid = pid;
 //    fprintf(stderr, "coreid %d with process %d\n", coreid, pid);
   }
 
+  // Return 0 if no process has been created for this core.
   pid_t getPid(int coreid) {
-    return map[coreid].pid;
+    return map[coreid].core->pid;
   }
 
   int getCoreid(int pid) {
     int i;
 
-    for(i = 0; i < CPU_CORES; i++) {
-      if(map[i].pid == pid) {
+    for(i = 0; i < PROCESS_SLOTS; i++) {
+      if(map[i].core->pid == pid) {
         return i;
       }
     }
@@ -104,6 +287,153 @@ public:
   xqueue * getPQueue(int coreid) {
     return map[coreid].pqueue;
   }
+
+  xqueue * getAQueue(int coreid) {
+    return map[coreid].aqueue;
+  }
+
+  xdeque * getDeque(int coreid) {
+    return map[coreid].deque;
+  }
+
+  xidle * getIdle(int coreid) {
+    return map[coreid].idle;
+  }
+
+  xtimerwheel * getTimers(int coreid) {
+    return map[coreid].timers;
+  }
+
+  xpoller * getPoller(int coreid) {
+    return map[coreid].poller;
+  }
+
+  affinitystats * getAffinityStats(int coreid) {
+    return map[coreid].stats;
+  }
+
+  // How many runnable threads are waiting for the core, only a hint.
+  int getLoad(int coreid) {
+    return map[coreid].pqueue->getLength() + map[coreid].aqueue->getLength()
+           + map[coreid].deque->size();
+  }
+
+  // How many schedulers are sleeping now.
+  volatile unsigned long * getSleepers(void) {
+    return sleepers;
+  }
+
+  bool hasSleepers(void) {
+    return *sleepers != 0;
+  }
+
+  int getCoreState(int coreid) {
+    return map[coreid].core->state;
+  }
+
+  // Only active cores are serving their private queues.
+  bool isCoreActive(int coreid) {
+    return map[coreid].core->state == CORE_ACTIVE;
+  }
+
+  // How many cores are active or starting.
+  int getActiveCores(void) {
+    return *activecores;
+  }
+
+  int getMinCores(void) {
+    return mincores;
+  }
+
+  unsigned long long getRetireTime(void) {
+    return retirens;
+  }
+
+  // Claim an inactive or parked core, only one process can succeed.
+  bool claimCore(int coreid, unsigned long from) {
+    if(cmpxchg(&map[coreid].core->state, from, CORE_STARTING) != from) {
+      return false;
+    }
+
+    xatomic::increment(activecores);
+    return true;
+  }
+
+  // The process of a claimed core is running its scheduler now.
+  void setCoreActive(int coreid) {
+    xatomic::atomic_set(&map[coreid].core->state, CORE_ACTIVE);
+  }
+
+  // Park the process of current core until somebody claims it again.
+  void parkCore(int coreid) {
+    volatile unsigned long * state = &map[coreid].core->state;
+
+    xatomic::decrement(activecores);
+    xatomic::atomic_set(state, CORE_PARKED);
+
+    // Since the futex is in a MAP_SHARED area, we can't use FUTEX_PRIVATE_FLAG.
+    while(*state == CORE_PARKED) {
+      syscall(SYS_futex, state, FUTEX_WAIT, CORE_PARKED, NULL, NULL, 0);
+    }
+  }
+
+  // Wake up a parked process after claiming its core.
+  void unparkCore(int coreid) {
+    syscall(SYS_futex, &map[coreid].core->state, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+
+  syscallstate * getSyscallState(int coreid) {
+    return map[coreid].syscall;
+  }
+
+  bool isSpare(int coreid) {
+    return coreid >= CPU_CORES;
+  }
+
+  // Clock of syscalls, in microseconds. It is never 0.
+  static unsigned long syscallClock(void) {
+    return (unsigned long)(xtimerwheel::now() / 1000ULL) | 1;
+  }
+
+  // The process of the core is entering a syscall which may block.
+  void enterSyscall(int coreid) {
+    map[coreid].syscall->since = syscallClock();
+  }
+
+  void exitSyscall(int coreid) {
+    map[coreid].syscall->since = 0;
+  }
+
+  // How long the process of the core has been in a syscall, 0 if it is not in one.
+  unsigned long getSyscallTime(int coreid, unsigned long now) {
+    unsigned long since = map[coreid].syscall->since;
+
+    return since ? (now - since) : 0;
+  }
+
+  bool isBlocked(int coreid, unsigned long now) {
+    return getSyscallTime(coreid, now) >= xdefines::SYSCALL_BLOCK_USECS;
+  }
+
+  // A spare takes over the private queue of a blocked core. Only one spare can succeed.
+  bool adoptCore(int coreid, int spareid) {
+    syscallstate * state = map[coreid].syscall;
+
+    if(cmpxchg(&state->adopter, (unsigned long)syscallstate::NO_ADOPTER, spareid) 
+       != (unsigned long)syscallstate::NO_ADOPTER) {
+      return false;
+    }
+
+    state->adoptions++;
+    setCoreActive(spareid);
+    return true;
+  }
+
+  // The spare gives the core back, and waits for another blocked core.
+  void releaseCore(int coreid, int spareid) {
+    xatomic::atomic_set(&map[spareid].core->state, CORE_PARKED);
+    xatomic::atomic_set(&map[coreid].syscall->adopter, (unsigned long)syscallstate::NO_ADOPTER);
+  }
  
   
 private:
@@ -113,6 +443,16 @@ private:
   // If we are using the globals, then some processes may seen some process id haven't been
   // setted since only the initial process will set this map when it creates
   // new processes.
-  pqmap map[CPU_CORES];
+  pqmap map[MAX_CORES];
+
+  // Number of sleeping schedulers, which is in the shared space.
+  volatile unsigned long * sleepers;
+
+  // Number of active or starting cores, which is in the shared space.
+  volatile unsigned long * activecores;
+
+  // Settings of the elastic pool.
+  int mincores;
+  unsigned long long retirens;
 };
 #endif /* _ */
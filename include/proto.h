@@ -0,0 +1,71 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   proto.h
+ * @brief:  Extensions of proto for programs which are linked with libproto.
+ *          Split-phase barrier: proto_barrier_arrive counts the caller for the
+ *          current phase and returns at once, with a token of the phase. The
+ *          caller can go on with work which doesn't depend on the others, and
+ *          then proto_barrier_wait only blocks if the phase has not completed.
+ *          The arriver which completes a phase gets PTHREAD_BARRIER_SERIAL_THREAD.
+ *          A thread must wait for its token before it arrives again.
+ *          Countdown latch: proto_latch_count_down may be called by any thread
+ *          any number of times, and proto_latch_wait blocks until the count
+ *          reaches zero. A latch of count 0 is open at once. Counting down
+ *          past zero does nothing, and a latch can't be reset.
+ *          Waiting threads are parked and yield their cores like the threads
+ *          waiting on pthread barriers, see xbarr.h.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _PROTO_H_
+#define _PROTO_H_
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The state is kept by the runtime, only the address of the object is used.
+typedef struct { void * __reserved; } proto_barrier_t;
+typedef struct { void * __reserved; } proto_latch_t;
+typedef unsigned long proto_barrier_token_t;
+
+int proto_barrier_init(proto_barrier_t * barrier, unsigned int count);
+int proto_barrier_destroy(proto_barrier_t * barrier);
+int proto_barrier_arrive(proto_barrier_t * barrier, proto_barrier_token_t * token);
+int proto_barrier_wait(proto_barrier_t * barrier, proto_barrier_token_t token);
+
+int proto_latch_init(proto_latch_t * latch, unsigned int count);
+int proto_latch_destroy(proto_latch_t * latch);
+int proto_latch_count_down(proto_latch_t * latch, unsigned int count);
+
+// Return 0 if the count has reached zero, EBUSY otherwise.
+int proto_latch_try_wait(proto_latch_t * latch);
+int proto_latch_wait(proto_latch_t * latch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PROTO_H_ */
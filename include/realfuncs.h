@@ -2,6 +2,11 @@
 #define _REAL_H_
 
 #include <sys/types.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
 
 #define WRAP(x) _real_##x
 
@@ -16,6 +21,34 @@ extern size_t (*WRAP(malloc_usable_size))(void *);
 extern ssize_t (*WRAP(read))(int, void*, size_t);
 extern ssize_t (*WRAP(write))(int, const void*, size_t);
 extern int (*WRAP(sigwait))(const sigset_t*, int*);
+extern int (*WRAP(nanosleep))(const struct timespec*, struct timespec*);
+extern int (*WRAP(clock_nanosleep))(clockid_t, int, const struct timespec*, struct timespec*);
+extern long (*WRAP(syscall))(long, ...);
+
+// sockets, see xio.h
+extern ssize_t (*WRAP(readv))(int, const struct iovec*, int);
+extern ssize_t (*WRAP(writev))(int, const struct iovec*, int);
+extern ssize_t (*WRAP(recv))(int, void*, size_t, int);
+extern ssize_t (*WRAP(recvfrom))(int, void*, size_t, int, struct sockaddr*, socklen_t*);
+extern ssize_t (*WRAP(recvmsg))(int, struct msghdr*, int);
+extern ssize_t (*WRAP(send))(int, const void*, size_t, int);
+extern ssize_t (*WRAP(sendto))(int, const void*, size_t, int, const struct sockaddr*, socklen_t);
+extern ssize_t (*WRAP(sendmsg))(int, const struct msghdr*, int);
+extern int (*WRAP(accept))(int, struct sockaddr*, socklen_t*);
+extern int (*WRAP(accept4))(int, struct sockaddr*, socklen_t*, int);
+extern int (*WRAP(connect))(int, const struct sockaddr*, socklen_t);
+extern int (*WRAP(poll))(struct pollfd*, nfds_t, int);
+extern int (*WRAP(epoll_wait))(int, struct epoll_event*, int, int);
+extern int (*WRAP(close))(int);
+extern int (*WRAP(fcntl))(int, int, ...);
+extern int (*WRAP(ioctl))(int, unsigned long, ...);
+
+// files, which may block the process, see the syscall handoff in xscheduler.cpp
+extern int (*WRAP(open))(const char*, int, ...);
+extern ssize_t (*WRAP(pread))(int, void*, size_t, off_t);
+extern ssize_t (*WRAP(pwrite))(int, const void*, size_t, off_t);
+extern int (*WRAP(fsync))(int);
+extern int (*WRAP(fdatasync))(int);
 
 extern FILE* (*WRAP(fopen))(const char *path, const char *mode);
 extern int (*WRAP(fclose))(FILE * file);
@@ -21,13 +21,25 @@
 
 /*
  * @file:   spinlock.h
- * @brief:  spinlock used internally.
+ * @brief:  spinlocks used internally.
+ *          spinlock:   test-and-set on one word. It is the only one small enough
+ *                      for the entries of xsynctable (xmutex, xcondvar, xbarr).
+ *          ttaslock:   test-and-test-and-set with exponential backoff.
+ *          ticketlock: FIFO, waiters back off in proportion to their place.
+ *          mcslock:    FIFO, every waiter spins on its own node.
+ *          All of them may be shared by processes, so they must be placed in
+ *          the shared memory, and so do the nodes of mcslock.
+ *          tests/lockbench compares them under contention.
  * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
  *  Note:   Some references: http://locklessinc.com/articles/locks/   
+ *          Mellor-Crummey and Scott, "Algorithms for scalable synchronization
+ *          on shared-memory multiprocessors", TOCS 1991.
  */
 #ifndef __SPINLOCK_H__
 #define __SPINLOCK_H__
 
+#include <stddef.h>
+
 #include "xatomic.h"
 
 class spinlock {
@@ -72,23 +84,171 @@ public:
 
 #else
   while (xatomic::test_and_set(&_lock)) {
-    //while(_lock) {
-    // There is no need to check the _lock since it could be inside the register
+    // Wait until the lock looks free before trying the atomic operation again,
+    // so that waiters only read their cached copy of the lock.
+    while(_lock) {
       /* Pause instruction to prevent excess processor bus usage */ 
-    xatomic::cpuRelax();
-   // }
+      xatomic::cpuRelax();
+    }
   }
 #endif
   }
   
+  // x86 doesn't reorder stores with older loads or stores, so a plain store
+  // is enough to release the lock. It is not a full barrier though: a later
+  // load may pass it. Callers that check state written by others after
+  // releasing, like xqueue waking up a sleeping owner, need memoryBarrier.
   void release(void) {
+    xatomic::compilerBarrier();
     _lock = 0;
-    xatomic::memoryBarrier();
   }
 
 private:
   volatile unsigned long _lock;
 };
 
+class ttaslock {
+  enum { MIN_BACKOFF = 4 };
+  enum { MAX_BACKOFF = 1024 };
+
+public:
+  ttaslock() {
+    _lock = 0;
+  }
+
+  void init(void) {
+    _lock = 0;
+  }
+
+  void acquire(void) {
+    int backoff = MIN_BACKOFF;
+
+    while(true) {
+      while(_lock) {
+        xatomic::cpuRelax();
+      }
+
+      if(!xatomic::test_and_set(&_lock)) {
+        return;
+      }
+
+      // Someone else got it first, stay away for a while.
+      for(int i = 0; i < backoff; i++) {
+        xatomic::cpuRelax();
+      }
+
+      if(backoff < MAX_BACKOFF) {
+        backoff <<= 1;
+      }
+    }
+  }
+
+  // Like spinlock::release, it is not a full barrier.
+  void release(void) {
+    xatomic::compilerBarrier();
+    _lock = 0;
+  }
+
+private:
+  volatile unsigned long _lock;
+};
+
+class ticketlock {
+  // Rough number of pauses that a short critical section takes.
+  enum { BACKOFF_BASE = 32 };
+
+public:
+  ticketlock() {
+    init();
+  }
+
+  void init(void) {
+    _next = 0;
+    _serving = 0;
+  }
+
+  void acquire(void) {
+    unsigned long ticket = (unsigned int)xatomic::increment_and_return(&_next);
+    unsigned long serving;
+
+    while((serving = _serving) != ticket) {
+      // Every owner ahead of us holds the lock once, so there is no point
+      // to check again before they are done.
+      for(unsigned long i = (ticket - serving) * BACKOFF_BASE; i > 0; i--) {
+        xatomic::cpuRelax();
+      }
+    }
+
+    xatomic::compilerBarrier();
+  }
+
+  // Like spinlock::release, it is not a full barrier.
+  void release(void) {
+    xatomic::compilerBarrier();
+    _serving = _serving + 1;
+  }
+
+private:
+  volatile unsigned long _next;
+  volatile unsigned long _serving;
+};
+
+// One waiter or owner of a mcslock. A node can be used for one lock at a time.
+class mcsnode {
+public:
+  mcsnode * volatile next;
+  volatile unsigned long locked;
+};
+
+class mcslock {
+public:
+  mcslock() {
+    _tail = NULL;
+  }
+
+  void init(void) {
+    _tail = NULL;
+  }
+
+  void acquire(mcsnode * me) {
+    mcsnode * pred;
+
+    me->next = NULL;
+    me->locked = 1;
+
+    pred = (mcsnode *)xatomic::exchange((volatile unsigned long *)&_tail, (unsigned long)me);
+    if(pred != NULL) {
+      // Link behind the previous one, and spin on our own node until it hands over.
+      pred->next = me;
+      while(me->locked) {
+        xatomic::cpuRelax();
+      }
+    }
+
+    xatomic::compilerBarrier();
+  }
+
+  void release(mcsnode * me) {
+    xatomic::compilerBarrier();
+
+    if(me->next == NULL) {
+      // Nobody is waiting.
+      if(cmpxchg(&_tail, me, NULL) == me) {
+        return;
+      }
+
+      // A new waiter has swapped the tail but hasn't linked itself yet.
+      while(me->next == NULL) {
+        xatomic::cpuRelax();
+      }
+    }
+
+    me->next->locked = 0;
+  }
+
+private:
+  mcsnode * volatile _tail;
+};
+
 #endif /* __SPINLOCK_H__ */
 
@@ -0,0 +1,602 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xaio.h
+ * @brief:  File reads and writes of user threads, which park the thread instead
+ *          of blocking the process. It is enabled by PROTO_AIO=1.
+ *          Every process submits the calls of its threads to its own io_uring,
+ *          which is set up on the first call. The ring writes the eventfd of
+ *          the poller of the core (xpoller.h) on every completion, so that a
+ *          sleeping scheduler wakes up, and the scheduler reaps the completions
+ *          in its loop. Where io_uring is not available, or with PROTO_AIO=helpers,
+ *          calls are queued to helper processes, which make the blocking syscalls
+ *          and hand the completions to the submitting core in the same way.
+ *
+ *          Buffers are in the shared memory, so the kernel or the helper reads
+ *          and writes them in place. Like the waiters of xio.h, a request is on
+ *          the stack of the waiting thread, but helpers take it from the shared
+ *          heap, since they can't see the memory mapped after they were created.
+ *          A request counts as a waiter of the poller until it is reaped, so that
+ *          the scheduler sleeps in epoll_wait and never retires meanwhile.
+ *          Only the submitting core reaps the request.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XAIO_H_
+#define _XAIO_H_
+
+#include <new>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define XAIO_URING 1
+#endif
+
+#include "xdefines.h"
+#include "xatomic.h"
+#include "spinlock.h"
+#include "list.h"
+#include "xthread.h"
+#include "xscheduler.h"
+#include "xpoller.h"
+#include "xcpus.h"
+#include "processmap.h"
+#include "memwrapper.h"
+#include "realfuncs.h"
+#include "log.h"
+
+// Operations of file requests.
+enum e_aio_op {
+  AIO_READ = 0,
+  AIO_WRITE
+};
+
+class xaio {
+  enum { MODE_OFF = 0, MODE_URING, MODE_HELPERS };
+  enum { RING_ENTRIES = xdefines::AIO_RING_ENTRIES };
+
+  // IORING_OP_READ and IORING_OP_WRITE, which read and write at the current
+  // position of the file if the offset is -1 (IORING_FEAT_RW_CUR_POS).
+  enum { URING_OP_READ = 22, URING_OP_WRITE = 23 };
+  enum { URING_FEAT_RW_CUR_POS = 1U << 3 };
+
+  // One file call of a parked thread.
+  class aioreq {
+  public:
+    struct lnode node;
+    xthread * thread;
+    int core;
+    int op;
+    int fd;
+    void * buf;
+    size_t count;
+
+    // -1 means the current position of the file.
+    long long offset;
+
+    // Bytes or -errno.
+    long result;
+
+    // Set by the reaper under the thread lock.
+    volatile bool done;
+  };
+
+  // Requests of one core, which helpers have finished.
+  class aiocore {
+  public:
+    spinlock lock;
+    struct lnode completed;
+    volatile unsigned long inflight;
+    char padding[64];
+  };
+
+  // Requests waiting for helpers. Idle helpers sleep on the futex of pending.
+  class aioqueue {
+  public:
+    spinlock lock;
+    struct lnode requests;
+    volatile unsigned long pending;
+  };
+
+#ifdef XAIO_URING
+  // The io_uring of current process, which is in the library globals.
+  // Globals are private to every process, so the ring of the parent is
+  // still mapped after cloning, but the child sets up its own one.
+  class aioring {
+  public:
+    int core;
+    int fd;
+    unsigned * sqhead;
+    unsigned * sqtail;
+    unsigned * sqmask;
+    unsigned * sqarray;
+    struct io_uring_sqe * sqes;
+    unsigned * cqhead;
+    unsigned * cqtail;
+    unsigned * cqmask;
+    struct io_uring_cqe * cqes;
+    void * sqptr;
+    void * cqptr;
+    size_t sqsize;
+    size_t cqsize;
+    size_t sqesize;
+  };
+#endif
+
+public:
+  xaio() {
+    mode = MODE_OFF;
+    cores = NULL;
+    queue = NULL;
+    helpers = NULL;
+#ifdef XAIO_URING
+    memset(&ring, 0, sizeof(ring));
+    ring.core = -1;
+    ring.fd = -1;
+#endif
+  }
+
+  static xaio& getInstance (void) {
+    static char buf[sizeof(xaio)];
+    static xaio * theOneTrueObject = new (buf) xaio();
+    return *theOneTrueObject;
+  }
+
+  void initialize(void) {
+    char * env = getenv("PROTO_AIO");
+
+    if(env == NULL || strcmp(env, "0") == 0) {
+      return;
+    }
+
+    mode = (strcmp(env, "helpers") != 0 && probeRing()) ? MODE_URING : MODE_HELPERS;
+
+    cores = (aiocore *)MALLOC_SHARED(sizeof(aiocore) * PROCESS_SLOTS);
+    for(int i = 0; i < PROCESS_SLOTS; i++) {
+      new (&cores[i].lock) spinlock;
+      listInit(&cores[i].completed);
+      cores[i].inflight = 0;
+    }
+
+    queue = (aioqueue *)MALLOC_SHARED(sizeof(aioqueue));
+    new (&queue->lock) spinlock;
+    listInit(&queue->requests);
+    queue->pending = 0;
+  }
+
+  bool isEnabled(void) {
+    return mode != MODE_OFF;
+  }
+
+  // Create the helpers, after all shared memory has been mapped.
+  void startHelpers(void) {
+    if(mode != MODE_HELPERS) {
+      return;
+    }
+
+    helpers = (pid_t *)MALLOC_SHARED(sizeof(pid_t) * xdefines::AIO_HELPERS);
+    for(int i = 0; i < xdefines::AIO_HELPERS; i++) {
+      void * stack = MMAP_PRIVATE(xdefines::PRIVATE_STACK_SIZE);
+
+      helpers[i] = clone(helperEntry, (void *)((intptr_t)stack + xdefines::PRIVATE_STACK_SIZE),
+                         CLONE_FS|CLONE_FILES|SIGCHLD, NULL);
+      if(helpers[i] == -1) {
+        PRFATAL("can't create the helper of file calls: %s\n", strerror(errno));
+      }
+    }
+  }
+
+  void stopHelpers(void) {
+    if(helpers == NULL) {
+      return;
+    }
+
+    for(int i = 0; i < xdefines::AIO_HELPERS; i++) {
+      kill(helpers[i], SIGKILL);
+    }
+  }
+
+  // Read or write the file, and park current thread until it is done.
+  // Return false if the caller should make the syscall itself.
+  // Note: preemption must be disabled, so that we stay on the same core.
+  bool access(xthread * current, int coreid, int op, int fd, void * buf, size_t count,
+              long long offset, long * result) {
+    aioreq stackreq;
+    aioreq * req = &stackreq;
+    bool submitted;
+
+    // The completion queue of the ring can't overflow.
+    if(cores[coreid].inflight >= RING_ENTRIES) {
+      return false;
+    }
+
+    if(mode == MODE_HELPERS) {
+      req = (aioreq *)MALLOC_SHARED(sizeof(aioreq));
+    }
+
+    req->thread = current;
+    req->core = coreid;
+    req->op = op;
+    req->fd = fd;
+    req->buf = buf;
+    req->count = count;
+    req->offset = offset;
+    req->result = 0;
+    req->done = false;
+
+    addInflight(coreid);
+
+    submitted = (mode == MODE_URING) ? submitRing(req, coreid) : submitHelper(req);
+    if(submitted) {
+      // The reaper sets done before it takes the thread lock, see complete.
+      current->lock();
+      if(req->done) {
+        current->unlock();
+      }
+      else {
+        current->setThreadIoWaiting();
+        threadYieldHoldingLock(current->getLock());
+      }
+    }
+    else {
+      removeInflight(coreid);
+    }
+
+    *result = req->result;
+    if(req != &stackreq) {
+      FREE_SHARED(req);
+    }
+
+    // The buffer is not mapped in the helpers either.
+    return submitted && !(mode == MODE_HELPERS && *result == -EFAULT);
+  }
+
+  // Whether some requests of the core are not reaped yet, only a hint without locks.
+  bool hasInflight(int coreid) {
+    return cores != NULL && cores[coreid].inflight != 0;
+  }
+
+  // Wake up the threads whose requests are done. It is called by the scheduler of the core.
+  void reap(int coreid) {
+    aiocore * entry = &cores[coreid];
+    struct lnode head;
+    lnode * node;
+
+#ifdef XAIO_URING
+    if(ring.core == coreid && ring.fd >= 0) {
+      reapRing();
+    }
+#endif
+
+    if(isListEmpty(&entry->completed)) {
+      return;
+    }
+
+    listInit(&head);
+    entry->lock.acquire();
+    if(!isListEmpty(&entry->completed)) {
+      listRetrieveAllItems(&head, &entry->completed);
+    }
+    entry->lock.release();
+
+    while((node = listRetrieveItem(&head)) != NULL) {
+      aioreq * req = container_of(node, aioreq, node);
+      complete(req, req->result);
+    }
+  }
+
+private:
+  void addInflight(int coreid) {
+    xatomic::increment(&cores[coreid].inflight);
+    processmap::getInstance().getPoller(coreid)->addWaiter();
+  }
+
+  void removeInflight(int coreid) {
+    processmap::getInstance().getPoller(coreid)->removeWaiter();
+    xatomic::decrement(&cores[coreid].inflight);
+  }
+
+  // The request is done. It is on the stack of the thread, which may
+  // run as soon as the thread lock is released.
+  void complete(aioreq * req, long result) {
+    xthread * thread = req->thread;
+    int coreid = req->core;
+    bool wakeup = false;
+
+    req->result = result;
+
+    thread->lock();
+    req->done = true;
+    if(thread->status == THREAD_STATUS_IO_WAITING) {
+      thread->setThreadRunning();
+      wakeup = true;
+    }
+    thread->unlock();
+
+    removeInflight(coreid);
+
+    if(wakeup) {
+      threadMakeRunnable(thread);
+    }
+  }
+
+  bool submitHelper(aioreq * req) {
+    queue->lock.acquire();
+    listInsertTail(&req->node, &queue->requests);
+    queue->pending++;
+    queue->lock.release();
+
+    // Since the futex is in a MAP_SHARED area, we can't use FUTEX_PRIVATE_FLAG.
+    syscall(SYS_futex, &queue->pending, FUTEX_WAKE, 1, NULL, NULL, 0);
+    return true;
+  }
+
+  static int helperEntry(void * arg) {
+    xaio::getInstance().serveRequests();
+    return 0;
+  }
+
+  // Main loop of a helper, which may run on any allowed CPU.
+  void serveRequests(void) {
+    cpu_set_t cpuset;
+
+    CPU_ZERO(&cpuset);
+    for(int i = 0; i < MAX_CORES; i++) {
+      CPU_SET(xcpus::getInstance().getCpu(i), &cpuset);
+    }
+    sched_setaffinity(0, sizeof(cpuset), &cpuset);
+
+    for(;;) {
+      aioreq * req = NULL;
+      lnode * node;
+      long ret;
+
+      queue->lock.acquire();
+      if((node = listRetrieveItem(&queue->requests)) != NULL) {
+        req = container_of(node, aioreq, node);
+        queue->pending--;
+      }
+      queue->lock.release();
+
+      if(req == NULL) {
+        syscall(SYS_futex, &queue->pending, FUTEX_WAIT, 0, NULL, NULL, 0);
+        continue;
+      }
+
+      if(req->op == AIO_READ) {
+        ret = (req->offset < 0) ? WRAP(read)(req->fd, req->buf, req->count)
+                                : WRAP(pread)(req->fd, req->buf, req->count, (off_t)req->offset);
+      }
+      else {
+        ret = (req->offset < 0) ? WRAP(write)(req->fd, req->buf, req->count)
+                                : WRAP(pwrite)(req->fd, req->buf, req->count, (off_t)req->offset);
+      }
+
+      req->result = (ret < 0) ? -errno : ret;
+      handOver(req);
+    }
+  }
+
+  // Give a finished request to the scheduler of its core.
+  void handOver(aioreq * req) {
+    aiocore * entry = &cores[req->core];
+    unsigned long long value = 1;
+    int wakefd = processmap::getInstance().getPoller(req->core)->getWakeFd();
+
+    entry->lock.acquire();
+    listInsertTail(&req->node, &entry->completed);
+    entry->lock.release();
+
+    WRAP(write)(wakefd, &value, sizeof(value));
+  }
+
+#ifdef XAIO_URING
+  // Whether io_uring can read and write at the current position of files.
+  static bool probeRing(void) {
+    struct io_uring_params params;
+    int fd;
+
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, 1, &params);
+    if(fd < 0) {
+      return false;
+    }
+
+    WRAP(close)(fd);
+    return (params.features & URING_FEAT_RW_CUR_POS) != 0;
+  }
+
+  // Set up the ring of current process, which is serving the core.
+  bool attachRing(int coreid) {
+    struct io_uring_params params;
+    int wakefd = processmap::getInstance().getPoller(coreid)->getWakeFd();
+    int fd;
+
+    // The ring of the parent process. Its fd is shared, so it must not be closed.
+    if(ring.sqptr != NULL) {
+      unmapRing();
+    }
+
+    ring.core = coreid;
+    ring.fd = -1;
+
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if(fd < 0) {
+      PRWRN("can't set up io_uring for core %d, files are accessed directly\n", coreid);
+      return false;
+    }
+
+    ring.sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqesize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+      if(ring.cqsize > ring.sqsize) {
+        ring.sqsize = ring.cqsize;
+      }
+      ring.cqsize = ring.sqsize;
+    }
+
+    ring.sqptr = WRAP(mmap)(NULL, ring.sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            fd, IORING_OFF_SQ_RING);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+      ring.cqptr = ring.sqptr;
+    }
+    else {
+      ring.cqptr = WRAP(mmap)(NULL, ring.cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              fd, IORING_OFF_CQ_RING);
+    }
+    ring.sqes = (struct io_uring_sqe *)WRAP(mmap)(NULL, ring.sqesize, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if(ring.sqptr == MAP_FAILED || ring.cqptr == MAP_FAILED || ring.sqes == MAP_FAILED
+       || syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &wakefd, 1) != 0) {
+      PRWRN("can't map io_uring for core %d, files are accessed directly\n", coreid);
+      WRAP(close)(fd);
+      memset(&ring, 0, sizeof(ring));
+      ring.core = coreid;
+      ring.fd = -1;
+      return false;
+    }
+
+    ring.sqhead = (unsigned *)((intptr_t)ring.sqptr + params.sq_off.head);
+    ring.sqtail = (unsigned *)((intptr_t)ring.sqptr + params.sq_off.tail);
+    ring.sqmask = (unsigned *)((intptr_t)ring.sqptr + params.sq_off.ring_mask);
+    ring.sqarray = (unsigned *)((intptr_t)ring.sqptr + params.sq_off.array);
+    ring.cqhead = (unsigned *)((intptr_t)ring.cqptr + params.cq_off.head);
+    ring.cqtail = (unsigned *)((intptr_t)ring.cqptr + params.cq_off.tail);
+    ring.cqmask = (unsigned *)((intptr_t)ring.cqptr + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((intptr_t)ring.cqptr + params.cq_off.cqes);
+    ring.fd = fd;
+    return true;
+  }
+
+  void unmapRing(void) {
+    WRAP(munmap)(ring.sqes, ring.sqesize);
+    if(ring.cqptr != ring.sqptr) {
+      WRAP(munmap)(ring.cqptr, ring.cqsize);
+    }
+    WRAP(munmap)(ring.sqptr, ring.sqsize);
+    memset(&ring, 0, sizeof(ring));
+  }
+
+  // Return false if the ring is full or not available.
+  bool submitRing(aioreq * req, int coreid) {
+    struct io_uring_sqe * sqe;
+    unsigned tail, index;
+
+    if(ring.core != coreid && !attachRing(coreid)) {
+      return false;
+    }
+
+    if(ring.fd < 0) {
+      return false;
+    }
+
+    tail = *ring.sqtail;
+    if(tail - *(volatile unsigned *)ring.sqhead >= RING_ENTRIES) {
+      return false;
+    }
+
+    index = tail & *ring.sqmask;
+    sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (req->op == AIO_READ) ? URING_OP_READ : URING_OP_WRITE;
+    sqe->fd = req->fd;
+    sqe->addr = (unsigned long)req->buf;
+    sqe->len = req->count;
+    sqe->off = (unsigned long long)req->offset;
+    sqe->user_data = (unsigned long)req;
+    ring.sqarray[index] = index;
+
+    // The entry must be visible before the tail.
+    xatomic::compilerBarrier();
+    *(volatile unsigned *)ring.sqtail = tail + 1;
+
+    enterRing();
+    return true;
+  }
+
+  // Submit the entries that the kernel hasn't taken yet.
+  void enterRing(void) {
+    unsigned pending = *(volatile unsigned *)ring.sqtail - *(volatile unsigned *)ring.sqhead;
+
+    // Others are taken again when the next request is submitted or reaped.
+    while(pending > 0 && syscall(__NR_io_uring_enter, ring.fd, pending, 0, 0, NULL, 0) < 0
+          && errno == EINTR) {
+      ;
+    }
+  }
+
+  void reapRing(void) {
+    unsigned head = *ring.cqhead;
+    unsigned tail = *(volatile unsigned *)ring.cqtail;
+
+    // Entries must be read after the tail.
+    xatomic::compilerBarrier();
+
+    while(head != tail) {
+      struct io_uring_cqe * cqe = &ring.cqes[head & *ring.cqmask];
+      aioreq * req = (aioreq *)(unsigned long)cqe->user_data;
+      long result = cqe->res;
+
+      head++;
+      complete(req, result);
+    }
+
+    xatomic::compilerBarrier();
+    *(volatile unsigned *)ring.cqhead = head;
+
+    if(*(volatile unsigned *)ring.sqtail != *(volatile unsigned *)ring.sqhead) {
+      enterRing();
+    }
+  }
+#else
+  static bool probeRing(void) {
+    return false;
+  }
+
+  bool submitRing(aioreq * req, int coreid) {
+    return false;
+  }
+#endif
+
+  int mode;
+  aiocore * cores;
+  aioqueue * queue;
+  pid_t * helpers;
+
+#ifdef XAIO_URING
+  aioring ring;
+#endif
+};
+
+#endif /* _XAIO_H_ */
@@ -94,6 +94,7 @@ static inline unsigned long __cmpxchg(volatile void *ptr, unsigned long old,
            : "=a"(prev)
            : "r"(newval), "m"(*__xg(ptr)), "0"(old)
            : "memory");
+    return prev;
   case 8:
     asm volatile("cmpxchgq %1,%2"
            : "=a"(prev)
@@ -149,6 +150,14 @@ public:
         : : "memory");
   }
 
+  // Atomic add i and return the original value.
+  static inline int add_and_return(int i, volatile unsigned long * obj) {
+    asm volatile("lock; xaddl %0, %1"
+        : "+r" (i), "+m" (*obj)
+        : : "memory");
+    return i;
+  }
+
   static inline void add(int i, volatile unsigned long * obj) {
     asm volatile("lock; addl %0, %1"
         : "+r" (i), "+m" (*obj)
@@ -210,6 +219,11 @@ public:
     __asm__ __volatile__ ("mfence": : :"memory");
   }
 
+  // Only stop the compiler from reordering memory accesses.
+  static inline void compilerBarrier(void) {
+    asm volatile("": : :"memory");
+  }
+
   static inline void cpuRelax(void) {
     asm volatile("pause\n": : :"memory");
   }
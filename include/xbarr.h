@@ -19,108 +19,260 @@
 
 */
 
+
 /*
  * @file:   xbarr.h
- * @brief:  The file to handle the barrier. 
+ * @brief:  The barrier, a two-level combining tree. Every core is a leaf, which
+ *          keeps the threads waiting on it, and the root counts all arrivals
+ *          with one atomic add. The lock of a leaf is only taken by threads of
+ *          the same core and by the releaser, so arrivals on different cores
+ *          never wait for each other.
+ *
+ *          Arriving and waiting are split, see proto.h: a thread arrives for
+ *          the current phase, and later waits until that phase completes.
+ *          pthread_barrier_wait does both at once. The last arriver is the serial
+ *          thread of POSIX. It resets the counter, starts the next phase, and
+ *          then takes the waiters of the finished phase from every leaf and hands
+ *          each batch to the queues of that core at once, so that they run
+ *          where they stopped, and the schedulers don't fight over one queue.
+ *          Unbound waiters go to its affinity queue, which idle schedulers
+ *          steal from, bound ones to its private queue.
+ *          Threads may arrive for the next phase before all waiters of this one
+ *          are woken up, so every leaf has a waitlist for each parity of phases.
+ *          A latch is a barrier which is counted down by any number at a time,
+ *          and only its first phase is waited for.
+ *
+ *          The leaves don't fit into an entry of xsynctable, they are allocated
+ *          from the shared heap when the barrier is initialized, like xrwlock.h.
  * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
  */
 
 #ifndef _XBARR_H_
 #define _XBARR_H_
 
+#include <new>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "xdefines.h"
+#include "xcpus.h"
+#include "xatomic.h"
+#include "spinlock.h"
+#include "list.h"
+#include "xthread.h"
+#include "xscheduler.h"
+#include "processmap.h"
+#include "memwrapper.h"
+
 class xbarr{
 
-  enum { MAGIC = 0xCAFEBABE };
+  // Threads waiting on one core, for the even and the odd phases.
+  class leaf {
+  public:
+    spinlock lock;
+    struct lnode waitlist[2];
+    char padding[64 - sizeof(spinlock) - 2 * sizeof(struct lnode)];
+  };
+
+  class barrstate {
+  public:
+    volatile unsigned long arrived;
+    volatile unsigned long phase;
+    unsigned long count;
+    int cores;
+
+    // Arrivals of a latch are never reset, see release.
+    bool latch;
+    char padding[64];
+
+    leaf leaves[0];
+  };
 
 public:
   xbarr() {}
 
-  void barrInit(unsigned count) {
-    // Initialize the waitlist.
-    listInit(&waitlist);
- 
-    // Initialize the spinlock.
-    lck.init();
+  int barrInit(unsigned count) {
+    if(count == 0) {
+      return EINVAL;
+    }
 
-    maxthreads = count;
-    waiters = 0;
+    init(count, false);
+    return 0;
   }
 
-  // barrier wait
-  void barrWait(xthread * current, xqueue * queue) {
-    lock();
+  // A latch of count 0 is open at once, its first phase has completed.
+  int latchInit(unsigned count) {
+    init(count, true);
+    if(count == 0) {
+      state->phase = 1;
+    }
+    return 0;
+  }
 
-    waiters++;
-  
-    // check whether we have enough waiters. 
-    if(waiters >= maxthreads) {
-      struct lnode head;
-      bool toEnqueue = false;
-
-      // If maxthreads is 1, then there
-      // is no need to check the waitlist.    
-      if(maxthreads > 1) {
-        listRetrieveAllItems(&head, &waitlist);        
- 
-        toEnqueue = true;
-      }
-        
-      // Now waiters is 0.
-      waiters = 0;
-
-      unlock();
-      
-      // FIXME: add all items into the global shared queue
-      // however, it is not efficient on cache usage since it is better to 
-      // put the thread back the orignal process 
-      if(toEnqueue) {
-//        fprintf(stderr, "%d: Barrier wait, release all threads %d\n", getpid(), maxthreads-1);
-        queue->enqueueAllList(&head);
-      }
-    } else {
-      // Put myself into the waitlist.
-      enqueueWaitlist(current);
+  // Return PTHREAD_BARRIER_SERIAL_THREAD to the last arriver, and 0 to others.
+  int barrWait(xthread * current, int coreid) {
+    unsigned long phase;
+    int ret;
+
+    ret = barrArrive(1, &phase);
+    if(ret == 0) {
+      barrAwait(current, coreid, phase);
+    }
+    return ret;
+  }
+
+  // Count "arrivals" for the current phase without waiting, and save the phase
+  // in "phase". Return PTHREAD_BARRIER_SERIAL_THREAD if the phase is completed by us.
+  // A thread must not arrive again before the phase that it arrived for completes.
+  int barrArrive(unsigned arrivals, unsigned long * phase) {
+    unsigned long before;
+
+    if(state == NULL || arrivals == 0) {
+      return EINVAL;
+    }
+
+    // The phase can't complete without us, so it is the one we arrive for.
+    *phase = state->phase;
+    before = (unsigned long)xatomic::add_and_return(arrivals, &state->arrived);
+
+    // Only a latch is counted down by more than one. Counting it down past
+    // zero does nothing, since its arrivals are never reset.
+    if(before < state->count && before + arrivals >= state->count) {
+      release(*phase);
+      return PTHREAD_BARRIER_SERIAL_THREAD;
+    }
+    return 0;
+  }
+
+  // Park until the specified phase completes.
+  int barrAwait(xthread * current, int coreid, unsigned long phase) {
+    leaf * node;
+
+    if(state == NULL) {
+      return EINVAL;
+    }
 
-      // Yielding to scheduler while holding lock.
-      threadYieldHoldingLock(getLock());
+    node = &state->leaves[coreid];
+    node->lock.acquire();
+
+    // The releaser starts the next phase before it takes our leaf lock.
+    if(state->phase != phase) {
+      node->lock.release();
+      return 0;
     }
 
-    return;
+    current->setThreadBarrierWaiting();
+    listInsertTail(&current->toqueue, &node->waitlist[phase & 1]);
+
+    // Yielding to scheduler while holding lock.
+    threadYieldHoldingLock(&node->lock);
+    return 0;
+  }
+
+  // Whether the specified phase has completed.
+  bool barrIsDone(unsigned long phase) {
+    return state != NULL && state->phase != phase;
   }
 
-  // FIXME: if someone is waiting here, complainning it. 
   void barrDestroy(void) {
-    if(waiters > 0) {
-      PRERR("Some one is waiting on barrier when detroying????\n");
-      assert(waiters == 0);
-    } 
+    if(state == NULL) {
+      return;
+    }
+
+    for(int i = 0; i < state->cores; i++) {
+      if(!isListEmpty(&state->leaves[i].waitlist[0]) || !isListEmpty(&state->leaves[i].waitlist[1])) {
+        PRERR("Some one is waiting on barrier when detroying????\n");
+        break;
+      }
+    }
+
+    FREE_SHARED(state);
+    state = NULL;
   }
   
 private:
-  // Put a thread to the waiting list of current lock
-  // Note: lock must be held to call this function
-  inline void enqueueWaitlist(xthread * current) {
-    listInsertTail(&current->toqueue, &waitlist);
-  }
+  void init(unsigned count, bool latch) {
+    int cores = PROCESS_SLOTS;
+    size_t size = sizeof(barrstate) + cores * sizeof(leaf);
 
-  void lock(void) {
-    lck.acquire();
+    state = (barrstate *)MALLOC_SHARED(size);
+    memset((void *)state, 0, size);
+    for(int i = 0; i < cores; i++) {
+      new (&state->leaves[i].lock) spinlock;
+      listInit(&state->leaves[i].waitlist[0]);
+      listInit(&state->leaves[i].waitlist[1]);
+    }
+    state->count = count;
+    state->cores = cores;
+    state->latch = latch;
   }
 
-  void unlock(void) {
-    lck.release();
-  }
+  // Start the next phase, and wake up all waiters of this one, leaf by leaf.
+  void release(unsigned long phase) {
+    processmap & procmap = processmap::getInstance();
 
-  spinlock * getLock(void) {
-    return &lck;
+    // Nobody can arrive for the next phase until it starts.
+    // A latch has only one phase.
+    if(!state->latch) {
+      state->arrived = 0;
+    }
+    xatomic::compilerBarrier();
+    state->phase = phase + 1;
+
+    for(int i = 0; i < state->cores; i++) {
+      leaf * node = &state->leaves[i];
+      struct lnode waiters;
+      struct lnode bound;
+      struct lnode batch;
+      lnode * entry;
+      int batched = 0;
+
+      // A waiter may have seen the last phase and not be on the list yet,
+      // so the list can't be checked without the lock.
+      listInit(&waiters);
+      node->lock.acquire();
+      if(!isListEmpty(&node->waitlist[phase & 1])) {
+        listRetrieveAllItems(&waiters, &node->waitlist[phase & 1]);
+      }
+      node->lock.release();
+
+      // Bound threads go to their own cores. Others go to the affinity queue
+      // of this core, where idle schedulers can steal them.
+      listInit(&bound);
+      listInit(&batch);
+      while((entry = listRetrieveItem(&waiters)) != NULL) {
+        xthread * thread = container_of(entry, xthread, toqueue);
+
+        thread->setThreadRunning();
+        if(!thread->isBounded()) {
+          listInsertTail(entry, &batch);
+          batched++;
+        }
+        else if(thread->getBoundCore() == i) {
+          listInsertTail(entry, &bound);
+        }
+        else {
+          threadMakeRunnable(thread);
+        }
+      }
+
+      if(!isListEmpty(&bound)) {
+        procmap.getPQueue(i)->enqueueAllList(&bound);
+      }
+
+      // The owner runs one of them at a time, a sleeping scheduler may take others.
+      if(batched > 0) {
+        procmap.getAQueue(i)->enqueueAllList(&batch);
+        if(batched > 1) {
+          schedulerWakeupAny();
+        }
+      }
+    }
   }
 
-private:
-  spinlock lck;     // spin lock used to 
-  struct lnode   waitlist;
-  unsigned int   maxthreads;
-  unsigned int   waiters; // How many waiters are waiting on this barrier.
- // bool             arrivalphase;
+  // It must fit into an entry of xsynctable, see libproto.cpp.
+  barrstate * state;
 };
 
 #endif /* _ */
@@ -28,6 +28,8 @@
 #ifndef _XCONDVAR_H_
 #define _XCONDVAR_H_
 
+#include "xmutex.h"
+
 class xcondvar{
   enum { MAGIC = 0xCAFEBABE };
 
@@ -37,17 +39,10 @@ public:
 
   // initialize the conditional variable.
   void condInit(void) {
-    // Initialize the waitlist.
-    listInit(&waitlist);
- 
     // Initialize the spinlock.
     lck.init();
 
-    // save some information
-    //waiters = 0;
-    mutex = NULL;
- 
-    setInited();
+    setup();
   }
 
   /* 
@@ -60,14 +55,17 @@ public:
     
      Upon  successful  return,  the  mutex shall have been locked and shall be owned 
      by the  calling thread.
+
+     If a deadline (CLOCK_MONOTONIC in nanoseconds) is given and it expires first, 
+     ETIMEDOUT is returned, and the mutex is locked too, see condTimeout.
    */
-  void condWait(pthread_mutex_t *mx, xthread * current) {
+  int condWait(xmutex * mx, xthread * current, unsigned long long deadline = 0) {
     // Acquire the spin lock
     lock();
 
     // Check whether the cond var has been initialized or not.
     if(!isInited()) {
-      condInit();
+      setup();
     } 
 
     // Whether we are using the same mutex. Complaining if not, it is
@@ -85,74 +83,113 @@ public:
     // Put current thread into the waiting list.
     enqueueWaitlist(current);
 
+    if(deadline != 0) {
+      threadArmTimer(current, TIMER_COND, this, deadline);
+    }
+
     // Release the user mutex
     //fprintf(stderr, "releasing mutex:%p related with condvar %p\n", mx, &lck); 
-    pthread_mutex_unlock(mx);
+    mx->mutexUnlock(current);
     //PRWRN("releasing current mutex"); 
    
     // Yielding so other threads can proceed
     threadYieldHoldingLock(getLock());
 
-    //fprintf(stderr, "acquiring current mutex:%p\n", mx); 
-    // Grab the lock before return.
-    pthread_mutex_lock(mx);
+    // We are moved onto the waitlist of the mutex when we are woken up,
+    // and the mutex has been handed to us. See xmutex::mutexRequeue.
+    if(deadline != 0 && threadCancelTimer(current)) {
+      return ETIMEDOUT;
+    }
+    return 0;
+  }
+
+  // The timer of a waiter has expired. If it is still waiting in the same wait, 
+  // move it onto the waitlist of the mutex, like condSignal.
+  void condTimeout(xthread * thread, unsigned long seq) {
+    struct lnode head;
+    xmutex * mx = NULL;
+
+    listInit(&head);
+
+    lock();
+    if(thread->timer.seq == seq && thread->status == THREAD_STATUS_COND_WAITING) {
+      listRemoveNode(&thread->toqueue);
+      thread->setThreadLockWaiting();
+      thread->timer.timedout = true;
+      listInsertTail(&thread->toqueue, &head);
+      mx = getMutex();
+    }
+    unlock();
+
+    if(mx) {
+      mx->mutexRequeue(&head);
+    }
   }
 
   // Simply wakeup one of waiters.
-  void condSignal(xthread * current, xqueue *queue) {
-    xthread * thread = NULL;
-      
+  void condSignal(xthread * current) {
+    struct lnode head;
+    xmutex * mx = NULL;
+
+    listInit(&head);
+
     lock();
 
+    // Someone may signal before anyone waits.
+    if(!isInited()) {
+      setup();
+    }
+
     // Check the waiters;
     if(hasWaiters()) {
       // dequeue the first item
-      thread = dequeueWaitlist(); 
+      listInsertTail(&dequeueWaitlist()->toqueue, &head); 
+      mx = getMutex();
     }
 
     unlock();
 
-    // Enqueue the thread after unlock() to avoid possible deadlock
-    // The corresponding queue have locks to avoid contention
-    if(thread) {
-      // Put the waiter into the corresponding pqueue
-      // Note: donot put it into the shared queue since normally
-      // current process will own this page.
-      // We can possibly improve the performance by doing so.
-      queue->enqueue(thread);
+    // Requeue the thread after unlock() to avoid possible deadlock
+    if(mx) {
+      mx->mutexRequeue(&head);
     }
 
     return;
   }
 
-  // Wakeup all waiters. Can we put all waiters into 
-  // our current queue? Whether it is too crowded?
-  // Currently, let's do this at first
-  void condBroadcast(xthread * current, xqueue *queue) {
-    bool insertWaiter = false;
+  // Wakeup all waiters. Only one of them can get the mutex, so we move them
+  // all onto the waitlist of the mutex. Then the mutex is handed from one to
+  // another, and only one of them is runnable at a time.
+  void condBroadcast(xthread * current) {
     struct lnode head;
+    xmutex * mx = NULL;
 
     lock();
 
+    if(!isInited()) {
+      setup();
+    }
+
     // Check how many waiters here
     if(hasWaiters()) {
-      // Move queue completely, we simply get the
-      // the first item and the last item of the waiting list.
-      head.prev = waitlist.prev;
-      head.next = waitlist.next;
-  
-      // Initialize the waitlist, now it is empty.
-      listInit(&waitlist);
-      
-      insertWaiter = true;
+      lnode * node;
+
+      // They are not waiting on us any more, see condTimeout.
+      for(node = waitlist.next; node != &waitlist; node = node->next) {
+        container_of(node, xthread, toqueue)->setThreadLockWaiting();
+      }
+
+      // Move queue completely, the waitlist is 
+      // re-initialized and it is empty now.
+      listRetrieveAllItems(&head, &waitlist);
+      mx = getMutex();
       assert(hasWaiters() != true);
     }
 
     unlock();
 
-    if(insertWaiter) {
-      // Add all items into the specified queue 
-      queue->enqueueAllList(&head);
+    if(mx) {
+      mx->mutexRequeue(&head);
     }
   }
 
@@ -168,6 +205,17 @@ public:
   }
 
 private:
+  void setup(void) {
+    // Initialize the waitlist.
+    listInit(&waitlist);
+
+    // save some information
+    //waiters = 0;
+    mutex = NULL;
+ 
+    setInited();
+  }
+
   // Set this mutex to inited status.
   inline void setInited(void) {
     init = MAGIC;
@@ -202,7 +250,8 @@ private:
  
     xthread * thread = container_of(node, xthread, toqueue);
   //  waiters--;
-   // thread->setThreadLockRunning();
+    // It is not waiting on us any more, see condTimeout.
+    thread->setThreadLockWaiting();
     return thread;
   }
 
@@ -210,6 +259,18 @@ private:
     return !isListEmpty(&waitlist); 
   }
 
+  // The mutex of the waiters that are just taken off the waitlist.
+  // Another mutex can be used once nobody is waiting.
+  // Note: lock must be held to call this function
+  inline xmutex * getMutex(void) {
+    xmutex * mx = mutex;
+
+    if(!hasWaiters()) {
+      mutex = NULL;
+    }
+    return mx;
+  }
+
 private:
   void lock(void) {
     lck.acquire();
@@ -226,7 +287,7 @@ private:
   spinlock lck;
  // int  waiters;    // How many waiters on this lock
   struct lnode  waitlist;
-  void * mutex;
+  xmutex * mutex;
   int    init;
 };
 
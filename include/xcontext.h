@@ -22,12 +22,16 @@
 /*
  * @file:   xcontext.h
  * @brief:  Thread context. 
+ *          Normally a context is saved by the routines in xcontext.cpp, which
+ *          only keeps the callee-saved registers on the stack. The ucontext_t
+ *          is only used when the signal handler has to save a trapped thread.
  * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
  */
 #ifndef XCONTEXTH
 #define XCONTEXTH
 
 #include <ucontext.h>
+#include <signal.h>
 
 #include "xdefines.h"
 #include "xatomic.h"
@@ -38,6 +42,14 @@ extern "C" {
   typedef void * (threadFunction)(void *);
 
   void threadRunning(void * func, void * arg);
+
+  // Implemented in xcontext.cpp. 
+  void proto_context_switch(void ** oldsp, void * newsp);
+  void proto_context_load(void * newsp);
+  void proto_context_save_call(void ** oldsp, void (*func)(void *), void * arg);
+  void proto_context_restore(void);
+  void proto_context_start(void);
+  void proto_context_resume(void * context);
 };
 
 // Swapcontext
@@ -48,44 +60,36 @@ public:
   void * stackbottom;
   int    stacksize;
    
-  // User context
+  // Saved stack pointer, the registers are on the stack.
+  void * sp;
+
+  // Whether the thread is saved in "context" by the signal handler.
+  bool trapped;
+
+  // Signal mask, only used by switchToWithSigmask().
+  sigset_t sigmask;
+
+  // User context saved in the signal handler.
   ucontext_t context;
   
   // Task status
   e_thread_status status;
 
   xcontext() {
-    // get context for current program
-    // This step is necessary before you try to makecontext
-    // Otherwise, some register will failed to be initialized.
-    getcontext(&context);
-
-    stacksize = xdefines::STACK_SIZE;
-
-    // Create the stack for this task.
-    stack = MALLOC_SHARED(stacksize);
-    stackbottom = (void *)((intptr_t)stack + stacksize);   
- 
-    //fprintf(stderr, "%d: stack %p ~ 0x%x\n", getpid(), stack, stackbottom);
-
-    // Cleanup the stack
-    memset(stack, 0, stacksize);
-
-    //PRDBG("%d: stack %p ~ 0x%x after memset\n",  getpid(), stack, stackbottom);
-    // Set context for this thread. 
-    context.uc_link = 0;
-    context.uc_stack.ss_sp = stack;
-    context.uc_stack.ss_size = stacksize;
-    context.uc_stack.ss_flags = 0;
-  }
-
-  ~xcontext() {
-    // Free the memory for the stack.
-    FREE_SHARED(stack);
+    sp = NULL;
+    trapped = false;
+    sigprocmask(SIG_SETMASK, NULL, &sigmask);
+
+    // The stack is given by the thread pool, see xthreadpool.h.
+    stack = NULL;
+    stackbottom = NULL;
+    stacksize = 0;
   }
 
-  void freeStack(void) {
-    FREE_SHARED(stack);
+  void setStack(void * start, int size) {
+    stack = start;
+    stacksize = size;
+    stackbottom = (void *)((intptr_t)stack + stacksize);   
   }
 
   // FIXME: we have to try to create the a new context.
@@ -98,40 +102,90 @@ public:
     }
 #endif
     // We will set to thread::
-    makecontext(&context, (void(*)(void))wrapFunc, 2, threadFunc, arg);
-    //makecontext( &context, (void(*)(void))func, 1, arg);
+    sp = makeFrame(stackbottom, wrapFunc, threadFunc, arg);
+    trapped = false;
   }
 
-  void getContext(void) {
-    getcontext(&context);
+  // Build an initial frame at the stack bottom, so that the first switch to 
+  // it will call func(arg1, arg2) through proto_context_start. 
+  // Return the stack pointer of the frame.
+  static void * makeFrame(void * stackbottom, void * func, void * arg1, void * arg2) {
+    unsigned long * frame = (unsigned long *)(((intptr_t)stackbottom & ~15L) - 16);
+ 
+    *(--frame) = (unsigned long)&proto_context_start;
+    *(--frame) = 0; // ebp/rbp
+#if defined(__i386__)
+    *(--frame) = (unsigned long)func;  // ebx
+    *(--frame) = (unsigned long)arg1;  // esi
+    *(--frame) = (unsigned long)arg2;  // edi
+#else
+    *(--frame) = 0;                    // rbx
+    *(--frame) = (unsigned long)func;  // r12
+    *(--frame) = (unsigned long)arg1;  // r13
+    *(--frame) = (unsigned long)arg2;  // r14
+    *(--frame) = 0;                    // r15
+#endif
+    // Default x87 control word and MXCSR.
+    frame = (unsigned long *)((intptr_t)frame - 8);
+    ((unsigned int *)frame)[0] = 0x1f80;
+    ((unsigned int *)frame)[1] = 0x037f;
+
+    return frame;
+  }
+
+  // Switch from this context to the next one. It returns when someone 
+  // switches back to this context.
+  void switchTo(xcontext * next) {
+    if(next->trapped) {
+      // setcontext will restore the signal mask of the trapped thread.
+      next->trapped = false;
+      proto_context_save_call(&sp, &proto_context_resume, &next->context);
+    }
+    else {
+      proto_context_switch(&sp, next->sp);
+    }
+  }
+
+  // The same as switchTo(), but the signal mask is switched too, just like swapcontext.
+  // Both sides must be switched out by this function.
+  void switchToWithSigmask(xcontext * next) {
+    sigprocmask(SIG_SETMASK, &next->sigmask, &sigmask);
+    switchTo(next);
   }
 
+  // Run this context and never return.
   void setContext(void) {
-    
-    setcontext(&context);
+    if(trapped) {
+      trapped = false;
+      proto_context_resume(&context);
+    }
+    else {
+      proto_context_load(sp);
+    }
     assert(0); 
   }
 
+  // The thread is trapped, save the signal context.
   void switchContext(void * newcontext) {
     memcpy(&context, newcontext, sizeof(ucontext_t));
+    trapped = true;
+  }
+
+  // Let the signal handler return to the specified context, instead of the trapped one.
+  static void redirectSignalContext(ucontext_t * sigcontext, xcontext * next) {
+    assert(!next->trapped);
+    sigcontext->uc_mcontext.gregs[REG_ESP] = (long)next->sp;
+    sigcontext->uc_mcontext.gregs[REG_EIP] = (long)&proto_context_restore;
   }
 
   // Reset all stack related field.
+  // Only the initial thread calls this, which has no stack from the thread pool.
   void resetStack(void * newstack, int size) {
-    void * oldstack = stack;
-    
-    stacksize = size;
+    setStack(newstack, size);
+  }
 
-    // Reset the stack for this task.
-    stack = newstack;
-    stackbottom = (void *)((intptr_t)stack + stacksize);   
- 
-    // Set context for this thread. 
-    context.uc_stack.ss_sp = stack;
-    context.uc_stack.ss_size = stacksize;
-    
-    // Free the old stack.
-    FREE_SHARED(oldstack);
+  bool isOnStack(void * addr) {
+    return ((intptr_t)addr >= (intptr_t)stack) && ((intptr_t)addr < (intptr_t)stackbottom);
   }
 
   void * getStackBottom(void) {
@@ -139,8 +193,8 @@ public:
   }
 
   void checkStack(void) {
-    int esp = context.uc_mcontext.gregs [REG_EBP];
-    if(esp < (int)((intptr_t)stack)) {
+    intptr_t esp = (intptr_t)sp;
+    if(esp < (intptr_t)stack) {
       PRERR("thread %d: esp %x stack %pStack is overflowed!!!!!!\n", pthread_self(), esp, stack);
       PRERR("Stack is overflowed!!!!!!\n");
       abort();
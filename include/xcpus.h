@@ -0,0 +1,179 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xcpus.h
+ * @brief:  Detect the cores that we can use at startup.
+ *          The number of cores is the minimum of:
+ *          (1) the CPUs in our affinity mask (sched_getaffinity),
+ *          (2) the CPU quota of our cgroup, rounded up (cgroup v2 cpu.max or
+ *              v1 cpu.cfs_quota_us/cpu.cfs_period_us),
+ *          (3) MAX_CORES.
+ *          The PROTO_CPUS environment variable overrides (1) and (2).
+ *          Spare processes are not bound to any core, they only use the slots
+ *          after the cores. So there are never more spares than slots left.
+ *          Core i is bound to the i-th allowed CPU ID, wrapping around if
+ *          there are more cores than allowed CPUs.
+ *          Like other singletons, it lives in the library globals. It is detected
+ *          by the initial process, and children processes inherit the result.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XCPUS_H_
+#define _XCPUS_H_
+
+#include <new>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "xdefines.h"
+
+class xcpus {
+public:
+  xcpus() {
+    detect();
+  }
+
+  static xcpus& getInstance (void) {
+    static char buf[sizeof(xcpus)];
+    static xcpus * theOneTrueObject = new (buf) xcpus();
+    return *theOneTrueObject;
+  }
+
+  // How many cores (processes) we are going to use.
+  int getCores(void) {
+    return cores;
+  }
+
+  // How many spare processes we are going to use.
+  int getSpares(void) {
+    return spares;
+  }
+
+  // The actual CPU id of specified core.
+  int getCpu(int coreid) {
+    return cpus[coreid % allowed];
+  }
+
+private:
+  void detect(void) {
+    cpu_set_t cpuset;
+    char * env;
+    int quota;
+
+    // Get all CPUs that we can run on.
+    allowed = 0;
+    if(sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+      for(int i = 0; i < CPU_SETSIZE && allowed < MAX_CORES; i++) {
+        if(CPU_ISSET(i, &cpuset)) {
+          cpus[allowed++] = i;
+        }
+      }
+    }
+
+    if(allowed == 0) {
+      PRWRN("can't get the affinity mask, use CPU 0 only\n");
+      cpus[0] = 0;
+      allowed = 1;
+    }
+
+    cores = allowed;
+
+    // The container may have less CPU time than the CPUs it can see.
+    quota = getCgroupQuota();
+    if(quota > 0 && quota < cores) {
+      cores = quota;
+    }
+
+    // The environment variable has the final word.
+    env = getenv("PROTO_CPUS");
+    if(env && atoi(env) > 0) {
+      cores = atoi(env);
+    }
+
+    if(cores > MAX_CORES) {
+      cores = MAX_CORES;
+    }
+
+    env = getenv("PROTO_SPARES");
+    spares = (env && atoi(env) >= 0) ? atoi(env) : xdefines::SYSCALL_SPARES;
+    if(spares > MAX_CORES - cores) {
+      spares = MAX_CORES - cores;
+    }
+  }
+
+  // Read a small file into buf, return the length or -1.
+  static int readFile(const char * path, char * buf, int size) {
+    int fd = open(path, O_RDONLY);
+    int len;
+
+    if(fd < 0) {
+      return -1;
+    }
+
+    len = read(fd, buf, size - 1);
+    close(fd);
+
+    if(len >= 0) {
+      buf[len] = '\0';
+    }
+    return len;
+  }
+
+  // Return the CPU quota in whole CPUs (rounded up), or 0 if there is no limit.
+  static int getCgroupQuota(void) {
+    char buf[64];
+    long quota, period;
+
+    // cgroup v2: "max 100000" or "200000 100000".
+    if(readFile("/sys/fs/cgroup/cpu.max", buf, sizeof(buf)) > 0) {
+      if(sscanf(buf, "%ld %ld", &quota, &period) == 2 && quota > 0 && period > 0) {
+        return (quota + period - 1) / period;
+      }
+      return 0;
+    }
+
+    // cgroup v1, quota is -1 if there is no limit.
+    if(readFile("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", buf, sizeof(buf)) > 0) {
+      quota = atol(buf);
+      if(quota > 0 && readFile("/sys/fs/cgroup/cpu/cpu.cfs_period_us", buf, sizeof(buf)) > 0) {
+        period = atol(buf);
+        if(period > 0) {
+          return (quota + period - 1) / period;
+        }
+      }
+    }
+
+    return 0;
+  }
+
+  int cores;
+  int spares;
+
+  // Allowed CPU ids.
+  int allowed;
+  int cpus[MAX_CORES];
+};
+
+#endif /* _XCPUS_H_ */
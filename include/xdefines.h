@@ -35,22 +35,83 @@
 extern "C" {
   typedef void * (threadFunction)(void *);
   #define RIP_ADDRESS 16
-  #define CPU_CORES 8
-  //#define CPU_CORES 8
+  // Static upper bound of the cores, which sizes the per-core tables.
+  #define MAX_CORES 64
+  // The actual number of cores is detected at startup, see xcpus.h.
+  #define CPU_CORES (xcpus::getInstance().getCores())
+  // Spare processes take the slots after the cores, see the syscall handoff in xscheduler.cpp.
+  #define SPARE_PROCESSES (xcpus::getInstance().getSpares())
+  #define PROCESS_SLOTS (CPU_CORES + SPARE_PROCESSES)
 };
 
 class xdefines {
 public:
-  enum { MAX_THREADS = 4096 };
-  enum { NUM_HEAPS = CPU_CORES }; // was 16
+  enum { MAX_THREADS = 16384 };
+  enum { NUM_HEAPS = MAX_CORES }; // was 16
 //  enum { PHEAP_SIZE = 1048576UL * 1200 }; // FIX ME 512 };
   enum { PHEAP_SIZE = 1048576UL * 1600 }; // FIX ME 512 };
-  enum { PHEAP_CHUNK = PHEAP_SIZE/(CPU_CORES *2) };
+  enum { PHEAP_CHUNK = PHEAP_SIZE/(MAX_CORES *2) };
   enum { FILE_BUFFER_SIZE = 40960UL };
 //  enum { MAX_GLOBALS_SIZE = 1048576UL * 20 };
   enum { INTERNALHEAP_SIZE = 1048576UL * 100 }; // FIXME 10M 
   enum { PRIVATE_STACK_SIZE = 131072UL}; // FIXME 32page 
-  enum { STACK_SIZE = 131072UL * 8}; // FIXME 32page*4 
+  // It fills a 1MB slot of xstacks.h with its guard page and header.
+  enum { STACK_SIZE = 131072UL * 8 - 4096UL * 2 };
+  // Default stacks come from this region too, see xstacks.h.
+  enum { STACK_REGION_SIZE = 1048576UL * 512 };
+  // Joined threads kept by each core for reuse, see xthreadpool.h.
+  enum { THREAD_CACHE_SIZE = 64 };
+  // An idle scheduler spins for so long before it sleeps on a futex.
+  // It can be changed by the PROTO_SPIN_USECS environment variable.
+  enum { SCHEDULER_SPIN_USECS = 100 };
+  // Sleeping is never longer than this, in case of a missing wakeup.
+  enum { SCHEDULER_SLEEP_MSECS = 100 };
+  // Timeslice of user threads in microseconds, 0 means no preemption.
+  // It can be changed by the PROTO_TIMESLICE_US environment variable.
+  // Threads are only preempted in the text of the application, not in libc,
+  // so a thread looping in a library keeps its core, see handleTimerTick.
+  enum { PREEMPT_TIMESLICE_USECS = 0 };
+  // A woken thread goes back to its last core, unless that core has 
+  // more than so many waiting threads than the waker's core.
+  enum { AFFINITY_IMBALANCE = 2 };
+  // A thread waiting for a mutex spins so many rounds before it parks.
+  enum { MUTEX_SPIN_COUNT = 100 };
+  // Resolution of timed waits, see xtimerwheel.h.
+  enum { TIMER_TICK_USECS = 100 };
+  // Sockets of user threads are managed only below this fd, see xio.h.
+  enum { MAX_IO_FDS = 16384 };
+  // A busy scheduler checks the sockets of its waiting threads so often.
+  enum { IO_POLL_USECS = 100 };
+  // Events taken by one epoll_wait of a scheduler.
+  enum { IO_POLL_EVENTS = 64 };
+  // An idle scheduler doesn't sleep longer than this if other cores have waiting sockets.
+  enum { IO_IDLE_POLL_MSECS = 10 };
+  // Spare processes which serve the cores whose processes are blocked in syscalls.
+  // It can be changed by the PROTO_SPARES environment variable, 0 disables them.
+  enum { SYSCALL_SPARES = 1 };
+  // A process is blocked if it has been in a syscall for so long.
+  enum { SYSCALL_BLOCK_USECS = 200 };
+  // How often a spare looks for blocked processes, backing off to the maximum when there is none.
+  enum { SYSCALL_CHECK_USECS = 20 };
+  enum { SYSCALL_CHECK_MAX_USECS = 10000 };
+  // Entries of the io_uring of every process, which bound the file calls in flight, see xaio.h.
+  enum { AIO_RING_ENTRIES = 64 };
+  // Helper processes making file calls where io_uring is not available.
+  enum { AIO_HELPERS = 4 };
+  // Records of synchronization objects mapped at the beginning, more come from
+  // the shared heap, see xsynctable.h. It must be a power of 2.
+  enum { SYNC_TABLE_ENTRIES = 65536 };
+  // Buckets of parked futex waiters, see xfutex.h. It must be a power of 2.
+  enum { FUTEX_BUCKETS = 1024 };
+  // Processes started at the beginning, they are never parked. 
+  // It can be changed by the PROTO_MIN_CORES environment variable.
+  enum { POOL_MIN_CORES = 1 };
+  // A new process is started when so many threads are waiting on a core
+  // and no idle scheduler can be woken up.
+  enum { POOL_GROW_THRESHOLD = 2 };
+  // An idle process is parked after so long.
+  // It can be changed by the PROTO_RETIRE_MSECS environment variable.
+  enum { POOL_RETIRE_MSECS = 1000 };
   enum { PageSize = 4096UL };
   enum { PAGE_SIZE_MASK = (PageSize-1) };
 
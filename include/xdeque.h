@@ -0,0 +1,151 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xdeque.h
+ * @brief:  Work-stealing deque (Chase-Lev) of runnable threads.
+ *          The owner process pushes and pops at the bottom without any lock,
+ *          other processes steal from the top with one cmpxchg.
+ *          The deque must be allocated in shared memory since thieves are
+ *          different processes.
+ *          Reference: D. Chase and Y. Lev, "Dynamic Circular Work-Stealing Deque", SPAA'05.
+ *          We never need to grow the array: every thread can be in at most one
+ *          queue at a time, so MAX_THREADS slots are always enough.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XDEQUE_H_
+#define _XDEQUE_H_
+
+#include "xdefines.h"
+#include "xatomic.h"
+
+class xthread;
+
+class xdeque {
+  enum { CAPACITY = xdefines::MAX_THREADS };
+  enum { MASK = CAPACITY - 1 };
+
+public:
+  xdeque() {
+    top = 0;
+    bottom = 0;
+  }
+
+  // Push a thread to the bottom. Only the owner can call this.
+  void push(xthread * thread) {
+    unsigned long b = bottom;
+    unsigned long t = top;
+
+    if((long)(b - t) >= CAPACITY) {
+      PRFATAL("Work-stealing deque %p is full, top %lu bottom %lu", this, t, b);
+    }
+
+    threads[b & MASK] = thread;
+
+    // x86 won't reorder two stores, we only need to stop the compiler
+    // so that thieves never see the new bottom before the slot.
+    xatomic::compilerBarrier();
+    bottom = b + 1;
+  }
+
+  // Pop a thread from the bottom. Only the owner can call this.
+  xthread * pop(void) {
+    xthread * thread = NULL;
+    unsigned long b = bottom - 1;
+    unsigned long t;
+    long size;
+
+    bottom = b;
+
+    // The new bottom must be visible to thieves before we read the top,
+    // otherwise both of us can take the last thread.
+    xatomic::memoryBarrier();
+
+    t = top;
+    size = (long)(b - t);
+
+    if(size < 0) {
+      // It is empty. Restore the bottom.
+      bottom = t;
+      return NULL;
+    }
+
+    thread = threads[b & MASK];
+    if(size > 0) {
+      // There are still some items left, no race with thieves.
+      return thread;
+    }
+
+    // This is the last item, compete with thieves by advancing the top.
+    if(cmpxchg(&top, t, t + 1) != t) {
+      thread = NULL;
+    }
+    bottom = t + 1;
+
+    return thread;
+  }
+
+  // Steal a thread from the top. It can be called by any process.
+  // Returning NULL means the deque is empty or we lost the race.
+  xthread * steal(void) {
+    unsigned long t = top;
+
+    // Loads are not reordered with other loads on x86.
+    xatomic::compilerBarrier();
+    unsigned long b = bottom;
+    xthread * thread;
+
+    if((long)(b - t) <= 0) {
+      return NULL;
+    }
+
+    thread = threads[t & MASK];
+
+    if(cmpxchg(&top, t, t + 1) != t) {
+      return NULL;
+    }
+
+    return thread;
+  }
+
+  // Check whether the deque has some work. It is a hint only for non-owners.
+  bool hasWork(void) {
+    return (long)(bottom - top) > 0;
+  }
+
+  int size(void) {
+    long size = (long)(bottom - top);
+    return (size > 0) ? size : 0;
+  }
+
+private:
+  // top and bottom are put on different cache lines since
+  // thieves are updating top and the owner is updating bottom.
+  volatile unsigned long top;
+  char  toppadding[64];
+  volatile unsigned long bottom;
+  char  bottompadding[64];
+
+  xthread * volatile threads[CAPACITY];
+};
+
+#endif /* _XDEQUE_H_ */
@@ -20,17 +20,24 @@
 
 /*
  * @file:   xevent.h
- * @brief:  
+ * @brief:  Event passed from a user thread to the scheduler of current process.
+ *          The user thread posts it right before switching to the scheduler,
+ *          and the scheduler handles it right after the switch. So there is at
+ *          most one pending event for each process, which is saved in a fixed
+ *          slot of the process object: no allocation and no lock is needed.
  * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
  */
 
 #ifndef _XEVENT_H_
 #define _XEVENT_H_
 
-#include "list.h"
-  
+class xthread;
+class xqueue;
+class spinlock;
+
 typedef enum {
-  E_EVENT_YIELD = 0,
+  E_EVENT_NONE = 0,
+  E_EVENT_YIELD,
   E_EVENT_RELEASE_LOCK,
 } e_event_type;
 
@@ -39,11 +46,9 @@ class xevent {
 public:
 
   xevent() {
-    listInit(&toqueue);
+    type = E_EVENT_NONE;
   }
 
-
-  lnode  toqueue; // event pointer.
   e_event_type type;
   union {
     struct { xthread * thread; xqueue * queue; } YIELD;
@@ -0,0 +1,302 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xfutex.h
+ * @brief:  Private futexes of user threads, which are used by libstdc++ and
+ *          others through syscall(SYS_futex) instead of the pthread calls.
+ *          The kernel keys a private futex by the address space, and every
+ *          core is a process of its own here, so a waker on another core
+ *          would never find the waiter. Worse, the waiter blocks its core.
+ *
+ *          Waiters are parked on a bucket of a shared hash table instead,
+ *          keyed by the address of the futex word, and yield their cores.
+ *          Like the kernel, the waiter checks the word while holding the
+ *          spin lock of the bucket, and the waker takes the same lock after
+ *          changing the word, so no wakeup can be lost. Reading the word may
+ *          trap and move the thread to the core owning the page, see
+ *          xprotect.cpp, which must not happen while holding a spin lock.
+ *          So the word is read once before the lock: then the thread is on
+ *          the owner, and stays there since it can't be preempted.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XFUTEX_H_
+#define _XFUTEX_H_
+
+#include <new>
+#include <errno.h>
+#include <linux/futex.h>
+
+#include "xdefines.h"
+#include "xatomic.h"
+#include "spinlock.h"
+#include "list.h"
+#include "xthread.h"
+#include "xtimerwheel.h"
+#include "xscheduler.h"
+#include "memwrapper.h"
+#include "log.h"
+
+class xfutex {
+  enum { BUCKETS = xdefines::FUTEX_BUCKETS };
+  enum { MASK = BUCKETS - 1 };
+
+  // Waiters of all futex words hashed here, one bucket per cache line.
+  class bucket {
+  public:
+    spinlock lock;
+    struct lnode waitlist;
+    char padding[64 - sizeof(spinlock) - sizeof(struct lnode)];
+  };
+
+public:
+  xfutex() {
+    buckets = NULL;
+  }
+
+  static xfutex& getInstance (void) {
+    static char buf[sizeof(xfutex)];
+    static xfutex * theOneTrueObject = new (buf) xfutex();
+    return *theOneTrueObject;
+  }
+
+  // It must be mapped before other processes are created.
+  void initialize(void) {
+    buckets = (bucket *)MMAP_SHARED(sizeof(bucket) * BUCKETS);
+
+    for(int i = 0; i < BUCKETS; i++) {
+      buckets[i].lock.init();
+      listInit(&buckets[i].waitlist);
+    }
+  }
+
+  // Park until we are woken up on the word, unless it isn't val any more.
+  // A deadline (CLOCK_MONOTONIC in nanoseconds) of 0 never expires.
+  // Note: preemption must be disabled to call this function.
+  int futexWait(xthread * current, int * uaddr, int val, unsigned int bitset,
+                unsigned long long deadline) {
+    bucket * b = getBucket(uaddr);
+
+    // Move to the owner of the page before taking the lock.
+    if(*(volatile int *)uaddr != val) {
+      return EAGAIN;
+    }
+
+    b->lock.acquire();
+
+    if(*(volatile int *)uaddr != val) {
+      b->lock.release();
+      return EAGAIN;
+    }
+
+    if(deadline != 0 && deadline <= xtimerwheel::now()) {
+      b->lock.release();
+      return ETIMEDOUT;
+    }
+
+    current->waitaddr = uaddr;
+    current->waitbits = bitset;
+    current->setThreadFutexWaiting();
+    listInsertTail(&current->toqueue, &b->waitlist);
+
+    if(deadline != 0) {
+      threadArmTimer(current, TIMER_FUTEX, NULL, deadline);
+    }
+
+    // When we are back, a waker has taken us off the bucket,
+    // unless the deadline has passed.
+    threadYieldHoldingLock(&b->lock);
+
+    if(deadline != 0 && threadCancelTimer(current)) {
+      return ETIMEDOUT;
+    }
+    return 0;
+  }
+
+  // Wake up at most count waiters on the word whose bitsets match.
+  int futexWake(int * uaddr, int count, unsigned int bitset) {
+    bucket * b = getBucket(uaddr);
+    struct lnode woken;
+    int ret;
+
+    listInit(&woken);
+
+    b->lock.acquire();
+    ret = takeWaiters(b, uaddr, count, bitset, &woken);
+    b->lock.release();
+
+    wakeWaiters(&woken);
+    return ret;
+  }
+
+  // Wake up at most count waiters on uaddr, and move at most requeue others
+  // to uaddr2, where they wait without being woken up. With cmp, the word
+  // must still be val, otherwise -EAGAIN is returned.
+  // Note: preemption must be disabled to call this function.
+  int futexRequeue(int * uaddr, int count, int requeue, int * uaddr2,
+                   bool cmp, int val) {
+    bucket * b1 = getBucket(uaddr);
+    bucket * b2 = getBucket(uaddr2);
+    struct lnode woken;
+    int ret;
+
+    // Move to the owner of the page before taking the locks, see futexWait.
+    if(cmp && *(volatile int *)uaddr != val) {
+      return -EAGAIN;
+    }
+
+    listInit(&woken);
+    lockPair(b1, b2);
+
+    if(cmp && *(volatile int *)uaddr != val) {
+      unlockPair(b1, b2);
+      return -EAGAIN;
+    }
+
+    ret = takeWaiters(b1, uaddr, count, FUTEX_BITSET_MATCH_ANY, &woken);
+    ret += moveWaiters(b1, uaddr, requeue, b2, uaddr2);
+
+    unlockPair(b1, b2);
+
+    wakeWaiters(&woken);
+    return ret;
+  }
+
+  // The timer of a waiter has expired. Take it off its bucket if it is still
+  // waiting in the same wait, otherwise it has been woken up.
+  void futexTimeout(xthread * thread, unsigned long seq) {
+    bool expired = false;
+    bucket * b = lockWaiter(thread);
+
+    if(thread->timer.seq == seq && thread->status == THREAD_STATUS_FUTEX_WAITING) {
+      listRemoveNode(&thread->toqueue);
+      thread->timer.timedout = true;
+      thread->setThreadRunning();
+      expired = true;
+    }
+    b->lock.release();
+
+    if(expired) {
+      threadMakeRunnable(thread);
+    }
+  }
+
+private:
+  bucket * getBucket(int * uaddr) {
+    return &buckets[(((unsigned long)uaddr >> 2) * 2654435761UL) & MASK];
+  }
+
+  // Lock the bucket where the thread is waiting. The thread can be requeued
+  // to another bucket before we get the lock, then try again.
+  bucket * lockWaiter(xthread * thread) {
+    while(true) {
+      bucket * b = getBucket((int *)thread->waitaddr);
+
+      b->lock.acquire();
+      if(b == getBucket((int *)thread->waitaddr)) {
+        return b;
+      }
+      b->lock.release();
+    }
+  }
+
+  // Always lock the lower bucket first.
+  void lockPair(bucket * b1, bucket * b2) {
+    if(b1 == b2) {
+      b1->lock.acquire();
+    }
+    else if(b1 < b2) {
+      b1->lock.acquire();
+      b2->lock.acquire();
+    }
+    else {
+      b2->lock.acquire();
+      b1->lock.acquire();
+    }
+  }
+
+  void unlockPair(bucket * b1, bucket * b2) {
+    b1->lock.release();
+    if(b1 != b2) {
+      b2->lock.release();
+    }
+  }
+
+  // Note: lock of the bucket must be held to call this function.
+  int takeWaiters(bucket * b, int * uaddr, int count, unsigned int bitset, struct lnode * woken) {
+    lnode * node = nextEntry(&b->waitlist);
+    int ret = 0;
+
+    while(node != &b->waitlist && ret < count) {
+      xthread * thread = container_of(node, xthread, toqueue);
+      node = nextEntry(node);
+
+      if(thread->waitaddr == uaddr && (thread->waitbits & bitset) != 0) {
+        listRemoveNode(&thread->toqueue);
+        listInsertTail(&thread->toqueue, woken);
+        thread->setThreadRunning();
+        ret++;
+      }
+    }
+
+    return ret;
+  }
+
+  // Note: locks of both buckets must be held to call this function.
+  int moveWaiters(bucket * from, int * uaddr, int count, bucket * to, int * uaddr2) {
+    lnode * node = nextEntry(&from->waitlist);
+    lnode * end = from->waitlist.prev;
+    int ret = 0;
+
+    // Stop at the last waiter, the moved ones may be put behind it.
+    while(node != &from->waitlist && ret < count) {
+      xthread * thread = container_of(node, xthread, toqueue);
+      bool last = (node == end);
+      node = nextEntry(node);
+
+      if(thread->waitaddr == uaddr) {
+        listRemoveNode(&thread->toqueue);
+        thread->waitaddr = uaddr2;
+        listInsertTail(&thread->toqueue, &to->waitlist);
+        ret++;
+      }
+
+      if(last) {
+        break;
+      }
+    }
+
+    return ret;
+  }
+
+  void wakeWaiters(struct lnode * woken) {
+    lnode * node;
+
+    while((node = listRetrieveItem(woken)) != NULL) {
+      threadMakeRunnable(container_of(node, xthread, toqueue));
+    }
+  }
+
+  bucket * buckets;
+};
+
+#endif /* _XFUTEX_H_ */
@@ -0,0 +1,200 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xidle.h
+ * @brief:  Idle state of one scheduler: spin for a while, then sleep on a futex.
+ *          The object must be in shared memory since wakers are other processes.
+ *
+ *          To avoid lost wakeups, both sides write first and read later:
+ *          the sleeper sets its state to sleeping and then re-checks the queues,
+ *          the waker puts the thread into a queue and then checks the state.
+ *          Both sides have a full memory barrier in between.
+ *
+ *          A scheduler whose poller has waiting sockets sleeps in epoll_wait
+ *          instead, see xpoller.h, then the waker writes its eventfd.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XIDLE_H_
+#define _XIDLE_H_
+
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "xdefines.h"
+#include "xatomic.h"
+#include "realfuncs.h"
+
+class xidle {
+  enum { IDLE_AWAKE = 0, IDLE_SLEEPING = 1, IDLE_POLLING = 2 };
+
+public:
+  xidle() {
+    state = IDLE_AWAKE;
+    wakefd = -1;
+    idlestart = 0;
+    idlesince = 0;
+    spinns = 0;
+    sleepns = 0;
+    sleeps = 0;
+    wakeups = 0;
+  }
+
+  static unsigned long long now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  // Called when the scheduler can't find any work.
+  // Return false if the spinning budget is used up and we should sleep.
+  bool spinning(unsigned long long budget) {
+    unsigned long long current = now();
+
+    if(idlestart == 0) {
+      idlestart = current;
+    }
+
+    if(idlesince == 0) {
+      idlesince = current;
+    }
+
+    return (current - idlestart) < budget;
+  }
+
+  // The scheduler has found some work.
+  void stopIdle(void) {
+    if(idlestart != 0) {
+      spinns += now() - idlestart;
+      idlestart = 0;
+    }
+    idlesince = 0;
+  }
+
+  // How long the scheduler has found no work, including sleeping.
+  unsigned long long idleTime(void) {
+    return idlesince ? (now() - idlesince) : 0;
+  }
+
+  // The eventfd of our poller, written when we sleep in epoll_wait.
+  void setWakeFd(int fd) {
+    wakefd = fd;
+  }
+
+  // Announce that we are going to sleep, in epoll_wait if polling.
+  // The caller must re-check all queues after this.
+  void prepareSleep(volatile unsigned long * sleepers, bool polling = false) {
+    xatomic::atomic_set(&state, polling ? IDLE_POLLING : IDLE_SLEEPING);
+    xatomic::increment(sleepers);
+  }
+
+  // Sleep until somebody wakes us up or the timeout expires.
+  void sleep(volatile unsigned long * sleepers, unsigned long long timeoutns) {
+    struct timespec timeout;
+    unsigned long long start = beginSleep();
+
+    timeout.tv_sec = timeoutns / 1000000000ULL;
+    timeout.tv_nsec = timeoutns % 1000000000ULL;
+
+    // Since the futex is in a MAP_SHARED area, we can't use FUTEX_PRIVATE_FLAG.
+    if(state == IDLE_SLEEPING) {
+      syscall(SYS_futex, &state, FUTEX_WAIT, IDLE_SLEEPING, &timeout, NULL, 0);
+    }
+
+    endSleep(sleepers, start);
+  }
+
+  // The caller sleeps by itself between them, like sleeping in epoll_wait.
+  unsigned long long beginSleep(void) {
+    unsigned long long start = now();
+
+    // Spinning time until now is accounted as spinning.
+    spinns += start - idlestart;
+    return start;
+  }
+
+  void endSleep(volatile unsigned long * sleepers, unsigned long long start) {
+    cancelSleep(sleepers);
+
+    sleeps++;
+    idlestart = now();
+    sleepns += idlestart - start;
+  }
+
+  // We have found some work after prepareSleep().
+  void cancelSleep(volatile unsigned long * sleepers) {
+    xatomic::atomic_set(&state, IDLE_AWAKE);
+    xatomic::decrement(sleepers);
+  }
+
+  bool isSleeping(void) {
+    return state != IDLE_AWAKE;
+  }
+
+  // Wake up this scheduler if it is sleeping.
+  // Only one waker will issue the system call.
+  bool wakeup(void) {
+    unsigned long current = state;
+
+    if(current == IDLE_AWAKE) {
+      return false;
+    }
+
+    if(cmpxchg(&state, current, IDLE_AWAKE) != current) {
+      return false;
+    }
+
+    xatomic::increment(&wakeups);
+    if(current == IDLE_POLLING) {
+      unsigned long long value = 1;
+      WRAP(write)(wakefd, &value, sizeof(value));
+    }
+    else {
+      syscall(SYS_futex, &state, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    return true;
+  }
+
+  void printStatistics(int coreid) {
+    unsigned long long total = spinns + sleepns;
+
+    fprintf(stderr, "core %d: idle spinning %llu ms, sleeping %llu ms (%lu sleeps, %lu wakeups), %.1f%% of idle time on cpu\n",
+            coreid, spinns / 1000000ULL, sleepns / 1000000ULL, sleeps, wakeups,
+            total ? (100.0 * spinns / total) : 0.0);
+  }
+
+private:
+  volatile unsigned long state;
+  int wakefd;
+  char padding[64];
+
+  // The following are only modified by the owner, except wakeups.
+  unsigned long long idlestart;
+  unsigned long long idlesince;
+  unsigned long long spinns;
+  unsigned long long sleepns;
+  unsigned long sleeps;
+  volatile unsigned long wakeups;
+};
+
+#endif /* _XIDLE_H_ */
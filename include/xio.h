@@ -0,0 +1,494 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xio.h
+ * @brief:  Blocking socket calls of user threads, which park the thread instead
+ *          of the whole process. A socket is switched to nonblocking mode the
+ *          first time a user thread uses it. Whether the user wants it to be
+ *          nonblocking is kept here, and changed by fcntl(F_SETFL) and
+ *          ioctl(FIONBIO), so that calls of the user get EAGAIN only then, and
+ *          fcntl(F_GETFL) shows the flag of the user. Processes which inherit
+ *          the socket still see the nonblocking flag of the kernel.
+ *          When a call would block, the thread puts one waiter for every fd on
+ *          the fd's waitlist, registers the fd on the poller of current core
+ *          (xpoller.h) and yields. Schedulers poll the pollers and wake up the
+ *          waiters whose fds are ready. The woken thread simply tries again.
+ *
+ *          Waiters are on the stack of the waiting thread, since poll waits for
+ *          many fds at the same time. A waiter is only unlinked under the lock
+ *          of its fd, so the waker never touches a waiter that has gone.
+ *          Locks are always taken in the order of fd lock, then thread lock.
+ *          The fd table is in the shared space, like the fd table of the kernel.
+ *          Files are only recognized here, their reads and writes go to xaio.h.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XIO_H_
+#define _XIO_H_
+
+#include <new>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+
+#include "xdefines.h"
+#include "spinlock.h"
+#include "list.h"
+#include "xthread.h"
+#include "xscheduler.h"
+#include "xpoller.h"
+#include "processmap.h"
+#include "memwrapper.h"
+#include "realfuncs.h"
+
+class xio {
+  enum { MAX_FDS = xdefines::MAX_IO_FDS };
+
+  // Waiters kept on the stack, poll with more fds takes them from the shared heap.
+  enum { STACK_WAITERS = 16 };
+
+  enum e_fd_mode {
+    FD_UNKNOWN = 0,
+    FD_PASS,      // Not a socket.
+    FD_MANAGED,   // A socket, switched to nonblocking by us.
+    FD_FILE       // A regular file or a block device, see xaio.h.
+  };
+
+  class iofd {
+  public:
+    spinlock lock;
+    volatile int mode;
+
+    // Whether the user wants a managed socket to be nonblocking.
+    volatile bool nonblock;
+
+    // Which poller the fd is registered on, -1 if none.
+    int core;
+    struct lnode waiters;
+  };
+
+  class iowaiter {
+  public:
+    struct lnode node;
+    xthread * thread;
+    int fd;
+    unsigned int events;
+
+    // Set by the waker under the fd lock.
+    volatile unsigned int revents;
+    bool linked;
+  };
+
+public:
+  xio() {
+    fds = NULL;
+  }
+
+  static xio& getInstance (void) {
+    static char buf[sizeof(xio)];
+    static xio * theOneTrueObject = new (buf) xio();
+    return *theOneTrueObject;
+  }
+
+  void initialize(void) {
+    fds = (iofd *)MMAP_SHARED(sizeof(iofd) * MAX_FDS);
+
+    for(int i = 0; i < MAX_FDS; i++) {
+      new (&fds[i].lock) spinlock;
+      fds[i].mode = FD_UNKNOWN;
+      fds[i].nonblock = false;
+      fds[i].core = -1;
+      listInit(&fds[i].waiters);
+    }
+  }
+
+  // Whether calls on the fd should park the thread when they would block.
+  bool manage(int fd) {
+    iofd * entry = getSocket(fd);
+
+    return entry != NULL && !entry->nonblock;
+  }
+
+  // The file status flags of fcntl(F_GETFL) as the user has set them.
+  int getFlags(int fd, int flags) {
+    iofd * entry = getSocket(fd);
+
+    if(entry == NULL || flags < 0) {
+      return flags;
+    }
+
+    return entry->nonblock ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+  }
+
+  // The user changes the file status flags by fcntl(F_SETFL).
+  // Return the flags for the kernel, where a managed socket stays nonblocking.
+  int setFlags(int fd, int flags) {
+    iofd * entry = getSocket(fd);
+
+    if(entry == NULL) {
+      return flags;
+    }
+
+    entry->nonblock = (flags & O_NONBLOCK) != 0;
+    return flags | O_NONBLOCK;
+  }
+
+  // The user changes the mode by ioctl(FIONBIO).
+  // Return false if the fd is not managed, then the kernel should do that.
+  bool setNonblock(int fd, bool nonblock) {
+    iofd * entry = getSocket(fd);
+
+    if(entry == NULL) {
+      return false;
+    }
+
+    entry->nonblock = nonblock;
+    return true;
+  }
+
+  // Whether the fd is a file, whose reads and writes can't be made nonblocking.
+  bool isFile(int fd) {
+    iofd * entry;
+
+    if(fds == NULL || fd < 0 || fd >= MAX_FDS) {
+      return false;
+    }
+
+    entry = &fds[fd];
+    if(entry->mode == FD_UNKNOWN) {
+      setup(entry, fd);
+    }
+
+    return entry->mode == FD_FILE;
+  }
+
+  // Wait until the fd may be ready for the events, or the deadline has passed.
+  // Return ETIMEDOUT if it has, or EINVAL if the fd is out of our table.
+  int waitFd(xthread * current, int coreid, int fd, unsigned int events, unsigned long long deadline) {
+    iowaiter waiter;
+
+    if(fd < 0 || fd >= MAX_FDS) {
+      return EINVAL;
+    }
+
+    waiter.fd = fd;
+    waiter.events = events;
+    return wait(current, coreid, &waiter, 1, deadline);
+  }
+
+  // Wait for any fd of poll. Return ETIMEDOUT if the deadline has passed,
+  // or EINVAL if some fd is out of our table.
+  int waitPoll(xthread * current, int coreid, struct pollfd * pfds, nfds_t nfds, unsigned long long deadline) {
+    iowaiter stackwaiters[STACK_WAITERS];
+    iowaiter * waiters = stackwaiters;
+    int num = 0;
+    int ret;
+
+    if(nfds > STACK_WAITERS) {
+      waiters = (iowaiter *)MALLOC_SHARED(sizeof(iowaiter) * nfds);
+    }
+
+    for(nfds_t i = 0; i < nfds; i++) {
+      // Negative fds are ignored by poll.
+      if(pfds[i].fd < 0) {
+        continue;
+      }
+
+      if(pfds[i].fd >= MAX_FDS) {
+        num = -1;
+        break;
+      }
+
+      // POLLIN and POLLOUT have the same values as their epoll counterparts.
+      waiters[num].fd = pfds[i].fd;
+      waiters[num].events = pfds[i].events;
+      num++;
+    }
+
+    ret = (num < 0) ? EINVAL : wait(current, coreid, waiters, num, deadline);
+
+    if(waiters != stackwaiters) {
+      FREE_SHARED(waiters);
+    }
+    return ret;
+  }
+
+  // The poller reports that the fd is ready. Wake up the waiters for these events.
+  void ready(int fd, unsigned int revents) {
+    iofd * entry;
+    struct lnode * node;
+    struct lnode * next;
+    unsigned int events = 0;
+
+    if(fd < 0 || fd >= MAX_FDS) {
+      return;
+    }
+
+    entry = &fds[fd];
+    entry->lock.acquire();
+
+    // Nobody is waiting any more, e.g. the waiters have timed out.
+    if(isListEmpty(&entry->waiters)) {
+      entry->lock.release();
+      return;
+    }
+
+    for(node = entry->waiters.next; node != &entry->waiters; node = next) {
+      iowaiter * waiter = container_of(node, iowaiter, node);
+
+      next = node->next;
+
+      // Errors and hangups are reported to everyone.
+      if(revents & (waiter->events | EPOLLERR | EPOLLHUP)) {
+        wakeWaiter(waiter, revents);
+      }
+      else {
+        events |= waiter->events;
+      }
+    }
+
+    if(isListEmpty(&entry->waiters)) {
+      processmap::getInstance().getPoller(entry->core)->removeWaiter();
+    }
+    else {
+      // The registration is one-shot, arm it again for the others.
+      processmap::getInstance().getPoller(entry->core)->watch(fd, events, true);
+    }
+
+    entry->lock.release();
+  }
+
+  // The fd is going to be closed. Waiters try again and get EBADF.
+  void close(int fd) {
+    iofd * entry;
+    struct lnode * node;
+
+    if(fds == NULL || fd < 0 || fd >= MAX_FDS) {
+      return;
+    }
+
+    entry = &fds[fd];
+    if(entry->mode == FD_UNKNOWN && entry->core < 0) {
+      return;
+    }
+
+    entry->lock.acquire();
+
+    if(!isListEmpty(&entry->waiters)) {
+      while((node = entry->waiters.next) != &entry->waiters) {
+        wakeWaiter(container_of(node, iowaiter, node), EPOLLHUP);
+      }
+      processmap::getInstance().getPoller(entry->core)->removeWaiter();
+    }
+
+    // A dup of the fd may still be open, which keeps the registration.
+    if(entry->core >= 0) {
+      processmap::getInstance().getPoller(entry->core)->unwatch(fd);
+      entry->core = -1;
+    }
+
+    entry->mode = FD_UNKNOWN;
+    entry->nonblock = false;
+    entry->lock.release();
+  }
+
+private:
+  // The entry of a managed socket, or NULL.
+  // Standard fds are shared with other programs, so they are never touched.
+  iofd * getSocket(int fd) {
+    iofd * entry;
+
+    if(fds == NULL || fd <= STDERR_FILENO || fd >= MAX_FDS) {
+      return NULL;
+    }
+
+    entry = &fds[fd];
+    if(entry->mode == FD_UNKNOWN) {
+      setup(entry, fd);
+    }
+
+    return (entry->mode == FD_MANAGED) ? entry : NULL;
+  }
+
+  // Find out whether the fd is a socket, and make it nonblocking.
+  // The fcntl of libc is used, since ours reports the flags of the user.
+  void setup(iofd * entry, int fd) {
+    struct stat st;
+    int flags;
+
+    entry->lock.acquire();
+
+    if(entry->mode == FD_UNKNOWN && fstat(fd, &st) == 0) {
+      entry->mode = FD_PASS;
+
+      if(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) {
+        entry->mode = FD_FILE;
+      }
+      else if(S_ISSOCK(st.st_mode)) {
+        flags = WRAP(fcntl)(fd, F_GETFL);
+
+        if(flags >= 0 && ((flags & O_NONBLOCK) || WRAP(fcntl)(fd, F_SETFL, flags | O_NONBLOCK) == 0)) {
+          entry->nonblock = (flags & O_NONBLOCK) != 0;
+          entry->mode = FD_MANAGED;
+        }
+      }
+    }
+
+    entry->lock.release();
+  }
+
+  // Put waiters on their fds and park current thread until one of them is woken up.
+  // Note: preemption must be disabled, so that we stay on the same core.
+  int wait(xthread * current, int coreid, iowaiter * waiters, int num, unsigned long long deadline) {
+    bool ready = false;
+    bool timedout = false;
+
+    for(int i = 0; i < num; i++) {
+      waiters[i].thread = current;
+      waiters[i].revents = 0;
+      addWaiter(&waiters[i], coreid);
+    }
+
+    // Wakers set revents before they take the thread lock, see wakeWaiter.
+    current->lock();
+    for(int i = 0; i < num; i++) {
+      if(waiters[i].revents) {
+        ready = true;
+        break;
+      }
+    }
+
+    if(ready) {
+      current->unlock();
+    }
+    else {
+      current->setThreadIoWaiting();
+      if(deadline) {
+        threadArmTimer(current, TIMER_SLEEP, NULL, deadline);
+      }
+
+      threadYieldHoldingLock(current->getLock());
+
+      if(deadline) {
+        timedout = threadCancelTimer(current);
+      }
+    }
+
+    for(int i = 0; i < num; i++) {
+      removeWaiter(&waiters[i]);
+    }
+
+    return timedout ? ETIMEDOUT : 0;
+  }
+
+  void addWaiter(iowaiter * waiter, int coreid) {
+    iofd * entry = &fds[waiter->fd];
+    processmap & procmap = processmap::getInstance();
+    unsigned int events = waiter->events;
+    struct lnode * node;
+    bool registered;
+
+    entry->lock.acquire();
+
+    // Nobody is waiting, so the fd can move to the poller of current core.
+    if(isListEmpty(&entry->waiters)) {
+      if(entry->core >= 0 && entry->core != coreid) {
+        procmap.getPoller(entry->core)->unwatch(waiter->fd);
+        entry->core = -1;
+      }
+
+      registered = (entry->core >= 0);
+      entry->core = coreid;
+      procmap.getPoller(coreid)->addWaiter();
+    }
+    else {
+      registered = true;
+      for(node = entry->waiters.next; node != &entry->waiters; node = node->next) {
+        events |= container_of(node, iowaiter, node)->events;
+      }
+    }
+
+    listInsertTail(&waiter->node, &entry->waiters);
+    waiter->linked = true;
+
+    // Not pollable, e.g. a regular file, which is always ready.
+    if(!procmap.getPoller(entry->core)->watch(waiter->fd, events, registered)) {
+      listRemoveNode(&waiter->node);
+      waiter->linked = false;
+      waiter->revents = EPOLLERR;
+
+      if(isListEmpty(&entry->waiters)) {
+        procmap.getPoller(entry->core)->removeWaiter();
+        entry->core = -1;
+      }
+    }
+
+    entry->lock.release();
+  }
+
+  // Current thread is running again.
+  void removeWaiter(iowaiter * waiter) {
+    iofd * entry = &fds[waiter->fd];
+
+    entry->lock.acquire();
+
+    if(waiter->linked) {
+      listRemoveNode(&waiter->node);
+      waiter->linked = false;
+
+      // The registration stays, an event without waiters is ignored.
+      if(isListEmpty(&entry->waiters)) {
+        processmap::getInstance().getPoller(entry->core)->removeWaiter();
+      }
+    }
+
+    entry->lock.release();
+  }
+
+  // Note: the lock of the waiter's fd must be held to call this function
+  void wakeWaiter(iowaiter * waiter, unsigned int revents) {
+    xthread * thread = waiter->thread;
+    bool wakeup = false;
+
+    listRemoveNode(&waiter->node);
+    waiter->linked = false;
+    waiter->revents = revents;
+
+    // The thread may be waking up for another fd, or not parked yet.
+    thread->lock();
+    if(thread->status == THREAD_STATUS_IO_WAITING) {
+      thread->setThreadRunning();
+      wakeup = true;
+    }
+    thread->unlock();
+
+    if(wakeup) {
+      threadMakeRunnable(thread);
+    }
+  }
+
+  iofd * fds;
+};
+
+#endif /* _XIO_H_ */
@@ -50,6 +50,7 @@
 #include "stlallocator.h"
 
 #include "xfilemap.h"
+#include "xstacks.h"
 
 class xmemory {
 private:
@@ -114,6 +115,12 @@ public:
     _globals.setMemoryUnowned();     
     _pheap.setMemoryUnowned();     
   }  
+
+  // Current process is going to park, others take its pages on their traps.
+  inline void releaseOwnedPages(int coreid) {
+    _globals.releasePages(coreid);
+    _pheap.releasePages(coreid);
+  }
   
   // Protect all memory.
   // This will be called before the main process tried to 
@@ -215,6 +222,11 @@ public:
    sprintf(str, "%d: segment fault address %p\n", getpid(), &addr);
    write(1, str, strlen(str));
   
+    // A thread has run out of its stack. We are on the alternate signal stack.
+    if (xstacks::getInstance().isGuardPage(addr)) {
+      PRFATAL("%d : stack overflow with addr %p.\n", getpid(), addr);
+    }
+
     // Check if this was a SEGV that we are supposed to trap.
     if (siginfo->si_code == SEGV_ACCERR) {
       xmemory::getInstance().handleAccessTrap(addr, context);
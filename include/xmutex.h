@@ -28,7 +28,11 @@
 #ifndef _XMUTEX_H_
 #define _XMUTEX_H_
 
+#include <errno.h>
+
 #include "spinlock.h"
+#include "xthread.h"
+#include "xtimerwheel.h"
 #include "xscheduler.h"
 
 class xmutex{
@@ -56,7 +60,12 @@ public:
     setInited();
   }
 
-  void mutexLock(xthread * current) {
+  // Adaptive mutex: spin for a while since the owner is probably running on
+  // another core, then park on the waitlist and yield the core to others.
+  // The parked thread owns the mutex when it is woken up, see mutexUnlock.
+  // If a deadline (CLOCK_MONOTONIC in nanoseconds) is given, the thread is
+  // taken off the waitlist when it expires, see mutexTimeout.
+  int mutexLock(xthread * current, unsigned long long deadline = 0) {
     // Acquire the spin lock
     lock();
 
@@ -65,49 +74,89 @@ public:
       mutexInit();
     } 
 
-    // Check whether the mutex is lockable or not
-    while(status != MUTEX_STATUS_UNLOCKED) {
-      unlock();
-     
-checkagain: 
-      // Loop for a while and check again
-      while(status != MUTEX_STATUS_UNLOCKED) {
-        xatomic::cpuRelax();
-      }
-      
-      lock();  
-  
+    if(tryAcquire(current)) {
+      return 0;
+    }
+    unlock();
+
+    // Loop for a while and check again
+    for(int i = 0; i < xdefines::MUTEX_SPIN_COUNT; i++) {
+      xatomic::cpuRelax();
+
       if(status == MUTEX_STATUS_UNLOCKED) {
-        // Now we can get lock!!
-        break;
-      }  
+        lock();
+        if(tryAcquire(current)) {
+          return 0;
+        }
+        unlock();
+      }
+    }
+
+    lock();
+    if(tryAcquire(current)) {
+      return 0;
+    }
 
-#if 1
-      //fprintf(stderr, "My god, why I still can't get the lock\n");
+    if(deadline != 0 && deadline <= xtimerwheel::now()) {
       unlock();
-      goto checkagain;
-#else
+      return ETIMEDOUT;
+    }
+
+    // Otherwise, put current thread into the waiting list.
+    enqueueWaitlist(current);
 
-      // Otherwise, put current thread into the waiting list.
-      enqueueWaitlist(current);
+    if(deadline != 0) {
+      threadArmTimer(current, TIMER_MUTEX, this, deadline);
+    }
 
-      // yielding will release corresponding lock. 
-      threadYieldHoldingLock(&lck);
+    // yielding will release corresponding lock. 
+    // When we are back, the owner has handed the mutex to us, 
+    // unless the deadline has passed.
+    threadYieldHoldingLock(&lck);
 
-      lock();
-#endif
+    if(deadline != 0 && threadCancelTimer(current)) {
+      return ETIMEDOUT;
     }
+    return 0;
+  }
 
-    // Now we can acquire lock safely
-    // Set the status to be locked and set the owner to current thread.
-    markLocked();
-    owner = current->getTid();
+  // Take the mutex only if it is free, EBUSY otherwise.
+  int mutexTryLock(xthread * current) {
+    lock();
+
+    if(!isInited()) {
+      mutexInit();
+    } 
 
+    if(tryAcquire(current)) {
+      return 0;
+    }
     unlock();
+
+    return EBUSY;
+  }
+
+  // The timer of a waiter has expired. Take it off the waitlist if it is still 
+  // waiting in the same wait, otherwise the mutex has been handed to it.
+  void mutexTimeout(xthread * thread, unsigned long seq) {
+    bool expired = false;
+
+    lock();
+    if(thread->timer.seq == seq && thread->status == THREAD_STATUS_LOCK_WAITING) {
+      listRemoveNode(&thread->toqueue);
+      thread->timer.timedout = true;
+      thread->setThreadRunning();
+      expired = true;
+    }
+    unlock();
+
+    if(expired) {
+      threadMakeRunnable(thread);
+    }
   }
 
   // release corresponding mutex. 
-  void mutexUnlock(xthread * current, xqueue * pqueue) {
+  void mutexUnlock(xthread * current) {
     int mytid = current->getTid();
     xthread * thread = NULL;
   
@@ -124,28 +173,59 @@ checkagain:
 
     // Check the waiters;
     if(hasWaiters()) {
-      // dequeue the first item
+      // Hand the mutex to the first waiter directly, it stays locked.
+      // Otherwise, all waiters and new comers would fight for it again.
       thread = dequeueWaitlist(); 
+      owner = thread->getTid();
+    }
+    else {
+      markLockFree();
     }
-
-    // Set the lock status
-    markLockFree();
 
     unlock();
 
     // Enqueue the thread after unlock() to avoid possible deadlock
     // The corresponding queue have locks to avoid contention
     if(thread) {
-      // Put the waiter into the corresponding pqueue
+      // Put the waiter into the run queue of current process
       // Note: donot put it into the shared queue since normally
       // current process will own this page.
       // We can possibly improve the performance by doing so.
-      pqueue->enqueue(thread);
+      threadMakeRunnable(thread);
     }
 
     return;
   }
 
+  // Wait morphing: threads woken up from a condition variable are moved onto
+  // the waitlist, instead of running only to fight for the mutex again.
+  // If the mutex is free, the first one owns it at once. Either way, every
+  // thread owns the mutex when it runs again, see xcondvar::condWait.
+  void mutexRequeue(lnode * list) {
+    xthread * thread = NULL;
+    lnode * node;
+
+    lock();
+    while((node = listRetrieveItem(list)) != NULL) {
+      xthread * waiter = container_of(node, xthread, toqueue);
+
+      if(status == MUTEX_STATUS_UNLOCKED) {
+        markLocked();
+        owner = waiter->getTid();
+        waiter->setThreadRunning();
+        thread = waiter;
+      }
+      else {
+        enqueueWaitlist(waiter);
+      }
+    }
+    unlock();
+
+    if(thread) {
+      threadMakeRunnable(thread);
+    }
+  }
+
   // Destory a mutex by simply set it to un-initialized status
   // Note: no need to free the memory, user should take care this
   void mutexDestroy(void) {
@@ -157,6 +237,21 @@ checkagain:
   }
 
 private:
+  // Take the mutex if it is free, and release the spin lock in that case.
+  // Note: lock must be held to call this function
+  inline bool tryAcquire(xthread * current) {
+    if(status != MUTEX_STATUS_UNLOCKED) {
+      return false;
+    }
+
+    // Set the status to be locked and set the owner to current thread.
+    markLocked();
+    owner = current->getTid();
+
+    unlock();
+    return true;
+  }
+
   // Set this mutex to inited status.
   inline void setInited(void) {
     init = MAGIC;
@@ -240,7 +335,7 @@ struct pth_mutex_st {
 };
 
 */
-  // WE should make sure that the size cannot be larger than pthread_mutex_t.
+  // WE should make sure that the size cannot be larger than an entry of xsynctable.
   // NOTE: otherwise, one field can be modified silently, a bug we found in debugging!
   spinlock lck;   // spin lock used to 
   int      status;  // What is the status of lock
@@ -248,6 +343,7 @@ struct pth_mutex_st {
   int      owner;   // Who is owning this lock 
   // To avoid the problems of uninitialize, we could use a 
   // magic number to check whether one mutex is initialized or not.
+  // A new entry of xsynctable is zeroed, so it is not initialized.
   int      init;    // whether the lock has been initialized or not.
 };
 
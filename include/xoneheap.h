@@ -47,6 +47,7 @@ public:
   void * startProtection(void) {getHeap()->startProtection(); }
   void * stopProtection(void) {getHeap()->stopProtection(); }
   void setMemoryUnowned(void) { getHeap()->setMemoryUnowned(); }
+  void releasePages(int coreid) { getHeap()->releasePages(coreid); }
 
   void * malloc (size_t sz) { return getHeap()->malloc(sz); }
   void free (void * ptr) { getHeap()->free(ptr); }
@@ -0,0 +1,151 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xpoller.h
+ * @brief:  The epoll instance of one core, where user threads blocked on sockets
+ *          register their interest, see xio.h. Every registration is one-shot,
+ *          so an event is reported to exactly one scheduler even if schedulers
+ *          of other cores poll this instance too.
+ *
+ *          An idle scheduler with waiters sleeps in epoll_wait instead of the
+ *          futex. Then wakers write the eventfd, which is the only level-triggered
+ *          entry, so that only the owner has to consume it.
+ *          Processes are cloned with CLONE_FILES, thus all of them share the fds.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XPOLLER_H_
+#define _XPOLLER_H_
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "xdefines.h"
+#include "xatomic.h"
+#include "xtimerwheel.h"
+#include "realfuncs.h"
+#include "log.h"
+
+class xpoller {
+public:
+  // The data of the eventfd, fds are never negative.
+  enum { WAKE_FD = -1 };
+
+  xpoller() {
+    epfd = -1;
+    wakefd = -1;
+    waiters = 0;
+    lastpoll = 0;
+  }
+
+  void initialize(void) {
+    struct epoll_event event;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(epfd < 0 || wakefd < 0) {
+      PRFATAL("can't create the epoll instance\n");
+    }
+
+    event.events = EPOLLIN;
+    event.data.fd = WAKE_FD;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &event);
+  }
+
+  int getWakeFd(void) {
+    return wakefd;
+  }
+
+  // Ask to be notified once when the fd is ready for the events.
+  // Return false with errno set if the fd can't be polled.
+  bool watch(int fd, unsigned int events, bool registered) {
+    struct epoll_event event;
+    int op = registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    event.events = events | EPOLLONESHOT;
+    event.data.fd = fd;
+
+    if(epoll_ctl(epfd, op, fd, &event) == 0) {
+      return true;
+    }
+
+    // The fd has been closed and reused without us knowing, or the other way around.
+    if(errno == ENOENT || errno == EEXIST) {
+      op = (op == EPOLL_CTL_MOD) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+      return epoll_ctl(epfd, op, fd, &event) == 0;
+    }
+
+    return false;
+  }
+
+  void unwatch(int fd) {
+    struct epoll_event event;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &event);
+  }
+
+  // Wait for events at most timeoutms milliseconds, 0 means not at all.
+  int poll(struct epoll_event * events, int max, int timeoutms) {
+    int num;
+
+    lastpoll = xtimerwheel::now();
+    num = WRAP(epoll_wait)(epfd, events, max, timeoutms);
+
+    return num < 0 ? 0 : num;
+  }
+
+  // Only the owner consumes the wakeups.
+  void drainWakeups(void) {
+    unsigned long long value;
+
+    WRAP(read)(wakefd, &value, sizeof(value));
+  }
+
+  // Count of fds that have waiting threads, only a hint without locks.
+  bool hasWaiters(void) {
+    return waiters != 0;
+  }
+
+  void addWaiter(void) {
+    xatomic::increment(&waiters);
+  }
+
+  void removeWaiter(void) {
+    xatomic::decrement(&waiters);
+  }
+
+  // Whether a busy scheduler should check the events now.
+  bool isDue(unsigned long long now) {
+    return waiters != 0 && now - lastpoll >= xdefines::IO_POLL_USECS * 1000ULL;
+  }
+
+private:
+  int epfd;
+  int wakefd;
+  volatile unsigned long waiters;
+  volatile unsigned long long lastpoll;
+  char padding[64];
+};
+
+#endif /* _XPOLLER_H_ */
@@ -159,6 +159,9 @@ public:
   // Set all pages owner for one block of heap memory.
   void setPagesOwner(void * addr, int size);
 
+  // Give up all pages owned by the specified core, which must be current one.
+  void releasePages(int coreid);
+
   // Start the protection from now on
   void startProtection (void) {
     //fprintf(stderr, "%d: isHeap %d\n", getpid(), _isHeap);
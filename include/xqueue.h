@@ -23,6 +23,7 @@
 #include "xplock.h"
 #include "spinlock.h"
 #include "process.h"
+#include "xscheduler.h"
 
 //#define USE_MUTEX_LOCK 1
 // Looks like that the implementation of mutex is much more efficient than
@@ -34,12 +35,30 @@ public:
     //fprintf(stderr, "threadqueue constructor\n");
     // Initialize the queue list
     listInit(&queue);
+    length = 0;
+
+    // By default, it is not owned by any process.
+    owner = -1;
+    forward = NULL;
   } 
+
+  // Set the core whose scheduler is serving this queue.
+  void setOwner(int coreid) {
+    owner = coreid;
+  }
   
   // push a thread to queue
   void enqueue(xthread * thread) {
     lock();
+    if(forward) {
+      xqueue * to = forward;
+      unlock();
+      to->enqueue(thread);
+      return;
+    }
+
     listInsertTail(&thread->toqueue, &queue); 
+    length++;
     //fprintf(stderr, "ENQUEUE %d: queue %p queue->prev %p queue->next %p\n", getpid(), &queue, queue.prev, queue.next);
     if(hasWork() != true) {
       fprintf(stderr, "************WRONG!!!%d (on lock %p): enqueue thread %p with tid %d. After queue.prev %p queue %p queue.next %p\n", getpid(), &qlock, &thread->toqueue, thread->getTid(), queue.prev, &queue, queue.next);
@@ -47,18 +66,42 @@ public:
     }
    // PRWRN("enqueue thread %p with tid %d ater hasWorkd %d\n", thread, thread->getTid(), hasWork());
     unlock();
+
+    // Releasing the lock is not a full barrier, and the thread must be
+    // visible before we check whether the owner is sleeping, see xidle.h.
+    xatomic::memoryBarrier();
+
+    // Wake up the owner if it is sleeping.
+    schedulerWakeup(owner);
   }
 
   // Add the whole list into the queue
   void enqueueAllList(lnode * list) {
+    int items = 0;
+
+    for(lnode * node = list->next; node != list; node = node->next) {
+      items++;
+    }
    
     lock();
+    if(forward) {
+      xqueue * to = forward;
+      unlock();
+      to->enqueueAllList(list);
+      return;
+    }
+
+    length += items;
 
     // Insert the list to the tail of queue and skip "list" node.
     listInsertListTail(list, &queue);
 
 
     unlock();
+
+    // The threads must be visible before we check the owner, see enqueue.
+    xatomic::memoryBarrier();
+    schedulerWakeup(owner);
   }
 
   // Pop a thread from the queue
@@ -72,6 +115,7 @@ public:
     if(hasWork()) {
       node = queue.next;
       listRemoveNode(node);
+      length--;
     
       // Check the list.
       //listPrintItems(&queue, 8);
@@ -87,11 +131,51 @@ public:
     return thread;
   }
 
+  // The owner is going to park. Move all threads to the specified queue, 
+  // and forward the threads enqueued later too, until the queue is opened again.
+  void close(xqueue * to) {
+    struct lnode moved;
+
+    listInit(&moved);
+
+    lock();
+    forward = to;
+    if(hasWork()) {
+      listRetrieveAllItems(&moved, &queue);
+      length = 0;
+    }
+    unlock();
+
+    if(!isListEmpty(&moved)) {
+      to->enqueueAllList(&moved);
+    }
+  }
+
+  // The owner is active again.
+  void open(void) {
+    lock();
+    forward = NULL;
+    unlock();
+  }
+
+  // Remove the specified thread, which must be in this queue.
+  void remove(xthread * thread) {
+    lock();
+    listRemoveNode(&thread->toqueue);
+    length--;
+    unlock();
+  }
+
   // Check whether the queue is empty or not
   bool hasWork(void) {
     return (!isListEmpty(&queue));
   }
 
+  // How many threads are in the queue. It is a hint without the lock.
+  int getLength(void) {
+    return length;
+  }
+
   void * getLock(void) {
     return &qlock;
   }
@@ -121,13 +205,23 @@ private:
   }
 
   // which core is located, this will affect the heap allocation too.
+  // Schedulers of all cores hit the run queues all the time. FIFO locks
+  // (ticketlock, mcslock) stall everyone once a waiting process is descheduled
+  // by the kernel, so we use ttaslock (see tests/lockbench).
 #ifdef USE_MUTEX_LOCK
   xplock qlock;
 #else
-  spinlock qlock;
+  ttaslock qlock;
 #endif
 
   struct lnode queue;
+  volatile int length;
+
+  // Which core's scheduler is serving this queue, -1 if all of them.
+  int owner;
+
+  // Where to put threads when the owner is parked, see close().
+  xqueue * volatile forward;
 
   // padding to avoid the false sharing problem.
   char padding[128];
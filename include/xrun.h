@@ -28,8 +28,10 @@
 #ifndef _XRUN_H_
 #define _XRUN_H_
 
+#include <errno.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <iostream>
 #include <fstream>
 
@@ -57,7 +59,15 @@
 #include "xmutex.h"
 #include "xcondvar.h"
 #include "xbarr.h"
+#include "xrwlock.h"
+#include "xsem.h"
+#include "xsynctable.h"
+#include "xfutex.h"
 #include "xsignal.h"
+#include "xcpus.h"
+#include "xthreadpool.h"
+#include "xio.h"
+#include "xaio.h"
 #include "log.h"
 
 class xrun {
@@ -70,6 +80,7 @@ private:
     proc (process::getInstance()),
     procmap (processmap::getInstance())
   {
+    privateStack = NULL;
   }
 
 public:
@@ -115,6 +126,18 @@ public:
     // load balance in the future. Now those private queues
     // are allocated in the shared space use mmap. 
     procmap.initPrivateQueues(); 
+
+    // Stacks and caches of joined threads.
+    xstacks::getInstance().initialize();
+    xthreadpool::getInstance().initialize();
+
+    // Sockets and files used by user threads.
+    xio::getInstance().initialize();
+    xaio::getInstance().initialize();
+
+    // The state of synchronization objects.
+    xsynctable::getInstance().initialize();
+    xfutex::getInstance().initialize();
     
     // Initialize the first process
     proc.initialize(pid, 0);
@@ -211,8 +234,9 @@ public:
 
     
     //while(1) ;
-    // Create other processes and binding them to specific core
-    createOtherProcesses(CPU_CORES);  
+    // Create other processes and binding them to specific core.
+    // More processes will be created when threads are waiting, see xscheduler.cpp.
+    createOtherProcesses(procmap.getMinCores());  
 
     //fprintf(stderr, "%d: after create other processes\n", getpid());
     // Note: we can't do this before forking processes to avoid stack smashing.
@@ -432,12 +456,27 @@ public:
     // Check whether I am running on the bounded core.
     assert(process::getInstance().getCoreId() == coreid);
 
-    for(int i = 1; i < CPU_CORES; i++) {
+    // Report how the schedulers spent their idle time.
+    if(getenv("PROTO_STATS")) {
+      for(int i = 0; i < CPU_CORES; i++) {
+        procmap.getIdle(i)->printStatistics(i);
+        procmap.getAffinityStats(i)->printStatistics(i);
+        procmap.getSyscallState(i)->printStatistics(i);
+      }
+      xsynctable::getInstance().printStatistics();
+    }
+
+    // Parked processes and spares are killed too. Some cores may have no process.
+    for(int i = 1; i < PROCESS_SLOTS; i++) {
       pid_t id = procmap.getPid(i);
-      kill(id, SIGKILL);
+      if(id > 0) {
+        kill(id, SIGKILL);
+      }
       //if(id > 0)
       //xsignal::getInstance().signalKill(id);
     }
+
+    xaio::getInstance().stopHelpers();
   }
 
   /// @brief create processs and binding them to different cores.
@@ -446,8 +485,18 @@ public:
 
     // Create other processes and binding them to specific cores
     for(i = 1; i < cores; i++) {
+      if(procmap.claimCore(i, CORE_INACTIVE)) {
+        proc.create(i);
+      }
+    }
+
+    // Spares are waiting for blocked cores from the beginning.
+    for(i = CPU_CORES; i < PROCESS_SLOTS; i++) {
       proc.create(i);
     }
+
+    // Helpers of file calls if io_uring is not available.
+    xaio::getInstance().startHelpers();
   }
 
   /// @return the "thread" id.
@@ -474,10 +523,14 @@ public:
   // @brief: free the private stack after usage.
   // Since the allocation happened before forkings, 
   // every process should called this after no usage
+  // Processes created later may find it released already.
   void freePrivateStack(void) {
     long size = (intptr_t)stackEnd - (intptr_t)stackStart;
 
-    MUNMAP(privateStack, size);
+    if(privateStack) {
+      MUNMAP(privateStack, size);
+      privateStack = NULL;
+    }
   }
 
   /// @brief Save context for current thread
@@ -501,29 +554,29 @@ public:
     return thread; 
   }
 
-  // Insert a thread to the global queue
-  void insertGlobalQueue(xthread * thread) {
+  // Insert a thread to the run queue of current process.
+  // Idle processes will steal it from there.
+  void insertRunQueue(xthread * thread) {
     thread->setThreadRunning();
-    squeue->enqueue(thread);
+    threadMakeRunnable(thread);
   }
  
   /// @brief Spawn a thread.
   /// @return an opaque object used by sync.
-  inline pthread_t spawn (void * threadFunc, void * arg)
+  inline pthread_t spawn (void * threadFunc, void * arg, size_t stacksize)
   {
     // check whether we have call postinit
     if(postinitialized == false) {
       postinit();
     }
 
+    threadPreemptDisable();
+
     int tid = threadsmap.allocTid();
     
-    void * ptr = MALLOC_SHARED(sizeof(xthread));
- 
-    // Create a block of memory to hold this task.
-    PRDBG("%d: spawning user thread %p. ptr %p to 0x%x\n", getpid(), threadFunc, ptr, (intptr_t)ptr + sizeof(xthread));
-    //printf("spawn new thread %d\n", tid);
-    xthread *  thread = new (ptr)xthread(tid);
+    // Get a thread with its stack, normally a joined one on this core.
+    xthread *  thread = xthreadpool::getInstance().alloc(proc.getCoreId(), tid, stacksize);
+    PRDBG("%d: spawning user thread %p. thread %p\n", getpid(), threadFunc, thread);
  
     // Register this thread block
     threadsmap.registerThread(tid, thread, true);
@@ -531,11 +584,12 @@ public:
     // Spawn a thread 
     thread->spawn(threadFunc, arg);
 
-    // Insert this thread into the global queue, then
-    // an idle process will pickup this thread and try to run that.
+    // Insert this thread into the deque of current process, then
+    // an idle process will steal this thread and try to run that.
     //PRWRN("%d: spawning user thread %p (tid %d). ptr %p to 0x%x\n", getpid(), threadFunc, tid, ptr, (intptr_t)ptr + sizeof(xthread));
-    insertGlobalQueue(thread);
+    insertRunQueue(thread);
 
+    threadPreemptEnable();
     return tid;
   }
 
@@ -544,7 +598,9 @@ public:
     // Now we have to find out which thread we are going to join
     xthread * thread = proc.getCurrent();
     //PRWRN("thread join tid %d\n", tid); 
+    threadPreemptDisable();
     thread->join(thread, tid, result);
+    threadPreemptEnable();
     PRDBG("thread join tid %d\n", tid); 
   }
 
@@ -563,15 +619,255 @@ public:
     //_thread.thread_kill(this, v, sig);
   } 
 
+  /// @brief Whether current thread is a user thread scheduled by us, which can be parked.
+  bool isUserThread(void) {
+    xthread * current;
+
+    if(!postinitialized) {
+      return false;
+    }
+
+    current = proc.getCurrent();
+    return current != NULL && current != proc.getScheduler();
+  }
+
+  /// @brief Sleep until the deadline on CLOCK_MONOTONIC, letting others run on this core.
+  /// @return false if current thread is not scheduled by us, then it should sleep in the kernel.
+  bool sleep(unsigned long long deadline) {
+    if(!isUserThread()) {
+      return false;
+    }
+
+    threadPreemptDisable();
+    threadSleep(deadline);
+    threadPreemptEnable();
+    return true;
+  }
+
+  /// @brief Let other threads waiting for current core run first.
+  void yield(void) {
+    if(!isUserThread()) {
+      return;
+    }
+
+    threadPreemptDisable();
+    threadYield();
+    threadPreemptEnable();
+  }
+
+  /// @brief Current thread is entering a syscall which may block the process, 
+  /// then a spare process can serve the core meanwhile, see xscheduler.cpp.
+  /// @return false if current thread is not scheduled by us.
+  bool syscallEnter(void) {
+    if(!isUserThread()) {
+      return false;
+    }
+
+    threadSyscallEnter();
+    return true;
+  }
+
+  /// @brief The syscall has returned. errno of the syscall is kept.
+  void syscallExit(void) {
+    int olderrno = errno;
+
+    threadSyscallExit();
+    errno = olderrno;
+  }
+
+  /// @brief Read or write a file through the I/O engine, which parks current thread
+  /// until the call is done, see xaio.h. The offset is -1 for the current position.
+  /// @return false if the caller should make the syscall itself.
+  bool fileAccess(int op, int fd, void * buf, size_t count, long long offset, ssize_t * ret) {
+    xaio & aio = xaio::getInstance();
+    long result;
+    bool done;
+
+    if(!aio.isEnabled() || !isUserThread() || !xio::getInstance().isFile(fd)) {
+      return false;
+    }
+
+    threadPreemptDisable();
+    done = aio.access(proc.getCurrent(), proc.getCoreId(), op, fd, buf, count, offset, &result);
+    threadPreemptEnable();
+
+    if(!done) {
+      return false;
+    }
+
+    if(result < 0) {
+      errno = -result;
+      result = -1;
+    }
+
+    *ret = result;
+    return true;
+  }
+
+  /// @brief Whether a call on the fd should park current thread when it would block, see xio.h.
+  bool ioManage(int fd, int flags = 0) {
+    if(!postinitialized || (flags & MSG_DONTWAIT)) {
+      return false;
+    }
+
+    return xio::getInstance().manage(fd);
+  }
+
+  /// @brief fcntl(F_GETFL) and fcntl(F_SETFL) of the user, see xio.h.
+  int ioGetFlags(int fd, int flags) {
+    return postinitialized ? xio::getInstance().getFlags(fd, flags) : flags;
+  }
+
+  int ioSetFlags(int fd, int flags) {
+    return postinitialized ? xio::getInstance().setFlags(fd, flags) : flags;
+  }
+
+  /// @brief ioctl(FIONBIO) of the user.
+  /// @return false if the kernel should change the mode of the fd.
+  bool ioSetNonblock(int fd, bool nonblock) {
+    return postinitialized && xio::getInstance().setNonblock(fd, nonblock);
+  }
+
+  /// @brief A call on a managed fd has failed. If it would block, wait until the fd is ready.
+  /// @return true if the call should be tried again.
+  bool ioWait(int fd, unsigned int events) {
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      return false;
+    }
+
+    ioWaitFd(fd, events, 0);
+    return true;
+  }
+
+  /// @brief Wait for a nonblocking connect on a managed fd to finish.
+  int ioConnect(int fd) {
+    struct pollfd pfd;
+    socklen_t len = sizeof(int);
+    int error = 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    do {
+      ioWaitFd(fd, EPOLLOUT, 0);
+      pfd.revents = 0;
+    } while(WRAP(poll)(&pfd, 1, 0) == 0);
+
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error != 0) {
+      errno = error;
+      return -1;
+    }
+
+    return 0;
+  }
+
+  /// @brief poll, which parks a user thread while no fd is ready.
+  int poll(struct pollfd * fds, nfds_t nfds, int timeout) {
+    unsigned long long deadline = ioDeadline(timeout);
+    int ret;
+
+    if(!isUserThread()) {
+      return WRAP(poll)(fds, nfds, timeout);
+    }
+
+    while((ret = WRAP(poll)(fds, nfds, 0)) == 0 && timeout != 0) {
+      threadPreemptDisable();
+      ret = xio::getInstance().waitPoll(proc.getCurrent(), proc.getCoreId(), fds, nfds, deadline);
+      threadPreemptEnable();
+
+      if(ret == ETIMEDOUT) {
+        return 0;
+      }
+
+      // Some fds are out of our table, leave it to the kernel.
+      if(ret == EINVAL) {
+        return WRAP(poll)(fds, nfds, ioTimeout(timeout, deadline));
+      }
+    }
+
+    return ret;
+  }
+
+  /// @brief epoll_wait, which parks a user thread until the epoll fd is readable.
+  int epoll_wait(int epfd, struct epoll_event * events, int maxevents, int timeout) {
+    unsigned long long deadline = ioDeadline(timeout);
+    int ret;
+
+    if(!isUserThread()) {
+      return WRAP(epoll_wait)(epfd, events, maxevents, timeout);
+    }
+
+    while((ret = WRAP(epoll_wait)(epfd, events, maxevents, 0)) == 0 && timeout != 0) {
+      ret = ioWaitFd(epfd, EPOLLIN, deadline);
+
+      if(ret == ETIMEDOUT) {
+        return 0;
+      }
+
+      if(ret == EINVAL) {
+        return WRAP(epoll_wait)(epfd, events, maxevents, ioTimeout(timeout, deadline));
+      }
+    }
+
+    return ret;
+  }
+
+  /// @brief The fd is going to be closed.
+  void ioClose(int fd) {
+    xio::getInstance().close(fd);
+  }
+
+private:
+  // Deadline of a timeout in milliseconds of poll, 0 if it never expires.
+  static unsigned long long ioDeadline(int timeout) {
+    return (timeout > 0) ? xtimerwheel::now() + timeout * 1000000ULL : 0;
+  }
+
+  // What is left of the timeout, in milliseconds and rounded up.
+  static int ioTimeout(int timeout, unsigned long long deadline) {
+    unsigned long long now = xtimerwheel::now();
+
+    if(timeout <= 0) {
+      return timeout;
+    }
+
+    return (deadline > now) ? (int)((deadline - now + 999999ULL) / 1000000ULL) : 0;
+  }
+
+  // Park current thread until the fd may be ready, or the deadline has passed.
+  // Threads that can't be parked wait in the kernel.
+  int ioWaitFd(int fd, unsigned int events, unsigned long long deadline) {
+    struct pollfd pfd;
+    int ret;
+
+    if(!isUserThread()) {
+      pfd.fd = fd;
+      pfd.events = events;
+      pfd.revents = 0;
+      return WRAP(poll)(&pfd, 1, -1) < 0 ? EINVAL : 0;
+    }
+
+    threadPreemptDisable();
+    ret = xio::getInstance().waitFd(proc.getCurrent(), proc.getCoreId(), fd, events, deadline);
+    threadPreemptEnable();
+    return ret;
+  }
+
+public:
   /* Heap-related functions. */
+  // A thread can't be preempted when it is holding the heap locks.
   inline void * malloc (size_t sz) {
+    threadPreemptDisable();
     void * ptr = xmemory::getInstance().malloc (heapid, sz);
+    threadPreemptEnable();
     return ptr;
   }
 
   // In fact, we can delay to open its information about heap.
   inline void free (void * ptr) {
+    threadPreemptDisable();
     xmemory::getInstance().free (heapid, ptr);
+    threadPreemptEnable();
   }
 
   inline size_t getSize (void * ptr) {
@@ -608,14 +904,53 @@ public:
     return xmemory::getInstance().mmap(postinitialized, addr, length, prot, flags, fd, offset); 
   }
 
-  /// Save an actual mutex address in original mutex.
   /// Mutex function calls. Here, we are using a totally different mechanism with
   /// sheriff or dthreads. In sheriff, we will have a private mapping
   /// for those synchronizations, thus it can't be used to synchronize different processes.
   /// However, proto will share a mapping between different processes. 
-  /// Thus, we can re-utilize the memory allocated from user space. 
+  /// The state of every object is kept in xsynctable, not in the memory allocated
+  /// from user space, which is protected and may be owned by another core.
+  /// Only the tag in the first word of the object is read, which may move us to
+  /// the owner of its page. Then the entry is added under the spin lock of the
+  /// table on that core, so no preemption.
+  void * getSyncState(void * object) {
+    void * state;
+
+    threadPreemptDisable();
+    state = xsynctable::getInstance().lookup(object);
+    threadPreemptEnable();
+    return state;
+  }
+
+  void dropSyncState(void * object) {
+    threadPreemptDisable();
+    xsynctable::getInstance().remove(object);
+    threadPreemptEnable();
+  }
+
+  xmutex * getMutex(pthread_mutex_t * mutex) {
+    return (xmutex *)getSyncState(mutex);
+  }
+
+  xcondvar * getCondvar(pthread_cond_t * cond) {
+    return (xcondvar *)getSyncState(cond);
+  }
+
+  // Barriers of pthread and proto.h, and latches too.
+  xbarr * getBarrier(void * barrier) {
+    return (xbarr *)getSyncState(barrier);
+  }
+
+  xrwlock * getRwlock(pthread_rwlock_t * rwlock) {
+    return (xrwlock *)getSyncState(rwlock);
+  }
+
+  xsem * getSemaphore(sem_t * sem) {
+    return (xsem *)getSyncState(sem);
+  }
+
   int mutex_init(pthread_mutex_t * mutex) {
-    xmutex * mx = (xmutex *)mutex;
+    xmutex * mx = getMutex(mutex);
     mx->mutexInit();
     return 0;
   }
@@ -631,84 +966,421 @@ public:
   }
 
   int mutex_lock(pthread_mutex_t * mutex) {
-    xmutex * mx = (xmutex *)mutex;
+    xmutex * mx = getMutex(mutex);
   //  fprintf(stderr, "mutex lock on %p\n", mutex);
+    threadPreemptDisable();
     mx->mutexLock(getCurrent());
+    threadPreemptEnable();
     return 0;
   }
 
+  int mutex_trylock(pthread_mutex_t * mutex) {
+    xmutex * mx = getMutex(mutex);
+    int ret;
+
+    threadPreemptDisable();
+    ret = mx->mutexTryLock(getCurrent());
+    threadPreemptEnable();
+    return ret;
+  }
+
   int mutex_unlock(pthread_mutex_t * mutex) {
-    xmutex * mx = (xmutex *)mutex;
+    xmutex * mx = getMutex(mutex);
     xthread * current = getCurrent();
-    xqueue  * pqueue = getCurrentPQueue();
-    mx->mutexUnlock(current, pqueue);
+    threadPreemptDisable();
+    mx->mutexUnlock(current);
+    threadPreemptEnable();
     return 0;
   }
 
+  int mutex_timedlock(pthread_mutex_t * mutex, const struct timespec * abstime) {
+    xmutex * mx = getMutex(mutex);
+    unsigned long long deadline = xtimerwheel::fromRealtime(abstime);
+    int ret;
+
+    threadPreemptDisable();
+    ret = mx->mutexLock(getCurrent(), deadline);
+    threadPreemptEnable();
+    return ret;
+  }
+
   int mutex_destroy(pthread_mutex_t * mutexptr) {
-    xmutex * mutex = (xmutex *)mutexptr;
+    xmutex * mutex = getMutex(mutexptr);
     mutex->mutexDestroy();
+    dropSyncState(mutexptr);
     return 0;
   }
   
   ///// conditional variable functions.
   void cond_init (pthread_cond_t * condptr) {
-    xcondvar * cond = (xcondvar *)condptr;
+    xcondvar * cond = getCondvar(condptr);
 
     cond->condInit();
   }
 
   void cond_destroy (pthread_cond_t * condptr) {
-    xcondvar * cond = (xcondvar *)condptr;
+    xcondvar * cond = getCondvar(condptr);
 
     cond->condDestroy();
+    dropSyncState(condptr);
   }
 
   /// FIXME: whether we can using the order like this.
   void cond_wait(pthread_cond_t * condptr, pthread_mutex_t * mutexptr) {
-    xcondvar * cond = (xcondvar *)condptr;
+    xcondvar * cond = getCondvar(condptr);
     xthread * current = getCurrent();
     //PRWRN("thread %d is waiting: condptr %p mutexptr %p\n", current->getTid(), condptr, mutexptr);
-    cond->condWait(mutexptr, current);
+    threadPreemptDisable();
+    cond->condWait(getMutex(mutexptr), current);
+    threadPreemptEnable();
    // PRERR("thread %d: condptr %p mutexptr %p\n", current->getTid(), condptr, mutexptr);
   }
 
+  int cond_timedwait(pthread_cond_t * condptr, pthread_mutex_t * mutexptr, const struct timespec * abstime) {
+    xcondvar * cond = getCondvar(condptr);
+    xthread * current = getCurrent();
+    unsigned long long deadline = xtimerwheel::fromRealtime(abstime);
+    int ret;
+
+    threadPreemptDisable();
+    ret = cond->condWait(getMutex(mutexptr), current, deadline);
+    threadPreemptEnable();
+    return ret;
+  }
+
   void cond_broadcast (pthread_cond_t * condptr) {
-    xcondvar * cond = (xcondvar *)condptr;
-    xqueue  * queue = getShareQueue();
+    xcondvar * cond = getCondvar(condptr);
     xthread * current = getCurrent();
-    cond->condBroadcast(current, queue);
+    threadPreemptDisable();
+    cond->condBroadcast(current);
+    threadPreemptEnable();
   }
 
   void cond_signal (pthread_cond_t * condptr) {
-    xcondvar * cond = (xcondvar *)condptr;
-    xqueue  * queue = getShareQueue();
+    xcondvar * cond = getCondvar(condptr);
     xthread * current = getCurrent();
-    cond->condSignal(current, queue);
+    threadPreemptDisable();
+    cond->condSignal(current);
+    threadPreemptEnable();
   }
 
   // Barrier support
-  int barrier_init(pthread_barrier_t  *barrier, unsigned int count) {
-    xbarr * barr = (xbarr *)barrier;
+  int barrier_init(void * barrier, unsigned int count) {
+    xbarr * barr = getBarrier(barrier);
 
-    barr->barrInit(count);
-    return 0;
+    return barr->barrInit(count);
   }
 
-  int barrier_destroy(pthread_barrier_t *barrier) {
-    xbarr * barr = (xbarr *)barrier;
+  int latch_init(void * latch, unsigned int count) {
+    xbarr * barr = getBarrier(latch);
+
+    return barr->latchInit(count);
+  }
+
+  int barrier_destroy(void * barrier) {
+    xbarr * barr = getBarrier(barrier);
 
     barr->barrDestroy();
+    dropSyncState(barrier);
     return 0;
   }
 
 
   int barrier_wait(pthread_barrier_t *barrier) {
-    xbarr * barr = (xbarr *)barrier;
-    xqueue  * queue = getShareQueue();
+    xbarr * barr = getBarrier(barrier);
+    xthread * current = getCurrent();
+    int ret;
+
+    threadPreemptDisable();
+    ret = barr->barrWait(current, proc.getCoreId());
+    threadPreemptEnable();
+    return ret;
+  }
+
+  // Split-phase barriers and latches, see proto.h.
+  int barrier_arrive(void * barrier, unsigned long * phase) {
+    xbarr * barr = getBarrier(barrier);
+    int ret;
+
+    threadPreemptDisable();
+    ret = barr->barrArrive(1, phase);
+    threadPreemptEnable();
+    return ret;
+  }
+
+  int barrier_await(void * barrier, unsigned long phase) {
+    xbarr * barr = getBarrier(barrier);
     xthread * current = getCurrent();
+    int ret;
+
+    threadPreemptDisable();
+    ret = barr->barrAwait(current, proc.getCoreId(), phase);
+    threadPreemptEnable();
+    return ret;
+  }
+
+  int latch_count_down(void * latch, unsigned int count) {
+    xbarr * barr = getBarrier(latch);
+    unsigned long phase;
+    int ret;
+
+    threadPreemptDisable();
+    ret = barr->barrArrive(count, &phase);
+    threadPreemptEnable();
+    return (ret == PTHREAD_BARRIER_SERIAL_THREAD) ? 0 : ret;
+  }
+
+  // Only the first phase of a latch is waited for.
+  int latch_try_wait(void * latch) {
+    return getBarrier(latch)->barrIsDone(0) ? 0 : EBUSY;
+  }
+
+  int latch_wait(void * latch) {
+    return barrier_await(latch, 0);
+  }
+
+  ///// semaphore functions, which return errno values.
+  int semaphore_init(sem_t * sem, unsigned int value) {
+    return getSemaphore(sem)->semInit(value);
+  }
 
-    barr->barrWait(current, queue);
+  int semaphore_destroy(sem_t * sem) {
+    getSemaphore(sem)->semDestroy();
+    dropSyncState(sem);
+    return 0;
+  }
+
+  int semaphore_wait(sem_t * sem) {
+    xsem * sm = getSemaphore(sem);
+    int ret;
+
+    threadPreemptDisable();
+    ret = sm->semWait(getCurrent());
+    threadPreemptEnable();
+    return ret;
+  }
+
+  int semaphore_timedwait(sem_t * sem, const struct timespec * abstime) {
+    xsem * sm = getSemaphore(sem);
+    unsigned long long deadline = xtimerwheel::fromRealtime(abstime);
+    int ret;
+
+    threadPreemptDisable();
+    ret = sm->semWait(getCurrent(), deadline);
+    threadPreemptEnable();
+    return ret;
+  }
+
+  int semaphore_trywait(sem_t * sem) {
+    return getSemaphore(sem)->semTryWait() ? 0 : EAGAIN;
+  }
+
+  int semaphore_post(sem_t * sem) {
+    xsem * sm = getSemaphore(sem);
+    int ret;
+
+    threadPreemptDisable();
+    ret = sm->semPost();
+    threadPreemptEnable();
+    return ret;
+  }
+
+  int semaphore_getvalue(sem_t * sem) {
+    return getSemaphore(sem)->semGetValue();
+  }
+
+  ///// futex functions, which return errno values as negative results like the syscall.
+  /// @brief Private futex calls of user threads are handled by us, see xfutex.h.
+  /// @return false if the call should be left to the kernel.
+  bool futex(int * uaddr, int op, int val, const struct timespec * timeout,
+             int * uaddr2, int val3, long * ret) {
+    xfutex & fx = xfutex::getInstance();
+    int cmd = op & FUTEX_CMD_MASK;
+    unsigned long long deadline = 0;
+
+    // Shared futexes are keyed by the file offset in the kernel, which works
+    // across our processes.
+    if(!postinitialized || !(op & FUTEX_PRIVATE_FLAG)) {
+      return false;
+    }
+
+    switch(cmd) {
+      case FUTEX_WAIT:
+      case FUTEX_WAIT_BITSET:
+        // Threads that we don't schedule can't be parked.
+        if(!isUserThread()) {
+          return false;
+        }
+
+        if(cmd == FUTEX_WAIT) {
+          val3 = FUTEX_BITSET_MATCH_ANY;
+        }
+        else if(val3 == 0) {
+          *ret = -EINVAL;
+          return true;
+        }
+
+        if(timeout != NULL) {
+          if(timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000L) {
+            *ret = -EINVAL;
+            return true;
+          }
+
+          // The timeout of FUTEX_WAIT is relative, that of FUTEX_WAIT_BITSET is absolute.
+          if(cmd == FUTEX_WAIT) {
+            deadline = xtimerwheel::now() + xtimerwheel::toNanoseconds(timeout);
+          }
+          else if(op & FUTEX_CLOCK_REALTIME) {
+            deadline = xtimerwheel::fromRealtime(timeout);
+          }
+          else {
+            deadline = xtimerwheel::toNanoseconds(timeout);
+          }
+
+          // 0 would never expire.
+          if(deadline == 0) {
+            deadline = 1;
+          }
+        }
+
+        threadPreemptDisable();
+        *ret = -fx.futexWait(getCurrent(), uaddr, val, val3, deadline);
+        threadPreemptEnable();
+        return true;
+
+      case FUTEX_WAKE:
+      case FUTEX_WAKE_BITSET:
+        if(cmd == FUTEX_WAKE) {
+          val3 = FUTEX_BITSET_MATCH_ANY;
+        }
+        else if(val3 == 0) {
+          *ret = -EINVAL;
+          return true;
+        }
+
+        threadPreemptDisable();
+        *ret = fx.futexWake(uaddr, val, val3);
+        threadPreemptEnable();
+        return true;
+
+      case FUTEX_REQUEUE:
+      case FUTEX_CMP_REQUEUE:
+        // The number of requeued waiters is passed in place of the timeout.
+        threadPreemptDisable();
+        *ret = fx.futexRequeue(uaddr, val, (int)(long)timeout, uaddr2,
+                               cmd == FUTEX_CMP_REQUEUE, val3);
+        threadPreemptEnable();
+        return true;
+
+      default:
+        // Waiters parked by us would never see the kernel's wakeups of
+        // FUTEX_WAKE_OP or PI futexes, so they are not supported.
+        PRWRN("private futex operation %d is not supported\n", cmd);
+        *ret = -ENOSYS;
+        return true;
+    }
+  }
+
+  /// @brief pthread_once on a private futex, so that threads waiting for the
+  /// initialization are parked. glibc waits on the word in the kernel directly.
+  int once(pthread_once_t * control, void (*routine)(void)) {
+    volatile int * word = (volatile int *)control;
+    int value;
+
+    while((value = *word) != ONCE_DONE) {
+      if(value == ONCE_INIT) {
+        if(cmpxchg(word, ONCE_INIT, ONCE_RUNNING) != ONCE_INIT) {
+          continue;
+        }
+
+        // The routine may throw, like the callable of std::call_once,
+        // then another thread can try again.
+        oncerunner runner(this, word);
+        routine();
+        runner.finish(ONCE_DONE);
+        break;
+      }
+
+      // Tell the running thread that someone is waiting.
+      if(value == ONCE_RUNNING
+         && cmpxchg(word, ONCE_RUNNING, ONCE_WAITING) != ONCE_RUNNING) {
+        continue;
+      }
+
+      long ret;
+      if(!futex((int *)word, FUTEX_WAIT_PRIVATE, ONCE_WAITING, NULL, NULL, 0, &ret)) {
+        xatomic::cpuRelax();
+      }
+    }
+
+    xatomic::memoryBarrier();
+    return 0;
+  }
+
+  ///// reader-writer lock functions.
+  int rwlock_init(pthread_rwlock_t * rwlock) {
+    xrwlock * rw = getRwlock(rwlock);
+
+    rw->rwlockInit();
+    return 0;
+  }
+
+  int rwlock_destroy(pthread_rwlock_t * rwlock) {
+    xrwlock * rw = getRwlock(rwlock);
+
+    rw->rwlockDestroy();
+    dropSyncState(rwlock);
+    return 0;
+  }
+
+  int rwlock_rdlock(pthread_rwlock_t * rwlock) {
+    xrwlock * rw = getRwlock(rwlock);
+    xthread * current = getCurrent();
+
+    threadPreemptDisable();
+    rw->rdLock(current, proc.getCoreId());
+    threadPreemptEnable();
+    return 0;
+  }
+
+  int rwlock_tryrdlock(pthread_rwlock_t * rwlock) {
+    xrwlock * rw = getRwlock(rwlock);
+    bool locked;
+
+    threadPreemptDisable();
+    locked = rw->rdTryLock(proc.getCoreId());
+    threadPreemptEnable();
+    return locked ? 0 : EBUSY;
+  }
+
+  int rwlock_wrlock(pthread_rwlock_t * rwlock) {
+    xrwlock * rw = getRwlock(rwlock);
+    xthread * current = getCurrent();
+
+    threadPreemptDisable();
+    rw->wrLock(current);
+    threadPreemptEnable();
+    return 0;
+  }
+
+  int rwlock_trywrlock(pthread_rwlock_t * rwlock) {
+    xrwlock * rw = getRwlock(rwlock);
+    xthread * current = getCurrent();
+    bool locked;
+
+    threadPreemptDisable();
+    locked = rw->wrTryLock(current);
+    threadPreemptEnable();
+    return locked ? 0 : EBUSY;
+  }
+
+  int rwlock_unlock(pthread_rwlock_t * rwlock) {
+    xrwlock * rw = getRwlock(rwlock);
+    xthread * current = getCurrent();
+
+    threadPreemptDisable();
+    rw->rwUnlock(current, proc.getCoreId());
+    threadPreemptEnable();
     return 0;
   }
 
@@ -728,6 +1400,45 @@ public:
     return dqueue;
   }
 private:
+  // States of a pthread_once_t, which is PTHREAD_ONCE_INIT at first.
+  enum { ONCE_INIT = 0, ONCE_RUNNING, ONCE_WAITING, ONCE_DONE };
+
+  // Publish the state when the routine of pthread_once returns, or reset it
+  // when the routine throws. Then wake up the waiting threads.
+  class oncerunner {
+  public:
+    oncerunner(xrun * run, volatile int * word) {
+      this->run = run;
+      this->word = word;
+      this->finished = false;
+    }
+
+    ~oncerunner() {
+      if(!finished) {
+        finish(ONCE_INIT);
+      }
+    }
+
+    void finish(int state) {
+      int value;
+      long ret;
+
+      do {
+        value = *word;
+      } while(cmpxchg(word, value, state) != value);
+      finished = true;
+
+      if(value == ONCE_WAITING) {
+        run->futex((int *)word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0, &ret);
+      }
+    }
+
+  private:
+    xrun * run;
+    volatile int * word;
+    bool finished;
+  };
+
   int allocTid(void) {
     return threadsmap.allocTid();
   } 
@@ -761,8 +1472,9 @@ private:
   // Private stack used by different processes.
   void * privateStack; 
 
-  // The global run queue for those threads which don't have preferred
-  // cores, for example, those newly created threads
+  // The global run queue. Runnable threads normally go to the 
+  // work-stealing deque of one process, this queue is only checked 
+  // after the private queue and the deque.
   xqueue * squeue;
   xqueue * dqueue; // Deadqueue, one thread's exit will put it to the dqueue.
   pid_t    pid; //Current process id.
@@ -0,0 +1,348 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xrwlock.h
+ * @brief:  Reader-writer lock, whose state is kept in xsynctable.h.
+ *          Every core has its own reader indicator on a separate cache line,
+ *          so readers on different cores don't bounce a shared counter.
+ *          A reader may leave on another core than the one it entered,
+ *          thus only the sum of all indicators means something.
+ *          The indicators don't fit into an entry of the table, they are
+ *          allocated from the shared heap when the lock is initialized.
+ *
+ *          Writers are preferred: once a writer has got the lock, new readers
+ *          wait until it leaves, and waiting writers go before waiting readers.
+ *          The writer waits for the current readers to drain, spinning
+ *          for a while and then parking. Like xmutex, waiting threads yield
+ *          their cores, and the lock is handed to them directly.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XRWLOCK_H_
+#define _XRWLOCK_H_
+
+#include <new>
+#include <string.h>
+
+#include "xdefines.h"
+#include "xcpus.h"
+#include "xatomic.h"
+#include "spinlock.h"
+#include "list.h"
+#include "xthread.h"
+#include "xscheduler.h"
+#include "memwrapper.h"
+
+class xrwlock {
+
+  enum { MAGIC = 0xCAFEBABE };
+
+  // Readers that have entered on one core.
+  class indicator {
+  public:
+    volatile unsigned long readers;
+    char padding[64 - sizeof(unsigned long)];
+  };
+
+  class rwstate {
+  public:
+    // Who is holding the lock for writing.
+    xthread * volatile writer;
+
+    // The writer that waits for the readers to drain.
+    xthread * drainer;
+
+    struct lnode readwait;
+    struct lnode writewait;
+
+    int cores;
+    char padding[64];
+
+    indicator counts[0];
+  };
+
+public:
+
+  void rwlockInit(void) {
+    lck.init();
+    setup();
+  }
+
+  void rwlockDestroy(void) {
+    if(isInited()) {
+      if(state->writer != NULL || hasReaders()) {
+        PRERR("Someone is still holding this rwlock when destroying?????\n");
+      }
+      FREE_SHARED(state);
+    }
+    setUninited();
+  }
+
+  // Try to enter as a reader without taking the spin lock.
+  bool rdTryLock(int coreid) {
+    getState();
+
+    if(state->writer == NULL) {
+      // The locked increment is a full barrier, so a writer that comes later
+      // must see us and the writer that came earlier is seen by us.
+      xatomic::increment(&state->counts[coreid].readers);
+      if(state->writer == NULL) {
+        return true;
+      }
+
+      rdUnlock(coreid);
+    }
+
+    return false;
+  }
+
+  void rdLock(xthread * current, int coreid) {
+    if(rdTryLock(coreid)) {
+      return;
+    }
+
+    lock();
+
+    // The writer can't change while we are holding the spin lock.
+    if(state->writer == NULL) {
+      xatomic::increment(&state->counts[coreid].readers);
+      unlock();
+      return;
+    }
+
+    current->setThreadLockWaiting();
+    listInsertTail(&current->toqueue, &state->readwait);
+
+    // The leaving writer counts us in before waking us up, see wrUnlock.
+    threadYieldHoldingLock(&lck);
+  }
+
+  bool wrTryLock(xthread * current) {
+    getState();
+
+    lock();
+    if(state->writer != NULL) {
+      unlock();
+      return false;
+    }
+
+    claim(current);
+    unlock();
+
+    if(hasReaders()) {
+      wrUnlock();
+      return false;
+    }
+    return true;
+  }
+
+  void wrLock(xthread * current) {
+    getState();
+
+    lock();
+    if(state->writer != NULL) {
+      current->setThreadLockWaiting();
+      listInsertTail(&current->toqueue, &state->writewait);
+
+      // The lock is handed to us directly. No reader can get in before that,
+      // so there is no need to wait for the readers again.
+      threadYieldHoldingLock(&lck);
+      return;
+    }
+
+    claim(current);
+    unlock();
+
+    waitReaders(current);
+  }
+
+  void rwUnlock(xthread * current, int coreid) {
+    if(state->writer == current) {
+      wrUnlock();
+    }
+    else {
+      rdUnlock(coreid);
+    }
+  }
+
+private:
+  // Allocate the indicators, spare processes have theirs too. The spin lock 
+  // must be held if the lock is not initialized explicitly.
+  void setup(void) {
+    int cores = PROCESS_SLOTS;
+    size_t size = sizeof(rwstate) + cores * sizeof(indicator);
+
+    state = (rwstate *)MALLOC_SHARED(size);
+    memset((void *)state, 0, size);
+    listInit(&state->readwait);
+    listInit(&state->writewait);
+    state->cores = cores;
+
+    // The state must be ready before others can see the magic.
+    xatomic::compilerBarrier();
+    setInited();
+  }
+
+  // Locks initialized by PTHREAD_RWLOCK_INITIALIZER are set up on their first use,
+  // since new entries of xsynctable are zeroed.
+  void getState(void) {
+    if(!isInited()) {
+      lock();
+      if(!isInited()) {
+        setup();
+      }
+      unlock();
+    }
+  }
+
+  // Take the lock for writing, then new readers won't get in.
+  // Note: lock must be held to call this function
+  void claim(xthread * current) {
+    state->writer = current;
+
+    // Readers check the writer after announcing themselves, so the writer
+    // must be visible before we check the readers.
+    xatomic::memoryBarrier();
+  }
+
+  bool hasReaders(void) {
+    int readers = 0;
+
+    for(int i = 0; i < state->cores; i++) {
+      readers += (int)state->counts[i].readers;
+    }
+
+    return readers != 0;
+  }
+
+  // Wait for the readers that got in before us.
+  void waitReaders(xthread * current) {
+    for(int i = 0; i < xdefines::MUTEX_SPIN_COUNT; i++) {
+      if(!hasReaders()) {
+        return;
+      }
+      xatomic::cpuRelax();
+    }
+
+    lock();
+
+    // The last reader checks the drainer while holding the spin lock.
+    if(!hasReaders()) {
+      unlock();
+      return;
+    }
+
+    state->drainer = current;
+    current->setThreadLockWaiting();
+    threadYieldHoldingLock(&lck);
+  }
+
+  void rdUnlock(int coreid) {
+    xthread * thread = NULL;
+
+    xatomic::decrement(&state->counts[coreid].readers);
+
+    // Wake up the writer if we are the last reader that it waits for.
+    if(state->writer != NULL) {
+      lock();
+      if(state->drainer != NULL && !hasReaders()) {
+        thread = state->drainer;
+        state->drainer = NULL;
+        thread->setThreadRunning();
+      }
+      unlock();
+
+      if(thread) {
+        threadMakeRunnable(thread);
+      }
+    }
+  }
+
+  void wrUnlock(void) {
+    struct lnode head;
+    xthread * thread;
+    lnode * node;
+
+    lock();
+
+    // Waiting writers go first.
+    if(!isListEmpty(&state->writewait)) {
+      thread = dequeue(&state->writewait);
+      state->writer = thread;
+      unlock();
+
+      threadMakeRunnable(thread);
+      return;
+    }
+
+    // Let all waiting readers in. They are counted on one core, which is fine
+    // since only the sum matters.
+    listInit(&head);
+    while((node = listRetrieveItem(&state->readwait)) != NULL) {
+      listInsertTail(node, &head);
+      xatomic::increment(&state->counts[0].readers);
+    }
+
+    state->writer = NULL;
+    unlock();
+
+    while((node = listRetrieveItem(&head)) != NULL) {
+      thread = container_of(node, xthread, toqueue);
+      thread->setThreadRunning();
+      threadMakeRunnable(thread);
+    }
+  }
+
+  xthread * dequeue(lnode * list) {
+    xthread * thread = container_of(listRetrieveItem(list), xthread, toqueue);
+
+    thread->setThreadRunning();
+    return thread;
+  }
+
+  inline void setInited(void) {
+    init = MAGIC;
+  }
+
+  inline void setUninited(void) {
+    init = 0;
+  }
+
+  inline bool isInited(void) {
+    return init == MAGIC;
+  }
+
+  void lock(void) {
+    lck.acquire();
+  }
+
+  void unlock(void) {
+    lck.release();
+  }
+
+  // It must fit into an entry of xsynctable, see libproto.cpp.
+  spinlock lck;
+  volatile unsigned int init;
+  rwstate * state;
+};
+
+#endif /* _XRWLOCK_H_ */
@@ -40,9 +40,15 @@
  //        fprintf(stderr, "%d: Swtiching from %d to %d\n",getpid(), old->tid, new->tid);
 //         PRWRN("%d: Swtiching from %d to %d",getpid(), old->tid, new->tid);
 
+// Switch to a new thread without any system call, see xcontext.cpp.
 #define THREAD_SWITCH(old,new) \
     THREAD_SWITCH_DEBUG(old, new) \
-    swapcontext(&((old)->ctx.context), &((new)->ctx.context));
+    (old)->ctx.switchTo(&((new)->ctx));
+
+// Switch the signal mask too, which is what swapcontext does.
+#define THREAD_SWITCH_SIGMASK(old,new) \
+    THREAD_SWITCH_DEBUG(old, new) \
+    (old)->ctx.switchToWithSigmask(&((new)->ctx));
 
 
 // FIXME in the future
@@ -62,9 +68,38 @@ void schedulerThread(void);
 
 // Yield to someone
 class xthread;
+class xqueue;
 void threadYieldHoldingLock(spinlock * lock);
 void threadYieldToRunQueue(xqueue * to);
 void threadYieldInitially(xqueue * to);
+
+// Runtime critical sections, in which current thread can't be preempted.
+void threadPreemptDisable(void);
+void threadPreemptEnable(void);
+
+// Let others waiting for current core run first.
+void threadYield(void);
+
+// Called by a new thread before running its function
+void threadStartRunning(void);
+
+// Put a thread into a run queue of current process
+void threadMakeRunnable(xthread * thread);
+
+// Timed waits, see xtimerwheel.h. The deadline is on CLOCK_MONOTONIC in nanoseconds.
+void threadArmTimer(xthread * thread, int type, void * object, unsigned long long deadline);
+bool threadCancelTimer(xthread * thread);
+
+// Park current thread until the deadline on CLOCK_MONOTONIC.
+void threadSleep(unsigned long long deadline);
+
+// Current thread may be blocked in the kernel between them, see the syscall handoff.
+void threadSyscallEnter(void);
+void threadSyscallExit(void);
+
+// Wake up the sleeping scheduler of specified core, -1 means anyone.
+void schedulerWakeup(int coreid);
+bool schedulerWakeupAny(void);
 };
 
 #endif
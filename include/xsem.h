@@ -0,0 +1,224 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xsem.h
+ * @brief:  Unnamed POSIX semaphores, whose state is kept in xsynctable.h like
+ *          that of mutexes. Posting or taking a token without contention is
+ *          one atomic operation, without the spin lock. A thread which can't
+ *          take a token parks on the waitlist and yields its core, and the
+ *          poster that sees waiters hands the token to the first one directly.
+ *          The poster adds the token before it checks the waiters, and the
+ *          waiter counts itself before it checks the tokens again, both with
+ *          locked instructions, so at least one of them sees the other.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XSEM_H_
+#define _XSEM_H_
+
+#include <errno.h>
+#include <semaphore.h>
+#include <limits.h>
+
+#include "xdefines.h"
+#include "xatomic.h"
+#include "spinlock.h"
+#include "list.h"
+#include "xthread.h"
+#include "xtimerwheel.h"
+#include "xscheduler.h"
+
+class xsem {
+  enum { MAGIC = 0xCAFEBABE };
+
+public:
+  int semInit(unsigned int value) {
+    if(value > SEM_VALUE_MAX) {
+      return EINVAL;
+    }
+
+    lck.init();
+    setup(value);
+    return 0;
+  }
+
+  // Take a token if there is one.
+  bool semTryWait(void) {
+    unsigned long value;
+
+    while((value = tokens) > 0) {
+      if(cmpxchg(&tokens, value, value - 1) == value) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Take a token, and park until there is one. If a deadline (CLOCK_MONOTONIC
+  // in nanoseconds) is given, the thread is taken off the waitlist when it
+  // expires, see semTimeout. 
+  int semWait(xthread * current, unsigned long long deadline = 0) {
+    if(semTryWait()) {
+      return 0;
+    }
+
+    lock();
+
+    // A semaphore used without sem_init has no tokens.
+    if(!isInited()) {
+      setup(0);
+    }
+
+    xatomic::increment(&waiters);
+
+    // A token may have been posted before we were counted.
+    if(semTryWait()) {
+      xatomic::decrement(&waiters);
+      unlock();
+      return 0;
+    }
+
+    if(deadline != 0 && deadline <= xtimerwheel::now()) {
+      xatomic::decrement(&waiters);
+      unlock();
+      return ETIMEDOUT;
+    }
+
+    current->setThreadSemWaiting();
+    listInsertTail(&current->toqueue, &waitlist);
+
+    if(deadline != 0) {
+      threadArmTimer(current, TIMER_SEM, this, deadline);
+    }
+
+    // When we are back, the poster has handed a token to us, 
+    // unless the deadline has passed.
+    threadYieldHoldingLock(&lck);
+
+    if(deadline != 0 && threadCancelTimer(current)) {
+      return ETIMEDOUT;
+    }
+    return 0;
+  }
+
+  // The timer of a waiter has expired. Take it off the waitlist if it is still
+  // waiting in the same wait, otherwise a token has been handed to it.
+  void semTimeout(xthread * thread, unsigned long seq) {
+    bool expired = false;
+
+    lock();
+    if(thread->timer.seq == seq && thread->status == THREAD_STATUS_SEM_WAITING) {
+      listRemoveNode(&thread->toqueue);
+      xatomic::decrement(&waiters);
+      thread->timer.timedout = true;
+      thread->setThreadRunning();
+      expired = true;
+    }
+    unlock();
+
+    if(expired) {
+      threadMakeRunnable(thread);
+    }
+  }
+
+  int semPost(void) {
+    xthread * thread = NULL;
+
+    if(tokens >= SEM_VALUE_MAX) {
+      return EOVERFLOW;
+    }
+
+    // The locked increment is a full barrier, see the waiter side in semWait.
+    xatomic::increment(&tokens);
+    if(waiters == 0) {
+      return 0;
+    }
+
+    // Waiters have set up the semaphore.
+    lock();
+
+    // Someone may have taken the token without waiting, then nobody is woken up.
+    if(!isListEmpty(&waitlist) && semTryWait()) {
+      lnode * node = listRetrieveItem(&waitlist);
+
+      thread = container_of(node, xthread, toqueue);
+      thread->setThreadRunning();
+      xatomic::decrement(&waiters);
+    }
+
+    unlock();
+
+    if(thread) {
+      threadMakeRunnable(thread);
+    }
+    return 0;
+  }
+
+  int semGetValue(void) {
+    return (int)tokens;
+  }
+
+  void semDestroy(void) {
+    if(waiters != 0) {
+      PRERR("Someone is still waiting on this semaphore when destroying?????\n");
+    }
+    setUninited();
+  }
+
+private:
+  // Note: lock must be held to call this function if the semaphore is in use.
+  void setup(unsigned long value) {
+    listInit(&waitlist);
+    waiters = 0;
+    tokens = value;
+    setInited();
+  }
+
+  inline void setInited(void) {
+    init = MAGIC;
+  }
+
+  inline void setUninited(void) {
+    init = 0;
+  }
+
+  inline bool isInited(void) {
+    return init == MAGIC;
+  }
+
+  void lock(void) {
+    lck.acquire();
+  }
+
+  void unlock(void) {
+    lck.release();
+  }
+
+  // It must fit into an entry of xsynctable, see libproto.cpp.
+  spinlock lck;
+  volatile unsigned long tokens;
+  volatile unsigned long waiters;
+  struct lnode waitlist;
+  unsigned int init;
+};
+
+#endif /* _XSEM_H_ */
@@ -0,0 +1,217 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xstacks.h
+ * @brief:  Stacks of user threads, carved from a dedicated shared region.
+ *          The region is reserved with MAP_NORESERVE before forking, so pages
+ *          are only committed when a thread touches them.
+ *          A stack slot is a power of two (16KB at least) and aligned to its size.
+ *          Like glibc, the lowest page of a slot is taken as the guard page, and
+ *          a small header is kept at the top. Free slots are kept on per-size lists
+ *          and never split, so a guard page stays at the same place.
+ *
+ *          mprotect only changes the page table of the calling process, so every
+ *          process protects the guard page by itself before it runs on a stack.
+ *          The header remembers which processes have done that.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XSTACKS_H_
+#define _XSTACKS_H_
+
+#include <new>
+#include <sys/mman.h>
+
+#include "xdefines.h"
+#include "spinlock.h"
+#include "memwrapper.h"
+
+class xstacks {
+  enum { MIN_SHIFT = 14 };   // 16KB
+  enum { CLASSES = 10 };     // 16KB ~ 8MB
+  enum { CHUNKS = xdefines::STACK_REGION_SIZE >> MIN_SHIFT };
+
+  // Kept at the top of a slot.
+  class stackheader {
+  public:
+    stackheader * next;
+    unsigned char guarded[MAX_CORES];
+  };
+
+  enum { HEADER_SIZE = (sizeof(stackheader) + 63) & ~63 };
+
+  // Shared by all processes.
+  class stackmeta {
+  public:
+    spinlock lock;
+    unsigned long used;
+    stackheader * freelist[CLASSES];
+
+    // Class of every 16KB chunk plus 1, 0 if the chunk is not used.
+    unsigned char classes[CHUNKS];
+  };
+
+public:
+  xstacks() {
+    base = NULL;
+    meta = NULL;
+  }
+
+  static xstacks& getInstance (void) {
+    static char buf[sizeof(xstacks)];
+    static xstacks * theOneTrueObject = new (buf) xstacks();
+    return *theOneTrueObject;
+  }
+
+  // Reserve the region before creating other processes.
+  void initialize(void) {
+    base = (char *)WRAP(mmap)(NULL, xdefines::STACK_REGION_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(base == MAP_FAILED) {
+      PRFATAL("can't reserve the stack region\n");
+    }
+
+    meta = (stackmeta *)MALLOC_SHARED(sizeof(stackmeta));
+    memset((void *)meta, 0, sizeof(stackmeta));
+    new (&meta->lock) spinlock;
+  }
+
+  // How much a stack of specified size can actually use, at least the size.
+  static int usableSize(size_t size) {
+    return slotSize(getClass(size)) - xdefines::PageSize - HEADER_SIZE;
+  }
+
+  // The largest stack that can be allocated, see pthread_attr_setstacksize.
+  static size_t maxSize(void) {
+    return slotSize(CLASSES - 1) - xdefines::PageSize - HEADER_SIZE;
+  }
+
+  // Allocate a stack and return its lowest usable address.
+  void * alloc(size_t size) {
+    int cls = getClass(size);
+    unsigned long slotsize = slotSize(cls);
+    stackheader * header;
+    char * slot;
+
+    meta->lock.acquire();
+
+    header = meta->freelist[cls];
+    if(header) {
+      meta->freelist[cls] = header->next;
+      slot = (char *)header + HEADER_SIZE - slotsize;
+    }
+    else {
+      // Slots are aligned to their size, so that we can find them from any address.
+      unsigned long offset = (meta->used + slotsize - 1) & ~(slotsize - 1);
+
+      if(offset + slotsize > xdefines::STACK_REGION_SIZE) {
+        meta->lock.release();
+        PRFATAL("the stack region is used up, try smaller stacks\n");
+      }
+
+      meta->used = offset + slotsize;
+      memset(&meta->classes[offset >> MIN_SHIFT], cls + 1, slotsize >> MIN_SHIFT);
+
+      slot = base + offset;
+      header = (stackheader *)(slot + slotsize - HEADER_SIZE);
+      memset(header->guarded, 0, sizeof(header->guarded));
+    }
+
+    meta->lock.release();
+
+    return slot + xdefines::PageSize;
+  }
+
+  // Put a stack back. The pages are kept, since it is probably reused soon.
+  void free(void * stack) {
+    char * slot = (char *)stack - xdefines::PageSize;
+    int cls = meta->classes[(slot - base) >> MIN_SHIFT] - 1;
+    stackheader * header = (stackheader *)(slot + slotSize(cls) - HEADER_SIZE);
+
+    meta->lock.acquire();
+    header->next = meta->freelist[cls];
+    meta->freelist[cls] = header;
+    meta->lock.release();
+  }
+
+  // Make sure that the guard page of the stack is protected in the process of specified core.
+  void guard(void * stack, int coreid) {
+    char * slot = (char *)stack - xdefines::PageSize;
+    stackheader * header;
+
+    if(!isInRegion(slot)) {
+      return;
+    }
+
+    header = (stackheader *)(slot + slotSize(meta->classes[(slot - base) >> MIN_SHIFT] - 1) - HEADER_SIZE);
+    if(!header->guarded[coreid]) {
+      mprotect(slot, xdefines::PageSize, PROT_NONE);
+      header->guarded[coreid] = 1;
+    }
+  }
+
+  // Whether the faulting address is on a guard page, that is, a stack overflow.
+  bool isGuardPage(void * addr) {
+    unsigned long offset;
+    int cls;
+
+    if(!isInRegion(addr)) {
+      return false;
+    }
+
+    offset = (char *)addr - base;
+    cls = meta->classes[offset >> MIN_SHIFT] - 1;
+    if(cls < 0) {
+      return false;
+    }
+
+    return (offset & (slotSize(cls) - 1)) < xdefines::PageSize;
+  }
+
+private:
+  bool isInRegion(void * addr) {
+    return base != NULL && (char *)addr >= base
+           && (char *)addr < base + xdefines::STACK_REGION_SIZE;
+  }
+
+  static unsigned long slotSize(int cls) {
+    return 1UL << (MIN_SHIFT + cls);
+  }
+
+  // The smallest class that can hold the specified size besides the guard page
+  // and the header. Larger stacks than maxSize are rejected before we come here.
+  static int getClass(size_t size) {
+    int cls = 0;
+
+    size += xdefines::PageSize + HEADER_SIZE;
+    while(cls < CLASSES - 1 && slotSize(cls) < size) {
+      cls++;
+    }
+
+    return cls;
+  }
+
+  char * base;
+  stackmeta * meta;
+};
+
+#endif /* _XSTACKS_H_ */
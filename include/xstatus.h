@@ -35,6 +35,10 @@ typedef enum {
   THREAD_STATUS_COND_WAITING,
   THREAD_STATUS_LOCK_WAITING,
   THREAD_STATUS_BARRIER_WAITING,
+  THREAD_STATUS_SEM_WAITING,
+  THREAD_STATUS_FUTEX_WAITING,
+  THREAD_STATUS_SLEEPING,
+  THREAD_STATUS_IO_WAITING,
   THREAD_STATUS_SIGNAL_HANDLING,
   THREAD_STATUS_JOINING, // Join the children threads
   THREAD_STATUS_DEAD       // Thread already exit but not cleaned up.
@@ -0,0 +1,363 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xsynctable.h
+ * @brief:  The state of mutexes, condition variables, barriers, rwlocks and
+ *          semaphores, which is kept out of the user objects. User objects
+ *          live in the protected heap or globals, which other cores can't
+ *          write without moving there, see xprotect.cpp. The state is kept
+ *          in records which are mapped shared and never protected, and an
+ *          index maps the address of the user object to its record.
+ *
+ *          Records never move, since waiters are parked on them. Only the
+ *          index is rebuilt, when it is filled up by live objects or by
+ *          the tombstones of destroyed ones. Lookups don't take any lock:
+ *          they probe the index and check that no rebuild has happened in
+ *          the meantime, otherwise they look again under the spin lock.
+ *          Records come from a preallocated array, and from the shared heap
+ *          once it is used up. Destroyed records are reused.
+ *
+ *          Objects are often freed or reused without being destroyed, so
+ *          the first word of the user object holds the tag of its record.
+ *          An object whose word doesn't match, like a new one with a static
+ *          initializer at the same address, gets a zeroed record. A zeroed
+ *          record is an uninitialized one, which is set up on its first use
+ *          like PTHREAD_MUTEX_INITIALIZER objects.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XSYNCTABLE_H_
+#define _XSYNCTABLE_H_
+
+#include <new>
+#include <string.h>
+
+#include "xdefines.h"
+#include "xatomic.h"
+#include "spinlock.h"
+#include "memwrapper.h"
+#include "log.h"
+
+class xsynctable {
+  enum { RECORDS = xdefines::SYNC_TABLE_ENTRIES };
+
+  // Keys of unused slots of the index. User objects are never at these addresses.
+  enum { KEY_EMPTY = 0, KEY_REMOVED = 1 };
+
+  // One record per cache line. A free record is linked by its object.
+  class syncrecord {
+  public:
+    volatile unsigned long tag;
+    char object[64 - sizeof(unsigned long)];
+  };
+
+  class syncslot {
+  public:
+    volatile unsigned long key;
+    syncrecord * record;
+  };
+
+  // Shared by all processes, unlike the table object in the library globals.
+  class syncstate {
+  public:
+    spinlock lock;
+
+    // Odd while the index is being rebuilt.
+    volatile unsigned long seq;
+
+    syncslot * volatile index;
+    volatile unsigned long mask;
+
+    // Live objects and tombstones in the index.
+    unsigned long count;
+    unsigned long removed;
+
+    // Records of the array that have been handed out, and the destroyed ones.
+    unsigned long used;
+    syncrecord * freelist;
+
+    unsigned long stamp;
+    unsigned long rebuilds;
+  };
+
+public:
+  enum { OBJECT_SIZE = sizeof(((syncrecord *)0)->object) };
+
+  xsynctable() {
+    records = NULL;
+    state = NULL;
+  }
+
+  static xsynctable& getInstance (void) {
+    static char buf[sizeof(xsynctable)];
+    static xsynctable * theOneTrueObject = new (buf) xsynctable();
+    return *theOneTrueObject;
+  }
+
+  // It must be mapped before other processes are created.
+  void initialize(void) {
+    records = (syncrecord *)MMAP_SHARED(sizeof(syncrecord) * RECORDS);
+    state = new (MALLOC_SHARED(sizeof(syncstate))) syncstate;
+    state->seq = 0;
+    state->count = 0;
+    state->removed = 0;
+    state->used = 0;
+    state->freelist = NULL;
+    state->stamp = 0;
+    state->rebuilds = 0;
+
+    // At most half of the index is used before it grows.
+    state->mask = RECORDS * 2 - 1;
+    state->index = allocIndex(RECORDS * 2);
+  }
+
+  // The state of the user object, which is added if it is not there.
+  // Reading the object may move the thread to the owner of its page, so it
+  // is done before the spin lock is taken. Then the thread stays there,
+  // since it can't be preempted, see getSyncState.
+  void * lookup(void * addr) {
+    unsigned long key = (unsigned long)addr;
+    unsigned long word = *(volatile unsigned long *)addr;
+    unsigned long seq = state->seq;
+    syncrecord * record;
+
+    xatomic::compilerBarrier();
+
+    if((seq & 1) == 0) {
+      syncslot * slot = find(key);
+
+      // x86 doesn't reorder loads, what we found is valid if no rebuild has
+      // started. Records are never freed, only reused.
+      if(slot != NULL) {
+        record = slot->record;
+        xatomic::compilerBarrier();
+        if(state->seq == seq && record->tag == word) {
+          return record->object;
+        }
+      }
+    }
+
+    state->lock.acquire();
+    record = lookupLocked(key);
+    state->lock.release();
+
+    return record->object;
+  }
+
+  // The user object is destroyed, the state is dropped.
+  void remove(void * addr) {
+    syncslot * slot;
+
+    state->lock.acquire();
+    slot = find((unsigned long)addr);
+    if(slot != NULL) {
+      freeRecord(slot->record);
+      slot->key = KEY_REMOVED;
+      state->count--;
+      state->removed++;
+    }
+    state->lock.release();
+  }
+
+  void printStatistics(void) {
+    fprintf(stderr, "synchronization objects %lu, index of %lu with %lu tombstones, %lu rebuilds\n",
+            state->count, state->mask + 1, state->removed, state->rebuilds);
+  }
+
+private:
+  static unsigned long hash(unsigned long key) {
+    return (key >> 3) * 2654435761UL;
+  }
+
+  static syncslot * allocIndex(unsigned long size) {
+    syncslot * index = (syncslot *)MALLOC_SHARED(sizeof(syncslot) * size);
+
+    if(index == NULL) {
+      PRFATAL("no memory for %lu synchronization objects\n", size / 2);
+    }
+    memset((void *)index, 0, sizeof(syncslot) * size);
+    return index;
+  }
+
+  // An index that has been dropped by a rebuild may still be read by a
+  // lookup, which will see the change of seq and discard what it found.
+  // The index never shrinks and rebuild sets the mask after it, so reading
+  // the mask first never takes a mask larger than the index.
+  syncslot * find(unsigned long key) {
+    unsigned long mask = state->mask;
+    xatomic::compilerBarrier();
+    syncslot * index = state->index;
+    unsigned long i = hash(key);
+
+    for(unsigned long n = 0; n <= mask; n++, i++) {
+      syncslot * slot = &index[i & mask];
+      unsigned long current = slot->key;
+
+      if(current == key) {
+        return slot;
+      }
+
+      if(current == KEY_EMPTY) {
+        break;
+      }
+    }
+
+    return NULL;
+  }
+
+  // Note: lock must be held to call this function.
+  syncrecord * lookupLocked(unsigned long key) {
+    volatile unsigned long * word = (volatile unsigned long *)key;
+    syncslot * slot = find(key);
+    syncrecord * record;
+
+    if(slot == NULL) {
+      record = allocRecord();
+      setTag(record, word);
+      insert(key, record);
+    }
+    else {
+      record = slot->record;
+
+      // The object has been initialized again without being destroyed.
+      if(record->tag != *word) {
+        setTag(record, word);
+      }
+    }
+
+    return record;
+  }
+
+  // The record must be zeroed and tagged before others can find it.
+  // Note: lock must be held to call this function.
+  void setTag(syncrecord * record, volatile unsigned long * word) {
+    unsigned long tag;
+
+    // Odd, so that it is never KEY_EMPTY or a zeroed user object.
+    tag = (++state->stamp * 2654435761UL) | 1;
+
+    memset(record->object, 0, sizeof(record->object));
+    record->tag = tag;
+    *word = tag;
+    xatomic::compilerBarrier();
+  }
+
+  // Note: lock must be held to call this function.
+  void insert(unsigned long key, syncrecord * record) {
+    unsigned long size = state->mask + 1;
+    syncslot * slot = NULL;
+
+    // Keep the index at most 3/4 full including tombstones, so that misses
+    // are short. Grow it if live objects take more than half.
+    if((state->count + state->removed + 1) * 4 > size * 3) {
+      rebuild((state->count + 1) * 2 > size ? size * 2 : size);
+    }
+
+    for(unsigned long i = hash(key); ; i++) {
+      slot = &state->index[i & state->mask];
+      if(slot->key == KEY_EMPTY || slot->key == KEY_REMOVED) {
+        break;
+      }
+    }
+
+    if(slot->key == KEY_REMOVED) {
+      state->removed--;
+    }
+
+    slot->record = record;
+    xatomic::compilerBarrier();
+    slot->key = key;
+    state->count++;
+  }
+
+  // Move the live objects to a new index, leaving the tombstones behind.
+  // Note: lock must be held to call this function.
+  void rebuild(unsigned long size) {
+    syncslot * old = state->index;
+    unsigned long oldsize = state->mask + 1;
+    syncslot * index = allocIndex(size);
+
+    for(unsigned long i = 0; i < oldsize; i++) {
+      unsigned long key = old[i].key;
+
+      if(key == KEY_EMPTY || key == KEY_REMOVED) {
+        continue;
+      }
+
+      for(unsigned long j = hash(key); ; j++) {
+        syncslot * slot = &index[j & (size - 1)];
+        if(slot->key == KEY_EMPTY) {
+          slot->key = key;
+          slot->record = old[i].record;
+          break;
+        }
+      }
+    }
+
+    // Lookups started before this will look again under the lock.
+    state->seq++;
+    xatomic::compilerBarrier();
+    state->index = index;
+    state->mask = size - 1;
+    state->removed = 0;
+    xatomic::compilerBarrier();
+    state->seq++;
+
+    state->rebuilds++;
+
+    // The first index is in the shared heap too.
+    FREE_SHARED(old);
+  }
+
+  // Note: lock must be held to call this function.
+  syncrecord * allocRecord(void) {
+    syncrecord * record = state->freelist;
+
+    if(record != NULL) {
+      state->freelist = *(syncrecord **)record->object;
+      return record;
+    }
+
+    if(state->used < RECORDS) {
+      return &records[state->used++];
+    }
+
+    // The array is used up, more records come from the shared heap.
+    record = (syncrecord *)MALLOC_SHARED(sizeof(syncrecord));
+    if(record == NULL) {
+      PRFATAL("no memory for synchronization objects, %lu are in use\n", state->count);
+    }
+    return record;
+  }
+
+  // Note: lock must be held to call this function.
+  void freeRecord(syncrecord * record) {
+    record->tag = 0;
+    *(syncrecord **)record->object = state->freelist;
+    state->freelist = record;
+  }
+
+  syncrecord * records;
+  syncstate * state;
+};
+
+#endif /* _XSYNCTABLE_H_ */
@@ -36,6 +36,7 @@
 #include "xatomic.h"
 #include "xcontext.h"
 #include "spinlock.h"
+#include "xtimerwheel.h"
 
 // User thread: we will save all status about each thread here.
 class xthread {
@@ -45,21 +46,19 @@ public:
     this->tid = tid;
     this->isbounded = false;
     this->status = THREAD_STATUS_INITIAL; 
+    this->nopreempt = 0;
+    this->lastcore = -1;
+    this->waitaddr = NULL;
 
     // Initialize corresponding queue
     listInit(&toqueue);
     listInit(&joinqueue);
-    listInit(&eventqueue);
   }
 
   // Creating a thread. 
   void spawn(void * actualFunc, void * arg);
   void join(xthread * current, pthread_t tid, void ** result);
 
-  // Get all events from the event queue. 
-  bool hasPendingEvents(void);
-  void getAllEvents(lnode * list);
-
   void putJoineeQueue(xthread* joinee);
   void putDeadqueue(xthread * thread);
 
@@ -96,6 +95,15 @@ public:
     return boundcore;
   }
 
+  // Which core did run me last time, -1 if I never ran.
+  int getLastCore(void) {
+    return lastcore;
+  }
+
+  void setLastCore(int coreid) {
+    lastcore = coreid;
+  }
+
   void setThreadRunning(void) {
     status = THREAD_STATUS_RUNNING; 
   }
@@ -110,6 +118,18 @@ public:
   void setThreadBarrierWaiting(void) {
     status = THREAD_STATUS_BARRIER_WAITING; 
   }
+  void setThreadSemWaiting(void) {
+    status = THREAD_STATUS_SEM_WAITING; 
+  }
+  void setThreadFutexWaiting(void) {
+    status = THREAD_STATUS_FUTEX_WAITING; 
+  }
+  void setThreadSleeping(void) {
+    status = THREAD_STATUS_SLEEPING; 
+  }
+  void setThreadIoWaiting(void) {
+    status = THREAD_STATUS_IO_WAITING; 
+  }
 
   void checkStack(void) {
     ctx.checkStack();
@@ -133,10 +153,6 @@ public:
     ctx.switchContext(context);
   }
 
-  void getContext(void) {
-    ctx.getContext();
-  }
-
   // Check whether one thread has been exited or not.
   bool isThreadDead(void);
 
@@ -202,13 +218,23 @@ public:
   int     hostpid;      
   e_thread_status status;
 
-  // The event queue passed from other threads
-  lnode  eventqueue;
+  // Depth of runtime critical sections, the thread can't be preempted if it is not 0.
+  int nopreempt;
 
   // The main thread should be bounded to its original process in the end,
   // otherwise, all children processes can not be reaped. 
   bool isbounded;  
   pid_t boundcore;
+
+  // The core whose cache is probably still warm for me.
+  int lastcore;
+
+  // Timer of timed waits and sleeps, see xtimerwheel.h.
+  xtimer timer;
+
+  // The futex word that I am waiting on, and the bitset of the wait, see xfutex.h.
+  void * volatile waitaddr;
+  unsigned int waitbits;
   
   void * retval;
   char buf[64]; // padding to avoid false sharing problem.
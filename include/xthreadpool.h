@@ -0,0 +1,176 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xthreadpool.h
+ * @brief:  Recycle thread control blocks together with their stacks.
+ *          A joined thread goes to the cache of current core and the next
+ *          spawn on this core takes it back, so creating a thread normally
+ *          needs no allocation and no lock. Stacks are never cleaned up, since
+ *          the initial frame is always built at the stack bottom.
+ *          If the cached stack has a different size, it goes back to xstacks.h.
+ *          Each core's cache is only touched by the process of this core.
+ *          When it grows too large, a batch is given to the global cache,
+ *          where an empty core cache refills from.
+ *          Callers must disable preemption so that they stay on the same core.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XTHREADPOOL_H_
+#define _XTHREADPOOL_H_
+
+#include <new>
+
+#include "xdefines.h"
+#include "xcpus.h"
+#include "xthread.h"
+#include "xstacks.h"
+#include "spinlock.h"
+#include "list.h"
+#include "memwrapper.h"
+
+class xthreadpool {
+  enum { CACHE_SIZE = xdefines::THREAD_CACHE_SIZE };
+  enum { CACHE_BATCH = xdefines::THREAD_CACHE_SIZE / 2 };
+
+  class threadcache {
+  public:
+    threadcache() {
+      listInit(&list);
+      count = 0;
+    }
+
+    lnode list;
+    volatile int count;
+    char  padding[64];
+  };
+
+public:
+  xthreadpool() {
+    caches = NULL;
+    global = NULL;
+    glock = NULL;
+  }
+
+  static xthreadpool& getInstance (void) {
+    static char buf[sizeof(xthreadpool)];
+    static xthreadpool * theOneTrueObject = new (buf) xthreadpool();
+    return *theOneTrueObject;
+  }
+
+  // Caches are in the shared space, since a parked core gives its threads to others.
+  // Spare processes have their caches too.
+  void initialize(void) {
+    void * ptr = MALLOC_SHARED(sizeof(threadcache) * PROCESS_SLOTS);
+
+    caches = (threadcache *)ptr;
+    for(int i = 0; i < PROCESS_SLOTS; i++) {
+      new (&caches[i]) threadcache;
+    }
+
+    global = new (MALLOC_SHARED(sizeof(threadcache))) threadcache;
+    glock = new (MALLOC_SHARED(sizeof(spinlock))) spinlock;
+  }
+
+  // Get a thread with a stack of specified size on specified core.
+  xthread * alloc(int coreid, int tid, size_t stacksize) {
+    threadcache * cache = &caches[coreid];
+    int usable = xstacks::usableSize(stacksize);
+    xthread * thread;
+    void * stack = NULL;
+
+    // The count of the global cache is only a hint without the lock.
+    if(cache->count == 0 && global->count > 0) {
+      moveThreads(global, cache, CACHE_BATCH);
+    }
+
+    if(cache->count > 0) {
+      thread = takeThread(cache);
+      if(thread->ctx.stacksize == usable) {
+        stack = thread->ctx.stack;
+      }
+      else {
+        xstacks::getInstance().free(thread->ctx.stack);
+      }
+    }
+    else {
+      thread = (xthread *)MALLOC_SHARED(sizeof(xthread));
+    }
+
+    if(stack == NULL) {
+      stack = xstacks::getInstance().alloc(stacksize);
+    }
+
+    // The new thread may run on this process at first.
+    xstacks::getInstance().guard(stack, coreid);
+
+    thread = new (thread) xthread(tid);
+    thread->ctx.setStack(stack, usable);
+    return thread;
+  }
+
+  // Put a joined thread into the cache of specified core.
+  void free(int coreid, xthread * thread) {
+    threadcache * cache = &caches[coreid];
+
+    listInsertHead(&thread->toqueue, &cache->list);
+    cache->count++;
+
+    if(cache->count > CACHE_SIZE) {
+      moveThreads(cache, global, CACHE_BATCH);
+    }
+  }
+
+  // Give all threads of specified core to the global cache, before the core is parked.
+  void flush(int coreid) {
+    threadcache * cache = &caches[coreid];
+
+    moveThreads(cache, global, cache->count);
+  }
+
+private:
+  xthread * takeThread(threadcache * cache) {
+    lnode * node = listRetrieveItem(&cache->list);
+
+    cache->count--;
+    return container_of(node, xthread, toqueue);
+  }
+
+  // Move at most "num" threads between a core cache and the global cache.
+  void moveThreads(threadcache * from, threadcache * to, int num) {
+    glock->acquire();
+
+    while(num-- > 0 && from->count > 0) {
+      xthread * thread = takeThread(from);
+
+      listInsertHead(&thread->toqueue, &to->list);
+      to->count++;
+    }
+
+    glock->release();
+  }
+
+  threadcache * caches;
+  threadcache * global;
+  spinlock    * glock;
+};
+
+#endif /* _XTHREADPOOL_H_ */
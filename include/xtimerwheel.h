@@ -0,0 +1,353 @@
+// -*- C++ -*-
+
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file:   xtimerwheel.h
+ * @brief:  Timers of timed waits and sleeps, kept in a hierarchical timer wheel per core.
+ *          Every thread has one timer, which is armed on the wheel of current
+ *          core before the thread blocks. Level 0 has one slot per tick, and
+ *          each slot of a higher level covers a whole round of the level below.
+ *          When level 0 wraps around, the next slot of level 1 is cascaded
+ *          down, and so on, like the classic timer wheel of Linux.
+ *
+ *          Wheels are in the shared space and protected by a spin lock, since
+ *          a thread cancels its timer on whatever core it runs after waking up,
+ *          and idle schedulers expire the timers of busy cores.
+ *          Expiring a timer doesn't touch the thread. The scheduler calls the
+ *          handler of the waiting object, which checks the sequence number to
+ *          make sure that the thread is still in the same wait. A sleeping
+ *          thread or one waiting for sockets has no object, it is woken up by
+ *          the scheduler itself.
+ * @author: Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+
+#ifndef _XTIMERWHEEL_H_
+#define _XTIMERWHEEL_H_
+
+#include <time.h>
+
+#include "xdefines.h"
+#include "spinlock.h"
+#include "list.h"
+
+// What a timer is waiting for, see expireTimer in xscheduler.cpp.
+enum e_timer_type {
+  TIMER_COND = 0,
+  TIMER_MUTEX,
+  TIMER_SEM,
+  TIMER_FUTEX,
+  TIMER_SLEEP
+};
+
+class xtimer {
+public:
+  xtimer() {
+    nodeInit(&node);
+    core = -1;
+    timedout = false;
+
+    // seq is kept when the thread is reused, so that a late handler of the
+    // last owner can't mistake it for a new wait.
+  }
+
+  lnode node;
+
+  // In ticks.
+  unsigned long long expires;
+
+  // Which wheel is holding the timer, -1 if it is not armed.
+  volatile int core;
+
+  int type;
+  void * object;
+
+  // Changed whenever the thread starts or finishes a timed wait.
+  volatile unsigned long seq;
+
+  // Set by the handler of the object.
+  volatile bool timedout;
+};
+
+class xtimerwheel {
+  enum { BITS = 6 };
+  enum { SLOTS = 1 << BITS };
+  enum { MASK = SLOTS - 1 };
+  enum { LEVELS = 5 };
+
+public:
+  enum { TICK_NS = xdefines::TIMER_TICK_USECS * 1000 };
+
+  xtimerwheel() {
+    for(int i = 0; i < LEVELS; i++) {
+      for(int j = 0; j < SLOTS; j++) {
+        listInit(&slots[i][j]);
+      }
+    }
+
+    next = currentTick();
+    earliest = ~0ULL;
+    count = 0;
+  }
+
+  static unsigned long long toNanoseconds(const struct timespec * ts) {
+    return (unsigned long long)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+  }
+
+  static unsigned long long now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return toNanoseconds(&ts);
+  }
+
+  static unsigned long long currentTick(void) {
+    return now() / TICK_NS;
+  }
+
+  // Convert an absolute CLOCK_REALTIME time of pthread functions to the monotonic clock.
+  static unsigned long long fromRealtime(const struct timespec * abstime) {
+    struct timespec ts;
+    unsigned long long mono = now();
+    unsigned long long real, target;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    real = toNanoseconds(&ts);
+    target = toNanoseconds(abstime);
+
+    return (target > real) ? mono + (target - real) : mono;
+  }
+
+  // Whether there is any timer, only a hint without the lock.
+  bool hasTimers(void) {
+    return count != 0;
+  }
+
+  // Whether some timer may have expired, only a hint without the lock.
+  bool isDue(unsigned long long tick) {
+    return count != 0 && tick >= earliest;
+  }
+
+  // Arm the timer, which expires at the specified monotonic time.
+  void add(xtimer * timer, int coreid, unsigned long long deadline) {
+    // Round up, so that it never expires early.
+    timer->expires = (deadline + TICK_NS - 1) / TICK_NS;
+
+    lock.acquire();
+
+    // Nothing has been handled while the wheel was empty, don't walk from there.
+    if(count == 0) {
+      next = currentTick();
+    }
+
+    timer->core = coreid;
+    insert(timer);
+    count++;
+    if(timer->expires < earliest) {
+      earliest = timer->expires;
+    }
+    lock.release();
+  }
+
+  // Remove the timer if it is still on this wheel. Return false if it has moved.
+  bool remove(xtimer * timer, int coreid) {
+    bool removed = false;
+
+    lock.acquire();
+    if(timer->core == coreid) {
+      listRemoveNode(&timer->node);
+      timer->core = -1;
+      count--;
+      removed = true;
+
+      // Otherwise the next add would take a tick in the past as the earliest.
+      if(count == 0) {
+        earliest = ~0ULL;
+      }
+    }
+    lock.release();
+
+    return removed;
+  }
+
+  // Take one timer which is due at the specified tick, and copy it to "expired",
+  // since the thread may arm it again as soon as the lock is released.
+  // Return NULL if there is none.
+  xtimer * expire(unsigned long long tick, xtimer * expired) {
+    xtimer * found = NULL;
+
+    lock.acquire();
+    while(count > 0 && next <= tick) {
+      lnode * slot = &slots[0][next & MASK];
+      lnode * node = listRetrieveItem(slot);
+
+      if(node == NULL) {
+        next++;
+        if((next & MASK) == 0) {
+          cascade();
+        }
+        continue;
+      }
+
+      xtimer * timer = container_of(node, xtimer, node);
+
+      // It was too far away when it was inserted.
+      if(timer->expires > next) {
+        insert(timer);
+        continue;
+      }
+
+      timer->core = -1;
+      count--;
+      *expired = *timer;
+      found = timer;
+      break;
+    }
+
+    if(found == NULL) {
+      // Nothing to cascade if there is no timer.
+      if(count == 0 && next <= tick) {
+        next = tick + 1;
+      }
+      earliest = getNextTick();
+    }
+    lock.release();
+
+    return found;
+  }
+
+  // No timer expires before this tick, ~0 if there is no timer.
+  unsigned long long nextTick(void) {
+    unsigned long long tick;
+
+    lock.acquire();
+    tick = getNextTick();
+    lock.release();
+
+    return tick;
+  }
+
+  // Move all timers to another wheel before current core is parked.
+  void moveTo(xtimerwheel * to, int tocore) {
+    lock.acquire();
+    to->lock.acquire();
+
+    if(to->count == 0) {
+      to->next = currentTick();
+    }
+
+    for(int i = 0; i < LEVELS; i++) {
+      for(int j = 0; j < SLOTS; j++) {
+        lnode * node;
+
+        while((node = listRetrieveItem(&slots[i][j])) != NULL) {
+          xtimer * timer = container_of(node, xtimer, node);
+
+          timer->core = tocore;
+          to->insert(timer);
+          to->count++;
+        }
+      }
+    }
+    count = 0;
+    earliest = ~0ULL;
+
+    to->earliest = to->getNextTick();
+
+    to->lock.release();
+    lock.release();
+  }
+
+private:
+  // Note: lock must be held to call this function
+  unsigned long long getNextTick(void) {
+    unsigned long long tick;
+
+    if(count == 0) {
+      return ~0ULL;
+    }
+
+    // The next cascade may bring some timers to level 0.
+    tick = ((next >> BITS) + 1) << BITS;
+
+    for(unsigned long long i = next; i < tick; i++) {
+      if(!isListEmpty(&slots[0][i & MASK])) {
+        return i;
+      }
+    }
+
+    return tick;
+  }
+
+  // Note: lock must be held to call this function
+  void insert(xtimer * timer) {
+    unsigned long long expires = (timer->expires < next) ? next : timer->expires;
+    unsigned long long delta = expires - next;
+    int level = 0;
+
+    // Too far away, put it into the last slot and insert it again later.
+    if(delta >= (1ULL << (BITS * LEVELS))) {
+      delta = (1ULL << (BITS * LEVELS)) - 1;
+      expires = next + delta;
+    }
+
+    while(level < LEVELS - 1 && delta >= (1ULL << (BITS * (level + 1)))) {
+      level++;
+    }
+
+    listInsertTail(&timer->node, &slots[level][(expires >> (BITS * level)) & MASK]);
+  }
+
+  // Level 0 has wrapped around, move the current slot of upper levels down.
+  // Note: lock must be held to call this function
+  void cascade(void) {
+    for(int level = 1; level < LEVELS; level++) {
+      int index = (next >> (BITS * level)) & MASK;
+      struct lnode head;
+      lnode * node;
+
+      listInit(&head);
+      if(!isListEmpty(&slots[level][index])) {
+        listRetrieveAllItems(&head, &slots[level][index]);
+      }
+
+      while((node = listRetrieveItem(&head)) != NULL) {
+        insert(container_of(node, xtimer, node));
+      }
+
+      // Only go up when this level has wrapped around too.
+      if(index != 0) {
+        break;
+      }
+    }
+  }
+
+  spinlock lock;
+
+  // The next tick to be handled.
+  unsigned long long next;
+
+  // No timer expires before it.
+  volatile unsigned long long earliest;
+
+  volatile int count;
+  lnode slots[LEVELS][SLOTS];
+};
+
+#endif /* _XTIMERWHEEL_H_ */
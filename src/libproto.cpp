@@ -32,10 +32,14 @@
 #endif
 
 #include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
 #include "memwrapper.h"
 #include "log.h"
 #include "streambuffer.h"
 #include "xrun.h"
+#include "proto.h"
 
 extern "C" {
 
@@ -179,6 +183,13 @@ extern "C" {
   }
 #endif
   /// Threads's synchronization functions.
+  // Their state is kept in the entries of xsynctable, not in the user objects.
+  enum { PROTO_MUTEX_FITS = HL::sassert<(sizeof(xmutex) <= xsynctable::OBJECT_SIZE)>::VALUE };
+  enum { PROTO_CONDVAR_FITS = HL::sassert<(sizeof(xcondvar) <= xsynctable::OBJECT_SIZE)>::VALUE };
+  enum { PROTO_BARRIER_FITS = HL::sassert<(sizeof(xbarr) <= xsynctable::OBJECT_SIZE)>::VALUE };
+  enum { PROTO_RWLOCK_FITS = HL::sassert<(sizeof(xrwlock) <= xsynctable::OBJECT_SIZE)>::VALUE };
+  enum { PROTO_SEM_FITS = HL::sassert<(sizeof(xsem) <= xsynctable::OBJECT_SIZE)>::VALUE };
+
   // Mutex related functions 
   int pthread_mutex_init (pthread_mutex_t * mutex, const pthread_mutexattr_t* attr) {    
     if (isInitialized()) 
@@ -196,9 +207,11 @@ extern "C" {
     return 0;
   }
 
-  // FIXME: add support for trylock
   int pthread_mutex_trylock(pthread_mutex_t * mutex) {
-    return 0;
+    if (!isInitialized()) 
+      return 0;
+
+    return xrun::getInstance().mutex_trylock (mutex);
   }
   
   int pthread_mutex_unlock (pthread_mutex_t * mutex) {    
@@ -208,6 +221,20 @@ extern "C" {
     return 0;
   }
 
+  int pthread_mutex_timedlock (pthread_mutex_t * mutex, const struct timespec * abstime) {
+    if (!isInitialized()) 
+      return 0;
+
+    // POSIX doesn't check the time if the mutex can be taken at once.
+    if (xrun::getInstance().mutex_trylock (mutex) == 0)
+      return 0;
+
+    if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L)
+      return EINVAL;
+
+    return xrun::getInstance().mutex_timedlock (mutex, abstime);
+  }
+
   int pthread_mutex_destroy (pthread_mutex_t * mutex) {    
     if (isInitialized()) 
       return xrun::getInstance().mutex_destroy (mutex);
@@ -242,6 +269,17 @@ extern "C" {
     return 0;
   }
 
+  int pthread_cond_timedwait (pthread_cond_t * cond, pthread_mutex_t * mutex,
+                              const struct timespec * abstime) {
+    if (!isInitialized()) 
+      return 0;
+
+    if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L)
+      return EINVAL;
+
+    return xrun::getInstance().cond_timedwait (cond, mutex, abstime);
+  }
+
   int pthread_cond_destroy (pthread_cond_t * cond) {
 	if (isInitialized()) 
     	xrun::getInstance().cond_destroy (cond);
@@ -270,6 +308,164 @@ extern "C" {
       return 0;
   }  
 
+  // Unnamed semaphores, see xsem.h. They set errno like the ones of libc.
+  // Like other synchronizations, they do nothing before the runtime is initialized.
+  int sem_init(sem_t * sem, int pshared, unsigned int value) {
+    int ret = 0;
+
+    if (isInitialized()) 
+      ret = xrun::getInstance().semaphore_init (sem, value);
+
+    if (ret != 0) {
+      errno = ret;
+      return -1;
+    }
+    return 0;
+  }
+
+  int sem_destroy(sem_t * sem) {
+    if (isInitialized()) 
+      xrun::getInstance().semaphore_destroy (sem);
+    return 0;
+  }
+
+  int sem_wait(sem_t * sem) {
+    int ret = 0;
+
+    if (isInitialized()) 
+      ret = xrun::getInstance().semaphore_wait (sem);
+
+    if (ret != 0) {
+      errno = ret;
+      return -1;
+    }
+    return 0;
+  }
+
+  int sem_timedwait(sem_t * sem, const struct timespec * abstime) {
+    int ret;
+
+    if (!isInitialized()) 
+      return 0;
+
+    // POSIX doesn't check the time if a token can be taken at once.
+    if (xrun::getInstance().semaphore_trywait (sem) == 0)
+      return 0;
+
+    if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    ret = xrun::getInstance().semaphore_timedwait (sem, abstime);
+    if (ret != 0) {
+      errno = ret;
+      return -1;
+    }
+    return 0;
+  }
+
+  int sem_trywait(sem_t * sem) {
+    int ret = 0;
+
+    if (isInitialized()) 
+      ret = xrun::getInstance().semaphore_trywait (sem);
+
+    if (ret != 0) {
+      errno = ret;
+      return -1;
+    }
+    return 0;
+  }
+
+  int sem_post(sem_t * sem) {
+    int ret = 0;
+
+    if (isInitialized()) 
+      ret = xrun::getInstance().semaphore_post (sem);
+
+    if (ret != 0) {
+      errno = ret;
+      return -1;
+    }
+    return 0;
+  }
+
+  int sem_getvalue(sem_t * sem, int * value) {
+    *value = isInitialized() ? xrun::getInstance().semaphore_getvalue (sem) : 0;
+    return 0;
+  }
+
+  // Also used by std::call_once. Threads waiting for the routine are parked
+  // on a private futex, see xrun::once.
+  int pthread_once (pthread_once_t * control, void (*routine)(void)) {
+    return xrun::getInstance().once (control, routine);
+  }
+
+  // Split-phase barriers and latches, see proto.h.
+  int proto_barrier_init(proto_barrier_t * barrier, unsigned int count) {
+    if (isInitialized()) 
+      return xrun::getInstance().barrier_init (barrier, count);
+    else
+      return 0;
+  }
+
+  int proto_barrier_destroy(proto_barrier_t * barrier) {
+    if (isInitialized()) 
+      return xrun::getInstance().barrier_destroy (barrier);
+    else
+      return 0;
+  }
+
+  int proto_barrier_arrive(proto_barrier_t * barrier, proto_barrier_token_t * token) {
+    if (isInitialized()) 
+      return xrun::getInstance().barrier_arrive (barrier, token);
+    else
+      return 0;
+  }
+
+  int proto_barrier_wait(proto_barrier_t * barrier, proto_barrier_token_t token) {
+    if (isInitialized()) 
+      return xrun::getInstance().barrier_await (barrier, token);
+    else
+      return 0;
+  }
+
+  int proto_latch_init(proto_latch_t * latch, unsigned int count) {
+    if (isInitialized()) 
+      return xrun::getInstance().latch_init (latch, count);
+    else
+      return 0;
+  }
+
+  int proto_latch_destroy(proto_latch_t * latch) {
+    if (isInitialized()) 
+      return xrun::getInstance().barrier_destroy (latch);
+    else
+      return 0;
+  }
+
+  int proto_latch_count_down(proto_latch_t * latch, unsigned int count) {
+    if (isInitialized()) 
+      return xrun::getInstance().latch_count_down (latch, count);
+    else
+      return 0;
+  }
+
+  int proto_latch_try_wait(proto_latch_t * latch) {
+    if (isInitialized()) 
+      return xrun::getInstance().latch_try_wait (latch);
+    else
+      return 0;
+  }
+
+  int proto_latch_wait(proto_latch_t * latch) {
+    if (isInitialized()) 
+      return xrun::getInstance().latch_wait (latch);
+    else
+      return 0;
+  }
+
   int pthread_cancel (pthread_t thread) {
     xrun::getInstance().cancel((int)thread);
     return 0;
@@ -277,6 +473,76 @@ extern "C" {
   
   int sched_yield (void) 
   {
+    if (isInitialized())
+      xrun::getInstance().yield();
+    return 0;
+  }
+
+  // Sleeping threads are parked on the timer wheel, so that others can run on
+  // this core. Threads that we don't schedule still sleep in the kernel.
+  // Sleeps are never interrupted by signals.
+  int nanosleep (const struct timespec * req, struct timespec * rem) {
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    if (!isInitialized()
+        || !xrun::getInstance().sleep(xtimerwheel::now() + xtimerwheel::toNanoseconds(req))) 
+      return WRAP(nanosleep)(req, rem);
+
+    if (rem) {
+      rem->tv_sec = 0;
+      rem->tv_nsec = 0;
+    }
+    return 0;
+  }
+
+  int clock_nanosleep (clockid_t clockid, int flags, const struct timespec * req, struct timespec * rem) {
+    unsigned long long deadline;
+
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L)
+      return EINVAL;
+
+    // Sleeps on CPU-time clocks are left to the kernel.
+    if (clockid == CLOCK_MONOTONIC) {
+      deadline = xtimerwheel::toNanoseconds(req);
+    }
+    else if (clockid == CLOCK_REALTIME) {
+      deadline = (flags & TIMER_ABSTIME) ? xtimerwheel::fromRealtime(req) : xtimerwheel::toNanoseconds(req);
+    }
+    else {
+      return WRAP(clock_nanosleep)(clockid, flags, req, rem);
+    }
+
+    if (!(flags & TIMER_ABSTIME))
+      deadline += xtimerwheel::now();
+
+    if (!isInitialized() || !xrun::getInstance().sleep(deadline))
+      return WRAP(clock_nanosleep)(clockid, flags, req, rem);
+
+    if (rem && !(flags & TIMER_ABSTIME)) {
+      rem->tv_sec = 0;
+      rem->tv_nsec = 0;
+    }
+    return 0;
+  }
+
+  int usleep (useconds_t usec) {
+    struct timespec ts;
+
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    return nanosleep(&ts, NULL);
+  }
+
+  unsigned int sleep (unsigned int seconds) {
+    struct timespec ts;
+
+    ts.tv_sec = seconds;
+    ts.tv_nsec = 0;
+    if (nanosleep(&ts, &ts) != 0)
+      return ts.tv_sec;
     return 0;
   }
 
@@ -297,11 +563,35 @@ extern "C" {
     return 0;
   }
 
-  int pthread_attr_init (pthread_attr_t *) {
+  // Our own thread attributes, which are kept inside pthread_attr_t.
+  // The magic tells whether the attribute is initialized by us.
+  struct protoattr {
+    unsigned long magic;
+    size_t stacksize;
+  };
+
+  enum { PROTO_ATTR_MAGIC = 0x70726f74 };
+  enum { PROTO_ATTR_FITS = HL::sassert<(sizeof(protoattr) <= sizeof(pthread_attr_t))>::VALUE };
+
+  static size_t getAttrStackSize(const pthread_attr_t * attr) {
+    const protoattr * pattr = (const protoattr *)attr;
+
+    if(pattr && pattr->magic == PROTO_ATTR_MAGIC) {
+      return pattr->stacksize;
+    }
+    return xdefines::STACK_SIZE;
+  }
+
+  int pthread_attr_init (pthread_attr_t * attr) {
+    protoattr * pattr = (protoattr *)attr;
+
+    pattr->magic = PROTO_ATTR_MAGIC;
+    pattr->stacksize = xdefines::STACK_SIZE;
     return 0;
   }
 
-  int pthread_attr_destroy (pthread_attr_t *) {
+  int pthread_attr_destroy (pthread_attr_t * attr) {
+    ((protoattr *)attr)->magic = 0;
     return 0;
   }
 
@@ -318,51 +608,64 @@ extern "C" {
   }
 
 #if 0
-  int pthread_rwlock_destroy (pthread_rwlock_t * rwlock) NOTHROW
+  int pthread_detach (pthread_t thread) NOTHROW
   {
     return 0;
   }
+#endif
 
-  int pthread_rwlock_init (pthread_rwlock_t * rwlock,
-			   const pthread_rwlockattr_t * attr) NOTHROW
-  {
-    return 0;
-  }
+  // Reader-writer locks, see xrwlock.h.
 
-  int pthread_detach (pthread_t thread) NOTHROW
-  {
-    return 0;
+  int pthread_rwlock_init (pthread_rwlock_t * rwlock, const pthread_rwlockattr_t * attr) {
+    if (isInitialized())
+      return xrun::getInstance().rwlock_init (rwlock);
+    else
+      return 0;
   }
 
-  int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock) NOTHROW
-  {
-    return 0;
+  int pthread_rwlock_destroy (pthread_rwlock_t * rwlock) {
+    if (isInitialized())
+      return xrun::getInstance().rwlock_destroy (rwlock);
+    else
+      return 0;
   }
 
-  int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock) NOTHROW
-  {
-    return 0;
+  int pthread_rwlock_rdlock (pthread_rwlock_t * rwlock) {
+    if (isInitialized())
+      return xrun::getInstance().rwlock_rdlock (rwlock);
+    else
+      return 0;
   }
 
-
-  int pthread_rwlock_unlock(pthread_rwlock_t *rwlock) NOTHROW
-  {
-    return 0;
+  int pthread_rwlock_tryrdlock (pthread_rwlock_t * rwlock) {
+    if (isInitialized())
+      return xrun::getInstance().rwlock_tryrdlock (rwlock);
+    else
+      return 0;
   }
 
-  int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock) NOTHROW
-  {
-    return 0;
+  int pthread_rwlock_wrlock (pthread_rwlock_t * rwlock) {
+    if (isInitialized())
+      return xrun::getInstance().rwlock_wrlock (rwlock);
+    else
+      return 0;
   }
 
-  int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) NOTHROW
-  {
-    return 0;
+  int pthread_rwlock_trywrlock (pthread_rwlock_t * rwlock) {
+    if (isInitialized())
+      return xrun::getInstance().rwlock_trywrlock (rwlock);
+    else
+      return 0;
   }
 
-#endif
-  int pthread_attr_getstacksize (const pthread_attr_t *, size_t * s) {
-    *s = 1048576UL; // really? FIX ME
+  int pthread_rwlock_unlock (pthread_rwlock_t * rwlock) {
+    if (isInitialized())
+      return xrun::getInstance().rwlock_unlock (rwlock);
+    else
+      return 0;
+  }
+  int pthread_attr_getstacksize (const pthread_attr_t * attr, size_t * s) {
+    *s = getAttrStackSize(attr);
     return 0;
   }
 
@@ -370,14 +673,26 @@ extern "C" {
   int pthread_mutexattr_init (pthread_mutexattr_t *)    { return 0; }
   int pthread_mutexattr_settype (pthread_mutexattr_t *, int) { return 0; }
   int pthread_mutexattr_gettype (const pthread_mutexattr_t *, int *) { return 0; }
-  int pthread_attr_setstacksize (pthread_attr_t *, size_t) { return 0; }
+
+  // The stack is rounded up to a power of two, see xstacks.h.
+  int pthread_attr_setstacksize (pthread_attr_t * attr, size_t size) {
+    protoattr * pattr = (protoattr *)attr;
+
+    if(size < (size_t)PTHREAD_STACK_MIN || size > xstacks::maxSize()) {
+      return EINVAL;
+    }
+
+    pattr->magic = PROTO_ATTR_MAGIC;
+    pattr->stacksize = size;
+    return 0;
+  }
 
   int pthread_create (pthread_t * tid,
 		      const pthread_attr_t * attr,
 		      void *(*start_routine) (void *),
 		      void * arg) 
   {
-    *tid = (pthread_t)xrun::getInstance().spawn ((void *)start_routine, arg);
+    *tid = (pthread_t)xrun::getInstance().spawn ((void *)start_routine, arg, getAttrStackSize(attr));
     return 0;
   }
 
@@ -417,6 +732,230 @@ extern "C" {
   }
 #endif
 
+  // Other calls of user threads that may block the process, like reading a file 
+  // or fsync, are marked. If the process is blocked for long, a spare process
+  // serves its core meanwhile, see the syscall handoff in xscheduler.cpp.
+#define BLOCKING_SYSCALL(call)                                                 \
+  {                                                                            \
+    bool marked = isInitialized() && xrun::getInstance().syscallEnter();       \
+    __typeof__(call) ret = (call);                                             \
+                                                                               \
+    if(marked)                                                                 \
+      xrun::getInstance().syscallExit();                                       \
+    return ret;                                                                \
+  }
+
+  // Socket calls of user threads park the thread instead of blocking the process,
+  // see xio.h. The socket has been made nonblocking, so the call is tried again
+  // after the socket gets ready. Calls on other fds are marked as blocking.
+#define BLOCKING_IO(fd, flags, events, call)                                   \
+  {                                                                            \
+    bool managed = isInitialized() && xrun::getInstance().ioManage(fd, flags); \
+    ssize_t ret;                                                               \
+                                                                               \
+    if(!managed)                                                               \
+      BLOCKING_SYSCALL(call)                                                   \
+                                                                               \
+    while((ret = (call)) < 0                                                   \
+          && xrun::getInstance().ioWait(fd, events))                           \
+      ;                                                                        \
+    return ret;                                                                \
+  }
+
+  // File reads and writes of user threads go to the I/O engine if it is enabled,
+  // see xaio.h. Otherwise they are marked as blocking.
+#define FILE_IO(op, fd, buf, count, offset)                                    \
+  {                                                                            \
+    ssize_t done;                                                              \
+                                                                               \
+    if(isInitialized() && xrun::getInstance().fileAccess(op, fd, (void *)(buf), count, offset, &done)) \
+      return done;                                                             \
+  }
+
+  ssize_t read (int fd, void * buf, size_t count) {
+    FILE_IO(AIO_READ, fd, buf, count, -1)
+    BLOCKING_IO(fd, 0, EPOLLIN, WRAP(read)(fd, buf, count))
+  }
+
+  ssize_t write (int fd, const void * buf, size_t count) {
+    FILE_IO(AIO_WRITE, fd, buf, count, -1)
+    BLOCKING_IO(fd, 0, EPOLLOUT, WRAP(write)(fd, buf, count))
+  }
+
+  ssize_t readv (int fd, const struct iovec * iov, int iovcnt) 
+    BLOCKING_IO(fd, 0, EPOLLIN, WRAP(readv)(fd, iov, iovcnt))
+
+  ssize_t writev (int fd, const struct iovec * iov, int iovcnt) 
+    BLOCKING_IO(fd, 0, EPOLLOUT, WRAP(writev)(fd, iov, iovcnt))
+
+  ssize_t recv (int fd, void * buf, size_t len, int flags) 
+    BLOCKING_IO(fd, flags, EPOLLIN, WRAP(recv)(fd, buf, len, flags))
+
+  ssize_t recvfrom (int fd, void * buf, size_t len, int flags, struct sockaddr * addr, socklen_t * addrlen) 
+    BLOCKING_IO(fd, flags, EPOLLIN, WRAP(recvfrom)(fd, buf, len, flags, addr, addrlen))
+
+  ssize_t recvmsg (int fd, struct msghdr * msg, int flags) 
+    BLOCKING_IO(fd, flags, EPOLLIN, WRAP(recvmsg)(fd, msg, flags))
+
+  ssize_t send (int fd, const void * buf, size_t len, int flags) 
+    BLOCKING_IO(fd, flags, EPOLLOUT, WRAP(send)(fd, buf, len, flags))
+
+  ssize_t sendto (int fd, const void * buf, size_t len, int flags, const struct sockaddr * addr, socklen_t addrlen) 
+    BLOCKING_IO(fd, flags, EPOLLOUT, WRAP(sendto)(fd, buf, len, flags, addr, addrlen))
+
+  ssize_t sendmsg (int fd, const struct msghdr * msg, int flags) 
+    BLOCKING_IO(fd, flags, EPOLLOUT, WRAP(sendmsg)(fd, msg, flags))
+
+  int accept (int fd, struct sockaddr * addr, socklen_t * addrlen) 
+    BLOCKING_IO(fd, 0, EPOLLIN, WRAP(accept)(fd, addr, addrlen))
+
+  int accept4 (int fd, struct sockaddr * addr, socklen_t * addrlen, int flags) 
+    BLOCKING_IO(fd, 0, EPOLLIN, WRAP(accept4)(fd, addr, addrlen, flags))
+
+  ssize_t pread (int fd, void * buf, size_t count, off_t offset) {
+    if (offset >= 0)
+      FILE_IO(AIO_READ, fd, buf, count, offset)
+    BLOCKING_SYSCALL(WRAP(pread)(fd, buf, count, offset))
+  }
+
+  ssize_t pwrite (int fd, const void * buf, size_t count, off_t offset) {
+    if (offset >= 0)
+      FILE_IO(AIO_WRITE, fd, buf, count, offset)
+    BLOCKING_SYSCALL(WRAP(pwrite)(fd, buf, count, offset))
+  }
+
+  int fsync (int fd) 
+    BLOCKING_SYSCALL(WRAP(fsync)(fd))
+
+  int fdatasync (int fd) 
+    BLOCKING_SYSCALL(WRAP(fdatasync)(fd))
+
+  // The mode is only passed when a file may be created, O_TMPFILE included.
+  static bool openNeedsMode(int flags) {
+#ifdef __OPEN_NEEDS_MODE
+    return __OPEN_NEEDS_MODE(flags);
+#elif defined(O_TMPFILE)
+    return (flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE;
+#else
+    return (flags & O_CREAT);
+#endif
+  }
+
+  int open (const char * path, int flags, ...) {
+    mode_t mode = 0;
+    va_list ap;
+
+    if (openNeedsMode(flags)) {
+      va_start(ap, flags);
+      mode = va_arg(ap, int);
+      va_end(ap);
+    }
+
+    BLOCKING_SYSCALL(WRAP(open)(path, flags, mode))
+  }
+
+  // Private futexes of user threads are parked by us, see xfutex.h. Everything
+  // else goes to the kernel, where a futex wait may block the process.
+  // Callers of the raw syscall pass at most six arguments.
+  long syscall (long number, ...) {
+    long a[6];
+    long ret;
+    va_list ap;
+
+    va_start(ap, number);
+    for (int i = 0; i < 6; i++)
+      a[i] = va_arg(ap, long);
+    va_end(ap);
+
+    if (number == SYS_futex) {
+      if (isInitialized()
+          && xrun::getInstance().futex((int *)a[0], (int)a[1], (int)a[2], (const struct timespec *)a[3],
+                                       (int *)a[4], (int)a[5], &ret)) {
+        if (ret < 0) {
+          errno = -ret;
+          return -1;
+        }
+        return ret;
+      }
+
+      BLOCKING_SYSCALL(WRAP(syscall)(number, a[0], a[1], a[2], a[3], a[4], a[5]))
+    }
+
+    return WRAP(syscall)(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+  }
+
+  int connect (int fd, const struct sockaddr * addr, socklen_t addrlen) {
+    bool managed = isInitialized() && xrun::getInstance().ioManage(fd);
+    int ret = WRAP(connect)(fd, addr, addrlen);
+
+    if (ret == 0 || !managed || errno != EINPROGRESS)
+      return ret;
+
+    return xrun::getInstance().ioConnect(fd);
+  }
+
+  // Managed sockets stay nonblocking in the kernel, the mode of the user is
+  // kept in xio.h. The argument of other commands is passed through.
+  int fcntl (int fd, int cmd, ...) {
+    va_list ap;
+    long arg;
+    int ret;
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, long);
+    va_end(ap);
+
+    if (!isInitialized()) 
+      return WRAP(fcntl)(fd, cmd, arg);
+
+    switch (cmd) {
+    case F_GETFL:
+      ret = WRAP(fcntl)(fd, cmd);
+      return xrun::getInstance().ioGetFlags(fd, ret);
+
+    case F_SETFL:
+      return WRAP(fcntl)(fd, cmd, xrun::getInstance().ioSetFlags(fd, (int)arg));
+
+    default:
+      return WRAP(fcntl)(fd, cmd, arg);
+    }
+  }
+
+  int ioctl (int fd, unsigned long request, ...) {
+    va_list ap;
+    void * arg;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if (isInitialized() && request == FIONBIO && arg != NULL
+        && xrun::getInstance().ioSetNonblock(fd, *(int *)arg != 0))
+      return 0;
+
+    return WRAP(ioctl)(fd, request, arg);
+  }
+
+  int poll (struct pollfd * fds, nfds_t nfds, int timeout) {
+    if (!isInitialized() || timeout == 0) 
+      return WRAP(poll)(fds, nfds, timeout);
+
+    return xrun::getInstance().poll(fds, nfds, timeout);
+  }
+
+  int epoll_wait (int epfd, struct epoll_event * events, int maxevents, int timeout) {
+    if (!isInitialized() || timeout == 0) 
+      return WRAP(epoll_wait)(epfd, events, maxevents, timeout);
+
+    return xrun::getInstance().epoll_wait(epfd, events, maxevents, timeout);
+  }
+
+  int close (int fd) {
+    if (isInitialized()) 
+      xrun::getInstance().ioClose(fd);
+    return WRAP(close)(fd);
+  }
+
   // Intercepting fopen calls.
   // We DONOT need to intercept setbbuf function at all. 
   // setvbuf function can be called only after fopen, that is,
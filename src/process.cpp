@@ -25,12 +25,16 @@
  * @author Tongping Liu <http://www.cs.umass.edu/~tonyliu>
  */
 #include <errno.h>
+#include <sched.h>
+#include <string.h>
 #include "process.h"
 #include "xmemory.h"
 #include "xmap.h"
 #include "processmap.h"
+#include "xcpus.h"
 #include "xrun.h"
 #include "xscheduler.h"
+#include "xthreadpool.h"
 
 void process::initialize(int pid, int coreid) {
     // Set process id for this process,
@@ -47,56 +51,80 @@ void process::initialize(int pid, int coreid) {
     setQueues(coreid);
 }
 
-void process::bindToCpu(int cpuid) {
+// Bind to the actual CPU of specified core, which may not be the same as coreid.
+void process::bindToCpu(int coreid) {
   cpu_set_t cpuset;
+  int cpuid = xcpus::getInstance().getCpu(coreid);
 
   /* set affinity attribute */
   CPU_ZERO(&cpuset);
   CPU_SET(cpuid, &cpuset);
 
   if(sched_setaffinity(0, sizeof (cpu_set_t), &cpuset) != 0) {
-    PRFATAL("can't set effinitity for core %d\n", cpuid);
+    PRFATAL("can't set effinitity for core %d (cpu %d)\n", coreid, cpuid);
   }
 }
 
-// Create a new process
+// Entry of a new process, see process::create.
+static int processEntry(void * arg) {
+  process::getInstance().start((int)(intptr_t)arg);
+  return 0;
+}
+
+// Create a new process. It can be called by any thread of any process now, 
+// so the child can't continue on current stack, which is shared by all processes
+// and is still used by the parent. The child starts on a private clone stack instead.
 void process::create(int coreid) {
   //PRLOG(stderr, "%d: creating %d process\n", getpid(), id);
-  int child = forkShareFS();
-  //fprintf(stderr, "%d: creating %d process %d\n", getpid(), coreid, child);
-  if(child == 0) {
-    // make the system call to get actual pid here.
-    pid_t mypid = syscall(SYS_getpid);
-
-    //fprintf(stderr, "%d before initialize\n", mypid);   
-    initialize(mypid, coreid);
-   
-    //fprintf(stderr, "%d before protect\n", mypid);   
-    // Now we have to setup all memory
-    xmemory::getInstance().protectAllMemory();
-
-    ucontext_t current;
-
-    getcontext(&current);
-
-    //fprintf(stderr, "%d after getcontext\n", mypid);   
-    // Create a new scheduler thread on current process
-//    PRLOG(stderr, "Creating child process %d before spawning scheduelr\n", mypid);
-    xthread * scheduler = spawnSchedulerThread();
-    PRLOG("Creating child process %d after spawning scheduelr\n", mypid);
-    PRLOG("Creating child process %d: stack %p\n", mypid, &mypid);
-   // fprintf(stderr, "Creating child process %d: stack %p\n", mypid, &mypid);
-
-    // Now we are running the scheduler thread!!!!
-    // Note: we have to switch to scheduler thread otherwise
-    // scheduler are still using current process's stack.
-    setcontext(&scheduler->ctx.context);
-   // swapcontext(&current, &scheduler->ctx.context);
+  int child;
+
+  clonestack = MMAP_PRIVATE(xdefines::PRIVATE_STACK_SIZE);
+
+  // Share the file system information and file descriptors, like threads.
+  child = clone(processEntry, (void *)((intptr_t)clonestack + xdefines::PRIVATE_STACK_SIZE),
+                CLONE_FS|CLONE_FILES|SIGCHLD, (void *)(intptr_t)coreid);
+  if(child == -1) {
+    PRFATAL("can't create the process for core %d: %s\n", coreid, strerror(errno));
   }
-  else {
-    // Register this process.
-    // Set process id to the global processmap.
-    processmap::getInstance().registerProcess(coreid, child);  
+
+  // Release my copy of the clone stack.
+  freeCloneStack();
+
+  // Register this process.
+  // Set process id to the global processmap.
+  processmap::getInstance().registerProcess(coreid, child);  
+}
+
+void process::start(int coreid) {
+  // make the system call to get actual pid here.
+  pid_t mypid = syscall(SYS_getpid);
+
+  //fprintf(stderr, "%d before initialize\n", mypid);   
+  initialize(mypid, coreid);
+
+  // The parent may be in the middle of anything, forget its state.
+  event.type = E_EVENT_NONE;
+  startSlice();
+ 
+  //fprintf(stderr, "%d before protect\n", mypid);   
+  // Now we have to setup all memory
+  xmemory::getInstance().protectAllMemory();
+
+  // Create a new scheduler thread on current process
+  xthread * scheduler = spawnSchedulerThread();
+  PRLOG("Creating child process %d after spawning scheduelr\n", mypid);
+  PRLOG("Creating child process %d: stack %p\n", mypid, &mypid);
+
+  // Now we are running the scheduler thread!!!!
+  // Note: we have to switch to scheduler thread otherwise
+  // scheduler are still using the clone stack.
+  scheduler->setContext();
+}
+
+void process::freeCloneStack(void) {
+  if(clonestack) {
+    MUNMAP(clonestack, xdefines::PRIVATE_STACK_SIZE);
+    clonestack = NULL;
   }
 }
 
@@ -105,10 +133,7 @@ xthread * process::spawnSchedulerThread(void) {
   int tid = xmap::getInstance().allocTid();
 
   // Create a block of memory to hold this task.
-  void * ptr = MALLOC_SHARED(sizeof(xthread));
-
-  // Create a block of memory to hold this task.
-  xthread *  thread = new (ptr)xthread(tid);
+  xthread *  thread = xthreadpool::getInstance().alloc(_coreid, tid, xdefines::STACK_SIZE);
 
   PRDBG("%d: Creating spawning thread %p tid %d\n", getpid(), thread, tid);
   //fprintf(stderr, "%d: Spawning scheduler thread %p tid %d\n", getpid(), thread, tid);
@@ -129,6 +154,7 @@ xthread * process::spawnSchedulerThread(void) {
 void process::setQueues(int id) {
   pqueue = xrun::getInstance().getPrivateQueue(id);
   squeue = xrun::getInstance().getShareQueue();
+  deque = processmap::getInstance().getDeque(id);
   //dqueue = xrun::getInstance().getDeadQueue();
 }
 
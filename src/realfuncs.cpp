@@ -18,6 +18,32 @@ size_t (*WRAP(malloc_usable_size))(void *);
 ssize_t (*WRAP(read))(int, void*, size_t);
 ssize_t (*WRAP(write))(int, const void*, size_t);
 int (*WRAP(sigwait))(const sigset_t*, int*);
+int (*WRAP(nanosleep))(const struct timespec*, struct timespec*);
+int (*WRAP(clock_nanosleep))(clockid_t, int, const struct timespec*, struct timespec*);
+long (*WRAP(syscall))(long, ...);
+
+// sockets
+ssize_t (*WRAP(readv))(int, const struct iovec*, int);
+ssize_t (*WRAP(writev))(int, const struct iovec*, int);
+ssize_t (*WRAP(recv))(int, void*, size_t, int);
+ssize_t (*WRAP(recvfrom))(int, void*, size_t, int, struct sockaddr*, socklen_t*);
+ssize_t (*WRAP(recvmsg))(int, struct msghdr*, int);
+ssize_t (*WRAP(send))(int, const void*, size_t, int);
+ssize_t (*WRAP(sendto))(int, const void*, size_t, int, const struct sockaddr*, socklen_t);
+ssize_t (*WRAP(sendmsg))(int, const struct msghdr*, int);
+int (*WRAP(accept))(int, struct sockaddr*, socklen_t*);
+int (*WRAP(accept4))(int, struct sockaddr*, socklen_t*, int);
+int (*WRAP(connect))(int, const struct sockaddr*, socklen_t);
+int (*WRAP(poll))(struct pollfd*, nfds_t, int);
+int (*WRAP(epoll_wait))(int, struct epoll_event*, int, int);
+int (*WRAP(close))(int);
+int (*WRAP(fcntl))(int, int, ...);
+int (*WRAP(ioctl))(int, unsigned long, ...);
+int (*WRAP(open))(const char*, int, ...);
+ssize_t (*WRAP(pread))(int, void*, size_t, off_t);
+ssize_t (*WRAP(pwrite))(int, const void*, size_t, off_t);
+int (*WRAP(fsync))(int);
+int (*WRAP(fdatasync))(int);
 FILE* (*WRAP(fopen))(const char *path, const char *mode);
 int (*WRAP(fclose))(FILE * file);
 
@@ -66,6 +92,30 @@ void init_real_functions() {
 	SET_WRAPPED(read, RTLD_NEXT);
 	SET_WRAPPED(write, RTLD_NEXT);
 	SET_WRAPPED(sigwait, RTLD_NEXT);
+	SET_WRAPPED(nanosleep, RTLD_NEXT);
+	SET_WRAPPED(clock_nanosleep, RTLD_NEXT);
+	SET_WRAPPED(syscall, RTLD_NEXT);
+	SET_WRAPPED(readv, RTLD_NEXT);
+	SET_WRAPPED(writev, RTLD_NEXT);
+	SET_WRAPPED(recv, RTLD_NEXT);
+	SET_WRAPPED(recvfrom, RTLD_NEXT);
+	SET_WRAPPED(recvmsg, RTLD_NEXT);
+	SET_WRAPPED(send, RTLD_NEXT);
+	SET_WRAPPED(sendto, RTLD_NEXT);
+	SET_WRAPPED(sendmsg, RTLD_NEXT);
+	SET_WRAPPED(accept, RTLD_NEXT);
+	SET_WRAPPED(accept4, RTLD_NEXT);
+	SET_WRAPPED(connect, RTLD_NEXT);
+	SET_WRAPPED(poll, RTLD_NEXT);
+	SET_WRAPPED(epoll_wait, RTLD_NEXT);
+	SET_WRAPPED(close, RTLD_NEXT);
+	SET_WRAPPED(fcntl, RTLD_NEXT);
+	SET_WRAPPED(ioctl, RTLD_NEXT);
+	SET_WRAPPED(open, RTLD_NEXT);
+	SET_WRAPPED(pread, RTLD_NEXT);
+	SET_WRAPPED(pwrite, RTLD_NEXT);
+	SET_WRAPPED(fsync, RTLD_NEXT);
+	SET_WRAPPED(fdatasync, RTLD_NEXT);
 	SET_WRAPPED(fopen, RTLD_NEXT);
 	SET_WRAPPED(fclose, RTLD_NEXT);
 
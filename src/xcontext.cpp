@@ -0,0 +1,201 @@
+// -*- C++ -*-
+/*
+  Copyright (c) 2012-2013, University of Massachusetts Amherst.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xcontext.cpp
+ * @brief  User-level context switch routines.
+ *         Unlike swapcontext, we only save the callee-saved registers, the x87
+ *         control word and MXCSR on the stack of the old thread, and the saved
+ *         context is just the stack pointer. No system call is made, the signal
+ *         mask is left alone.
+ *
+ *         Layout of a saved context, from the saved stack pointer upward:
+ *           i386:   mxcsr, fpucw, edi, esi, ebx, ebp, return address
+ *           x86_64: mxcsr, fpucw, r15, r14, r13, r12, rbx, rbp, return address
+ *
+ *         This file doesn't depend on the rest of the runtime, so that it can
+ *         be linked into the tests directly.
+ * @author Tongping Liu <http://www.cs.umass.edu/~tonyliu>
+ */
+#include <ucontext.h>
+
+extern "C" {
+
+#if defined(__i386__)
+asm(
+  ".text\n"
+
+  // void proto_context_switch(void ** oldsp, void * newsp)
+  ".globl proto_context_switch\n"
+  ".type proto_context_switch, @function\n"
+  "proto_context_switch:\n"
+  "  movl 4(%esp), %eax\n"
+  "  movl 8(%esp), %edx\n"
+  "  pushl %ebp\n"
+  "  pushl %ebx\n"
+  "  pushl %esi\n"
+  "  pushl %edi\n"
+  "  subl $8, %esp\n"
+  "  stmxcsr (%esp)\n"
+  "  fnstcw 4(%esp)\n"
+  "  movl %esp, (%eax)\n"
+  "  movl %edx, %esp\n"
+
+  // Restore a saved context on current stack pointer.
+  // The signal handler returns here when it redirects a thread to the scheduler.
+  ".globl proto_context_restore\n"
+  "proto_context_restore:\n"
+  "  ldmxcsr (%esp)\n"
+  "  fldcw 4(%esp)\n"
+  "  addl $8, %esp\n"
+  "  popl %edi\n"
+  "  popl %esi\n"
+  "  popl %ebx\n"
+  "  popl %ebp\n"
+  "  ret\n"
+  ".size proto_context_switch, .-proto_context_switch\n"
+
+  // void proto_context_load(void * newsp)
+  ".globl proto_context_load\n"
+  ".type proto_context_load, @function\n"
+  "proto_context_load:\n"
+  "  movl 4(%esp), %esp\n"
+  "  jmp proto_context_restore\n"
+  ".size proto_context_load, .-proto_context_load\n"
+
+  // void proto_context_save_call(void ** oldsp, void (*func)(void *), void * arg)
+  // Save current context and call func(arg) on current stack. func never returns.
+  ".globl proto_context_save_call\n"
+  ".type proto_context_save_call, @function\n"
+  "proto_context_save_call:\n"
+  "  movl 4(%esp), %eax\n"
+  "  movl 8(%esp), %ecx\n"
+  "  movl 12(%esp), %edx\n"
+  "  pushl %ebp\n"
+  "  pushl %ebx\n"
+  "  pushl %esi\n"
+  "  pushl %edi\n"
+  "  subl $8, %esp\n"
+  "  stmxcsr (%esp)\n"
+  "  fnstcw 4(%esp)\n"
+  "  movl %esp, (%eax)\n"
+  "  andl $-16, %esp\n"
+  "  subl $12, %esp\n"
+  "  pushl %edx\n"
+  "  call *%ecx\n"
+  "  ud2\n"
+  ".size proto_context_save_call, .-proto_context_save_call\n"
+
+  // First entry of a new context, see xcontext::makeFrame:
+  // call ebx(esi, edi) and never return.
+  ".globl proto_context_start\n"
+  ".type proto_context_start, @function\n"
+  "proto_context_start:\n"
+  "  andl $-16, %esp\n"
+  "  subl $8, %esp\n"
+  "  pushl %edi\n"
+  "  pushl %esi\n"
+  "  call *%ebx\n"
+  "  ud2\n"
+  ".size proto_context_start, .-proto_context_start\n"
+);
+#elif defined(__x86_64__)
+asm(
+  ".text\n"
+
+  // void proto_context_switch(void ** oldsp, void * newsp)
+  ".globl proto_context_switch\n"
+  ".type proto_context_switch, @function\n"
+  "proto_context_switch:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $8, %rsp\n"
+  "  stmxcsr (%rsp)\n"
+  "  fnstcw 4(%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+
+  ".globl proto_context_restore\n"
+  "proto_context_restore:\n"
+  "  ldmxcsr (%rsp)\n"
+  "  fldcw 4(%rsp)\n"
+  "  addq $8, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  ".size proto_context_switch, .-proto_context_switch\n"
+
+  // void proto_context_load(void * newsp)
+  ".globl proto_context_load\n"
+  ".type proto_context_load, @function\n"
+  "proto_context_load:\n"
+  "  movq %rdi, %rsp\n"
+  "  jmp proto_context_restore\n"
+  ".size proto_context_load, .-proto_context_load\n"
+
+  // void proto_context_save_call(void ** oldsp, void (*func)(void *), void * arg)
+  ".globl proto_context_save_call\n"
+  ".type proto_context_save_call, @function\n"
+  "proto_context_save_call:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $8, %rsp\n"
+  "  stmxcsr (%rsp)\n"
+  "  fnstcw 4(%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  andq $-16, %rsp\n"
+  "  movq %rdx, %rdi\n"
+  "  call *%rsi\n"
+  "  ud2\n"
+  ".size proto_context_save_call, .-proto_context_save_call\n"
+
+  // First entry of a new context: call r12(r13, r14) and never return.
+  ".globl proto_context_start\n"
+  ".type proto_context_start, @function\n"
+  "proto_context_start:\n"
+  "  andq $-16, %rsp\n"
+  "  movq %r13, %rdi\n"
+  "  movq %r14, %rsi\n"
+  "  call *%r12\n"
+  "  ud2\n"
+  ".size proto_context_start, .-proto_context_start\n"
+);
+#else
+#error "Context switch is not supported on this architecture."
+#endif
+
+// Resume a context saved by the signal handler.
+void proto_context_resume(void * context) {
+  setcontext((ucontext_t *)context);
+}
+
+};
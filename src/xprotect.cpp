@@ -29,47 +29,6 @@
 #include "xcontext.h"
 #include "processmap.h"
 
-static long getRegister(ucontext_t * context, int reg) {
-  return context->uc_mcontext.gregs [reg];
-}
-
-static void changeRegister(ucontext_t * ncxt, ucontext_t * ocxt, int reg) {
-  ncxt->uc_mcontext.gregs[reg] = ocxt->uc_mcontext.gregs[reg];
-}
-/// @brief: switch to the scheduler thread of this process.
-//  However, we DONOT actually do switch NOW in the signal handler,
-//  since we donot know how to take care the signal stack
-//  Calling setcontext() can cause program to abort().
-static void switchContext(ucontext_t * destcontext, ucontext_t * srccontext) {
-  // Since the process will set the context to "context" parameter
-  // here, what we need to do is to override "context" with the 
-  // scheduler's context, then after signal handler, 
-  // the process will switch to scheduler thread.
-  long oesp, oebp, oeip;
-  long nesp, nebp, neip;
-  oesp = getRegister((ucontext_t *)destcontext, REG_ESP);
-  oebp = getRegister((ucontext_t *)destcontext, REG_EBP);
-  oeip = getRegister((ucontext_t *)destcontext, REG_EIP);
-  nesp = getRegister((ucontext_t *)srccontext, REG_ESP);
-  nebp = getRegister((ucontext_t *)srccontext, REG_EBP);
-  neip = getRegister((ucontext_t *)srccontext, REG_EIP);
-
-#if 1 
-  // Overlapping current context with the target context
-  changeRegister(destcontext, srccontext, REG_ESP);
-  changeRegister(destcontext, srccontext, REG_EBP);
-  changeRegister(destcontext, srccontext, REG_EIP);
-  changeRegister(destcontext, srccontext, REG_EAX);
-  changeRegister(destcontext, srccontext, REG_EBX);
-  changeRegister(destcontext, srccontext, REG_ECX);
-  changeRegister(destcontext, srccontext, REG_EDX);
-  changeRegister(destcontext, srccontext, REG_ESI);
-  changeRegister(destcontext, srccontext, REG_EDI);
-  changeRegister(destcontext, srccontext, REG_FS);
-  memcpy(&destcontext->uc_mcontext.fpregs, &srccontext->uc_mcontext.fpregs, sizeof(srccontext->uc_mcontext.fpregs));
-#endif
-}
-
 /// @brief Handle the page trap 
 void xprotect::handleAccessTrap (void * addr, void * context) {
   // Compute the page number of this item
@@ -100,11 +59,13 @@ Handle_OwnedPage:
     
     // Add this thread to the process owning this page
     pqueue->enqueue(current);
+    processmap::getInstance().getAffinityStats(coreid)->trapmigrate++;
 
-    // Switch to the scheduler thread after the handler
-    ucontext_t * srccontext = process::getInstance().getScheduler()->myContext();
-   
-    switchContext((ucontext_t *)context, srccontext);
+    // Switch to the scheduler thread after the handler.
+    // We DONOT actually switch NOW in the signal handler, since we donot know
+    // how to take care the signal stack. Instead, the handler will return to
+    // the scheduler's saved context.
+    xcontext::redirectSignalContext((ucontext_t *)context, &process::getInstance().getScheduler()->ctx);
 #endif
   }
   else {
@@ -148,3 +109,30 @@ void xprotect::setPagesOwner(void * addr, int size) {
       _ownning.setPagesUnowned(pageNo, pages);
     }
 }
+
+// Current process is going to park, or a spare gives its core back. Threads
+// trapping on my pages would be sent to my private queue, which forwards them
+// to the global queue, and they would trap again wherever they run. So the
+// pages are protected here and set unowned, then the next trap takes them.
+void xprotect::releasePages(int coreid) {
+  int start = -1;
+
+  if(!_isProtected) {
+    return;
+  }
+
+  for(int pageNo = 0; pageNo <= _totalpages; pageNo++) {
+    bool mine = (pageNo < _totalpages && _ownning.getOwner(pageNo) == coreid);
+
+    if(mine && start < 0) {
+      start = pageNo;
+    }
+    else if(!mine && start >= 0) {
+      // Protect them before others can own them.
+      mprotect((void *)((intptr_t)_startaddr + start * xdefines::PageSize), 
+               (pageNo - start) * xdefines::PageSize, PROT_NONE);
+      _ownning.setPagesUnowned(start, pageNo - start);
+      start = -1;
+    }
+  }
+}
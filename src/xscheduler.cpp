@@ -24,6 +24,9 @@
  * @author Tongping Liu <http://www.cs.umass.edu/~tonyliu>
  */
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <link.h>
 #include "process.h"
 #include "memwrapper.h"
 #include "xmemory.h"
@@ -32,27 +35,31 @@
 #include "xatomic.h"
 #include "xscheduler.h"
 #include "xevent.h"
+#include "processmap.h"
+#include "xthreadpool.h"
+#include "xstacks.h"
+#include "xio.h"
+#include "xaio.h"
 
 extern "C" {
 
-void schedulerWait(void) {
-  //FIXME: whether it is good to use pause.
-//  usleep(100);
-  //pause();
-  xatomic::cpuRelax();
-}
+static void startPreemptTimer(void);
+
 
 // Check whether current thread can be runnable on current process?
-bool isRunnableThread(xthread * thread, int coreid, xqueue * queue) {
+bool isRunnableThread(xthread * thread, int coreid) {
   // If the thread is not existing, return false
   if(!thread)
     return false;
 
   //PRWRN("thread %d is runnable??\n", thread->getTid());
 #if 1
-  // When the thread is bounded and current core is not the core to be bounded
-  if(thread->isBounded() && (thread->isBoundCore(coreid) == false)) {
-    queue->enqueue(thread); 
+  // When the thread is bounded and current core is not the core to be bounded,
+  // give it to its bounded core. Private queues are never stolen from.
+  // If that core is not active now, we have to run it here.
+  if(thread->isBounded() && (thread->isBoundCore(coreid) == false)
+     && processmap::getInstance().isCoreActive(thread->getBoundCore())) {
+    processmap::getInstance().getPQueue(thread->getBoundCore())->enqueue(thread); 
     return false;
   }
 #endif
@@ -69,19 +76,496 @@ bool isRunnableThread(xthread * thread, int coreid, xqueue * queue) {
   return true;
 }
 
-static long getRegister(ucontext_t * context, int reg) {
-  return context->uc_mcontext.gregs [reg];
+// A simple xorshift generator to pick up victims. 
+static inline unsigned int nextRandom(unsigned int * seed) {
+  unsigned int x = *seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *seed = x;
+  return x;
+}
+
+// Steal one thread from other processes' deques or affinity queues, starting
+// from a random victim. Spares are victims too, while they are serving blocked cores.
+static xthread * stealThread(int coreid, unsigned int * seed) {
+  processmap & procmap = processmap::getInstance();
+  int slots = PROCESS_SLOTS;
+  int victim = nextRandom(seed) % slots;
+  xthread * thread = NULL;
+
+  for(int i = 0; i < slots; i++, victim = (victim + 1) % slots) {
+    if(victim == coreid) {
+      continue;
+    }
+
+    thread = procmap.getDeque(victim)->steal();
+    if(thread) {
+      break;
+    }
+
+    // Woken threads waiting for a busy core, see threadMakeRunnable.
+    if(procmap.getAQueue(victim)->hasWork()) {
+      thread = procmap.getAQueue(victim)->dequeue();
+      if(thread) {
+        break;
+      }
+    }
+  }
+
+  return thread;
+}
+
+// Thread is going to run on the core, update the affinity counters.
+// The guard page of its stack may be not protected in this process yet.
+static void threadRunOnCore(xthread * thread, int coreid) {
+  int lastcore = thread->getLastCore();
+
+  if(lastcore != coreid) {
+    xstacks::getInstance().guard(thread->ctx.stack, coreid);
+  }
+
+  if(lastcore >= 0) {
+    affinitystats * stats = processmap::getInstance().getAffinityStats(coreid);
+    if(lastcore == coreid) {
+      stats->hits++;
+    }
+    else {
+      stats->misses++;
+    }
+  }
+
+  thread->setLastCore(coreid);
+}
+
+// Check whether there is some work for the specified core.
+// It is only a hint since we are not holding any lock.
+static bool hasRunnableWork(int coreid) {
+  processmap & procmap = processmap::getInstance();
+  process & proc = process::getInstance();
+
+  if(proc.getPQueue()->hasWork() || procmap.getAQueue(coreid)->hasWork()
+     || proc.getDeque()->hasWork() || proc.getSQueue()->hasWork()) {
+    return true;
+  }
+
+  for(int i = 0; i < PROCESS_SLOTS; i++) {
+    if(i != coreid && (procmap.getDeque(i)->hasWork() || procmap.getAQueue(i)->hasWork())) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// The sleep or socket wait of a thread is over, see threadSleep and xio.h.
+static void sleepTimeout(xthread * thread, unsigned long seq) {
+  bool expired = false;
+
+  // The thread holds its lock until it has been switched out.
+  thread->lock();
+  if(thread->timer.seq == seq 
+     && (thread->status == THREAD_STATUS_SLEEPING || thread->status == THREAD_STATUS_IO_WAITING)) {
+    thread->timer.timedout = true;
+    thread->setThreadRunning();
+    expired = true;
+  }
+  thread->unlock();
+
+  if(expired) {
+    threadMakeRunnable(thread);
+  }
+}
+
+// A timer has expired, let the object that the thread waits on take it off the waitlist.
+static void expireTimer(xthread * thread, xtimer * expired) {
+  // The thread has finished the wait in the meantime.
+  if(thread->timer.seq != expired->seq) {
+    return;
+  }
+
+  switch(expired->type) {
+    case TIMER_COND:
+      ((xcondvar *)expired->object)->condTimeout(thread, expired->seq);
+      break;
+
+    case TIMER_MUTEX:
+      ((xmutex *)expired->object)->mutexTimeout(thread, expired->seq);
+      break;
+
+    case TIMER_SEM:
+      ((xsem *)expired->object)->semTimeout(thread, expired->seq);
+      break;
+
+    case TIMER_FUTEX:
+      xfutex::getInstance().futexTimeout(thread, expired->seq);
+      break;
+
+    case TIMER_SLEEP:
+      sleepTimeout(thread, expired->seq);
+      break;
+
+    default:
+      PRERR("the timer is not defined %d\n", expired->type);
+      break;
+  }
+}
+
+// Expire the timers of specified core, which are due now.
+static void runTimers(int coreid) {
+  xtimerwheel * wheel = processmap::getInstance().getTimers(coreid);
+  unsigned long long tick;
+  xtimer * timer;
+  xtimer expired;
+
+  if(!wheel->hasTimers()) {
+    return;
+  }
+
+  tick = xtimerwheel::currentTick();
+  if(!wheel->isDue(tick)) {
+    return;
+  }
+
+  while((timer = wheel->expire(tick, &expired)) != NULL) {
+    expireTimer(container_of(timer, xthread, timer), &expired);
+  }
+}
+
+// Wake up the threads whose sockets registered on the poller of specified core
+// are ready, waiting at most timeoutms milliseconds.
+static void runPoller(int coreid, int timeoutms) {
+  xpoller * poller = processmap::getInstance().getPoller(coreid);
+  struct epoll_event events[xdefines::IO_POLL_EVENTS];
+  int num;
+
+  num = poller->poll(events, xdefines::IO_POLL_EVENTS, timeoutms);
+  for(int i = 0; i < num; i++) {
+    if(events[i].data.fd == xpoller::WAKE_FD) {
+      if(coreid == process::getInstance().getCoreId()) {
+        poller->drainWakeups();
+      }
+      continue;
+    }
+
+    xio::getInstance().ready(events[i].data.fd, events[i].events);
+  }
+}
+
+// A busy scheduler checks its sockets once in a while, see xdefines::IO_POLL_USECS.
+static void pollSockets(int coreid) {
+  xpoller * poller = processmap::getInstance().getPoller(coreid);
+
+  if(poller->hasWaiters() && poller->isDue(xtimerwheel::now())) {
+    runPoller(coreid, 0);
+  }
+}
+
+// Wake up the threads whose file calls submitted on this core are done, see xaio.h.
+// Only this core can reap them, and the poller is woken up by every completion.
+static void reapFiles(int coreid) {
+  xaio & aio = xaio::getInstance();
+
+  if(aio.hasInflight(coreid)) {
+    aio.reap(coreid);
+  }
+}
+
+// Before sleeping, check the sockets of other cores, since their schedulers 
+// may be busy running threads. Sockets stay on the poller of a spare after it has
+// given the core back. Return how long we can sleep until we check again.
+static unsigned long long runAllPollers(int coreid, unsigned long long timeout) {
+  processmap & procmap = processmap::getInstance();
+  bool waiting = false;
+
+  for(int i = 0; i < PROCESS_SLOTS; i++) {
+    if(i != coreid && procmap.getPoller(i)->hasWaiters()) {
+      runPoller(i, 0);
+      waiting = true;
+    }
+  }
+
+  if(waiting && timeout > xdefines::IO_IDLE_POLL_MSECS * 1000000ULL) {
+    return xdefines::IO_IDLE_POLL_MSECS * 1000000ULL;
+  }
+
+  return timeout;
 }
 
-static xevent * retrieveEvent(lnode * eventlist) {
-  lnode * node = (lnode *)listRetrieveItem(eventlist);
-  xevent * event = NULL;
+// Before sleeping, expire the timers of all cores, since other schedulers may be 
+// busy running threads. Return how long we can sleep until the next timer.
+static unsigned long long runAllTimers(unsigned long long timeout) {
+  processmap & procmap = processmap::getInstance();
+  unsigned long long tick = ~0ULL;
+
+  for(int i = 0; i < PROCESS_SLOTS; i++) {
+    xtimerwheel * wheel = procmap.getTimers(i);
+
+    if(wheel->hasTimers()) {
+      unsigned long long next;
+
+      runTimers(i);
+      next = wheel->nextTick();
+      if(next < tick) {
+        tick = next;
+      }
+    }
+  }
+
+  if(tick != ~0ULL) {
+    unsigned long long now = xtimerwheel::now();
+    unsigned long long when = tick * xtimerwheel::TICK_NS;
+
+    if(when <= now) {
+      return 0;
+    }
+    if(when - now < timeout) {
+      return when - now;
+    }
+  }
+
+  return timeout;
+}
+
+// No work is found. Spin for a while and then sleep on the futex
+// until some thread is put into the queues or the next timer expires.
+// If threads are waiting for sockets on our poller, sleep in epoll_wait instead.
+static void schedulerWait(int coreid, xidle * idle, unsigned long long spinns) {
+  processmap & procmap = processmap::getInstance();
+  unsigned long long timeout;
+  unsigned long long start;
+  bool polling;
+
+  if(idle->spinning(spinns)) {
+    xatomic::cpuRelax();
+    return;
+  }
+
+  timeout = runAllTimers(xdefines::SCHEDULER_SLEEP_MSECS * 1000000ULL);
+  timeout = runAllPollers(coreid, timeout);
+  polling = procmap.getPoller(coreid)->hasWaiters();
+
+  // Announce that we are sleeping and re-check the queues, 
+  // so that any thread inserted before it won't be missed.
+  idle->prepareSleep(procmap.getSleepers(), polling);
+
+  if(hasRunnableWork(coreid)) {
+    idle->cancelSleep(procmap.getSleepers());
+    return;
+  }
+
+  if(!polling) {
+    idle->sleep(procmap.getSleepers(), timeout);
+    return;
+  }
+
+  // Rounded up, so that we never wake up before the next timer.
+  start = idle->beginSleep();
+  runPoller(coreid, (int)((timeout + 999999ULL) / 1000000ULL));
+  idle->endSleep(procmap.getSleepers(), start);
+}
+
+// Park current process, which has been idle for long enough. Threads in my queues
+// and those put into my private queue later go to the global queue, my pages
+// are given up.
+// Note: parked processes don't exit, so we never need to reap them or worry 
+// about reused pids. We come back when the core is claimed again.
+static void schedulerRetire(int coreid, process & proc) {
+  processmap & procmap = processmap::getInstance();
+  xqueue * squeue = proc.getSQueue();
+  xthread * thread;
+
+  proc.getPQueue()->close(squeue);
+  procmap.getAQueue(coreid)->close(squeue);
+
+  while((thread = proc.getDeque()->pop()) != NULL) {
+    squeue->enqueue(thread);
+  }
+
+  // Core 0 is never parked, it takes care of my timers.
+  procmap.getTimers(coreid)->moveTo(procmap.getTimers(0), 0);
+
+  // Others can reuse my joined threads.
+  xthreadpool::getInstance().flush(coreid);
+
+  // Others take my pages, see xprotect::releasePages.
+  xmemory::getInstance().releaseOwnedPages(coreid);
+
+  procmap.parkCore(coreid);
+
+  // Now somebody has claimed this core again.
+  proc.getPQueue()->open();
+  procmap.getAQueue(coreid)->open();
+  procmap.setCoreActive(coreid);
+}
+
+// Start a process for an inactive core, or wake up a parked one.
+// It is called when threads are waiting and all active schedulers are busy.
+static void schedulerGrow(void) {
+  processmap & procmap = processmap::getInstance();
+
+  if(procmap.getActiveCores() >= CPU_CORES) {
+    return;
+  }
+
+  for(int i = 1; i < CPU_CORES; i++) {
+    int state = procmap.getCoreState(i);
+
+    if(state == CORE_PARKED && procmap.claimCore(i, CORE_PARKED)) {
+      procmap.unparkCore(i);
+      return;
+    }
+
+    if(state == CORE_INACTIVE && procmap.claimCore(i, CORE_INACTIVE)) {
+      process::getInstance().create(i);
+      return;
+    }
+  }
+}
+
+// Syscall handoff: a process in a syscall that we can't make nonblocking, like 
+// reading a file or fsync, can't run the threads waiting for its core. Spare 
+// processes are created at startup. A spare looks at the syscalls of all cores,
+// and adopts a core whose process has been blocked for SYSCALL_BLOCK_USECS while
+// threads are waiting. Then it runs on the CPU of that core, and serves the 
+// private queue, the deque, the timers and the sockets of the core besides its own,
+// until the blocked process returns or there is no more work. The blocked process
+// never waits for the spare, both of them serve the core for a while.
+// Threads bound to the core are left to its own process.
+
+// Wait for a blocked core with waiting threads, and adopt it. Return the core.
+static int spareAdopt(int spareid, process & proc) {
+  processmap & procmap = processmap::getInstance();
+  unsigned long interval = xdefines::SYSCALL_CHECK_USECS;
+  struct timespec ts;
+
+  for(;;) {
+    unsigned long now = processmap::syscallClock();
+    unsigned long wait = interval;
+
+    for(int i = 0; i < CPU_CORES; i++) {
+      unsigned long elapsed = procmap.getSyscallTime(i, now);
+
+      if(elapsed == 0) {
+        continue;
+      }
+
+      // Check again when it becomes blocked.
+      if(elapsed < xdefines::SYSCALL_BLOCK_USECS) {
+        if(xdefines::SYSCALL_BLOCK_USECS - elapsed < wait) {
+          wait = xdefines::SYSCALL_BLOCK_USECS - elapsed;
+        }
+        continue;
+      }
+
+      // Threads in the global queue can't be run if nobody else is idle.
+      if((procmap.getLoad(i) > 0 || (proc.getSQueue()->hasWork() && !procmap.hasSleepers()))
+         && procmap.adoptCore(i, spareid)) {
+        // The blocked process has left its CPU.
+        proc.bindToCpu(i);
+        proc.getPQueue()->open();
+        procmap.getAQueue(spareid)->open();
+        return i;
+      }
+    }
+
+    if(wait < xdefines::SYSCALL_CHECK_USECS) {
+      wait = xdefines::SYSCALL_CHECK_USECS;
+    }
+
+    ts.tv_sec = wait / 1000000;
+    ts.tv_nsec = (wait % 1000000) * 1000;
+    WRAP(nanosleep)(&ts, NULL);
+
+    if(interval < xdefines::SYSCALL_CHECK_MAX_USECS) {
+      interval *= 2;
+    }
+  }
+}
+
+// Take a thread waiting for the adopted core from its private queue, affinity
+// queue or deque. Bound threads are put back, so we only look at those waiting now.
+static xthread * spareTakeThread(int coreid) {
+  processmap & procmap = processmap::getInstance();
+  xqueue * pqueue = procmap.getPQueue(coreid);
+  xthread * thread;
+
+  for(int i = pqueue->getLength(); i > 0; i--) {
+    thread = pqueue->dequeue();
+    if(thread == NULL) {
+      break;
+    }
+
+    if(!thread->isBounded()) {
+      return thread;
+    }
+    pqueue->enqueue(thread);
+  }
+
+  if(procmap.getAQueue(coreid)->hasWork()) {
+    thread = procmap.getAQueue(coreid)->dequeue();
+    if(thread) {
+      return thread;
+    }
+  }
+
+  return procmap.getDeque(coreid)->steal();
+}
+
+// Give the adopted core back. Like schedulerRetire, threads in my queues and 
+// those put into my private queue later go to the global queue.
+static void spareRelease(int spareid, int coreid, process & proc) {
+  processmap & procmap = processmap::getInstance();
+  xqueue * squeue = proc.getSQueue();
+  xthread * thread;
+
+  proc.getPQueue()->close(squeue);
+  procmap.getAQueue(spareid)->close(squeue);
+
+  while((thread = proc.getDeque()->pop()) != NULL) {
+    squeue->enqueue(thread);
+  }
 
-  if(node) {
-    event = container_of(node, xevent, toqueue);
-  } 
+  procmap.getTimers(spareid)->moveTo(procmap.getTimers(0), 0);
+  xthreadpool::getInstance().flush(spareid);
+  xmemory::getInstance().releaseOwnedPages(spareid);
 
-  return event;
+  procmap.releaseCore(coreid, spareid);
+}
+
+// Wake up the scheduler of specified core. If coreid is -1 (the global queue), 
+// anyone who is sleeping can do the work.
+void schedulerWakeup(int coreid) {
+  if(coreid < 0) {
+    schedulerWakeupAny();
+  }
+  else {
+    processmap::getInstance().getIdle(coreid)->wakeup();
+  }
+}
+
+// Wake up one sleeping scheduler so that it can steal the new work. 
+// Return false if nobody is sleeping.
+bool schedulerWakeupAny(void) {
+  processmap & procmap = processmap::getInstance();
+  int coreid;
+
+  if(!procmap.hasSleepers()) {
+    return false;
+  }
+
+  coreid = process::getInstance().getCoreId();
+  for(int i = 1; i <= CPU_CORES; i++) {
+    if(procmap.getIdle((coreid + i) % CPU_CORES)->wakeup()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static long getRegister(ucontext_t * context, int reg) {
+  return context->uc_mcontext.gregs [reg];
 }
 
 // Put a thread into the specified queue, which should
@@ -90,46 +574,36 @@ static void enqueueYieldThread(xthread * thread, xqueue * queue) {
   queue->enqueue(thread);
 }
 
-// handle the events of current thread.
-static void handleThreadEvents(xthread * current) {
+// Handle the event posted by the thread which has just switched to the scheduler.
+static void handleThreadEvents(process & proc) {
+  xevent event;
 
+  if(!proc.takeEvent(&event)) {
+    return;
+  }
 
-  //fprintf(stderr, "%d: HANDLE thread events\n", getpid());
-  if(current->hasPendingEvents()) { 
-    lnode  eventlist;
-    //fprintf(stderr, "%d:*******has pending events\n", getpid());
-    // Get all events inside the event queue.
-    current->getAllEvents(&eventlist);
- 
-    // Get events of this thread.
-    while(!isListEmpty(&eventlist)) {
-      xevent * event = retrieveEvent(&eventlist);
-
-      switch(event->type) {
-        case E_EVENT_YIELD: 
-          // Put the specified thread into the specified queue.
-          enqueueYieldThread(event->args.YIELD.thread, event->args.YIELD.queue);      
-          break;
+  switch(event.type) {
+    case E_EVENT_YIELD: 
+      // Put the specified thread into the specified queue.
+      enqueueYieldThread(event.args.YIELD.thread, event.args.YIELD.queue);      
+      break;
 
-        case E_EVENT_RELEASE_LOCK:
-          {
-            spinlock * lock = event->args.RELEASELOCK.lock;
-            lock->release();
-          }        
-          break;
+    case E_EVENT_RELEASE_LOCK:
+      event.args.RELEASELOCK.lock->release();
+      break;
 
-        default:
-          PRERR("the event is not defined %d\n", event->type);
-          break;
-      }
-    }
+    default:
+      PRERR("the event is not defined %d\n", event.type);
+      break;
   }
 }
  
 // Main entry of a process
 void schedulerThread(void) {
   xthread * thread;
-  xqueue  * pqueue, * squeue;
+  xqueue  * pqueue, * aqueue, * squeue;
+  xdeque  * deque;
+  xidle   * idle;
   process &proc = process::getInstance();
   int coreid = proc.getCoreId();
   xthread * scheduler = proc.getScheduler();
@@ -140,10 +614,26 @@ void schedulerThread(void) {
 
   // Get the queues about this process
   pqueue = proc.getPQueue();
+  aqueue = processmap::getInstance().getAQueue(coreid);
   squeue = proc.getSQueue();
+  deque = proc.getDeque();
+  idle = processmap::getInstance().getIdle(coreid);
 
-  // Release the temporary stack.
+  // Release the temporary stacks.
   xrun::getInstance().freePrivateStack();
+  proc.freeCloneStack();
+
+  // Threads can be given to my private queue now.
+  // A spare is active only when it has adopted a blocked core.
+  bool spare = processmap::getInstance().isSpare(coreid);
+  int adopted = -1;
+
+  if(!spare) {
+    processmap::getInstance().setCoreActive(coreid);
+  }
+
+  // Start the timer of preemption if required.
+  startPreemptTimer();
 
   //printf("pid %d tid %d scheduler %d proc %p\n", mypid, tid, scheduler, proc);
 #if 0
@@ -164,38 +654,122 @@ void schedulerThread(void) {
 
   int running_thread3 = 0;
 
-  bool inpqueue = false;
+  // Seed of victim selection, different for each process.
+  unsigned int seed = (coreid + 1) * 2654435761U;
+
+  // How long we will spin before sleeping.
+  char * spinenv = getenv("PROTO_SPIN_USECS");
+  unsigned long long spinns = (spinenv ? atol(spinenv) : xdefines::SCHEDULER_SPIN_USECS) * 1000ULL;
+
+  // When we should be parked, see schedulerRetire.
+  int mincores = processmap::getInstance().getMinCores();
+  unsigned long long retirens = processmap::getInstance().getRetireTime();
+
   // An endless loop
   for(;;) {
     
-    //handleThreadEvents(scheduler);
+    //handleThreadEvents(proc);
 
     // Whileloop is used to pick up one ready thread. 
     while(true) {
-      inpqueue = false;
+      // A spare serves the adopted core before its own queues, see the syscall handoff.
+      if(spare) {
+        // File calls submitted here must be reaped here.
+        if(adopted >= 0 && !processmap::getInstance().isBlocked(adopted, processmap::syscallClock())
+           && !xaio::getInstance().hasInflight(coreid)) {
+          spareRelease(coreid, adopted, proc);
+          adopted = -1;
+        }
+
+        if(adopted < 0) {
+          adopted = spareAdopt(coreid, proc);
+          idle->stopIdle();
+        }
+
+        runTimers(adopted);
+        pollSockets(adopted);
+
+        thread = spareTakeThread(adopted);
+        if(isRunnableThread(thread, coreid)) {
+          break;
+        }
+      }
+
+      // Threads whose timed waits have expired become runnable.
+      runTimers(coreid);
+
+      // So do threads whose sockets are ready, or whose file calls are done.
+      pollSockets(coreid);
+      reapFiles(coreid);
+
       // Check whether there are some work in my private queue.
+      // Bounded threads and migrated threads are here.
       thread = pqueue->dequeue();
    
       // if one thread is bounded, only those boundative can run them.
-      if(isRunnableThread(thread, coreid, squeue)) { 
-        inpqueue = true;
+      if(isRunnableThread(thread, coreid)) { 
+        break;
+      }
+
+      // Woken threads which ran here last time, unless others have stolen them.
+      if(aqueue->hasWork()) {
+        thread = aqueue->dequeue();
+        if(isRunnableThread(thread, coreid)) {
+          break;
+        }
+      }
+
+      // Check my own deque, no lock is needed.
+      thread = deque->pop();
+      if(isRunnableThread(thread, coreid)) { 
         break;
       }
         
       // Check whether there are some work in the global queue.
-      thread = squeue->dequeue(); 
+      if(squeue->hasWork()) {
+        thread = squeue->dequeue(); 
       
-      if(isRunnableThread(thread, coreid, squeue)) { 
+        if(isRunnableThread(thread, coreid)) { 
+          break;
+        }
+      }
+
+      // Steal from others.
+      thread = stealThread(coreid, &seed);
+      if(isRunnableThread(thread, coreid)) { 
         break;
       }
 
-      // If no work need to do, sleep for a while and try again
-      schedulerWait(); 
+      // A spare gives the adopted core back if there is no more work.
+      // It waits for its file calls in epoll_wait, like other schedulers.
+      if(spare && !xaio::getInstance().hasInflight(coreid)) {
+        if(idle->spinning(spinns)) {
+          xatomic::cpuRelax();
+        }
+        else {
+          spareRelease(coreid, adopted, proc);
+          adopted = -1;
+        }
+        continue;
+      }
+
+      // Give the core back if we have been idle for long enough.
+      // Sockets and file calls on our poller must be waited for here.
+      if(coreid >= mincores && idle->idleTime() >= retirens
+         && !processmap::getInstance().getPoller(coreid)->hasWaiters()) {
+        schedulerRetire(coreid, proc);
+        idle->stopIdle();
+        continue;
+      }
+
+      // If no work need to do, spin or sleep for a while and try again
+      schedulerWait(coreid, idle, spinns); 
     }
 
+    idle->stopIdle();
+
     // Now we have some ready threads. 
     PRLOG("%d: thread %x (at %p) is ready now\n", getpid(), thread->getTid(), thread);
-   // fprintf(stderr, "%d: thread %d (at %p) is ready now, getting from pqueue %d\n", getpid(), thread->getTid(), thread, inpqueue);
 
 #if 1
     // Now check whether some signals for this thread
@@ -212,7 +786,9 @@ void schedulerThread(void) {
 
     PRDBG("Set thread %d to current thread before switching\n", thread->getTid());
     // Set current for new thread
+    threadRunOnCore(thread, coreid);
     process::getInstance().setCurrent(thread);
+    proc.startSlice();
     //proc.setCurrent(thread);
 
 
@@ -241,7 +817,7 @@ void schedulerThread(void) {
     //process::getInstance().setCurrent(thread);
     proc.setCurrent(scheduler);
 
-    handleThreadEvents(scheduler);
+    handleThreadEvents(proc);
  
     //printf("SCHEDULING: scheduler thread\n");
     // Update the time on of previous thread 
@@ -259,18 +835,262 @@ void schedulerThread(void) {
   }
 }
 
-// Add a event to the scheduler's event queue
-void insertSchedulerEventQueue(xthread * scheduler, xevent * event) {
+// Make a thread runnable again.
+// Bounded threads always go to the private queue of their core, which is never
+// stolen from. Other threads go back to the affinity queue of the core they ran on
+// last time, since their data is probably still in that cache. Idle processes
+// steal from affinity queues too, so they don't starve behind a busy core. Only when that
+// core is obviously busier than current one, they are pushed onto the deque of 
+// current process, idle processes will steal them if current process is busy.
+// If nobody can steal them, a new process is started, see schedulerGrow.
+// Note: only current process can push to its deque, so this must be called
+// on current process (user thread or scheduler thread).
+void threadMakeRunnable(xthread * thread) {
+  processmap & procmap = processmap::getInstance();
+  int lastcore = thread->getLastCore();
+  int coreid;
+
+  if(thread->isBounded() && procmap.isCoreActive(thread->getBoundCore())) {
+    procmap.getPQueue(thread->getBoundCore())->enqueue(thread);
+    return;
+  }
+
+  coreid = process::getInstance().getCoreId();
+  if(lastcore >= 0 && lastcore != coreid && procmap.isCoreActive(lastcore)) {
+    affinitystats * stats = procmap.getAffinityStats(coreid);
+
+    // Hysteresis: only migrate when the imbalance is large enough.
+    if(procmap.getLoad(lastcore) <= procmap.getLoad(coreid) + xdefines::AFFINITY_IMBALANCE) {
+      stats->wakeaffine++;
+      procmap.getAQueue(lastcore)->enqueue(thread);
+
+      // Others are waiting there before it, wake up a thief that may take it
+      // sooner. The enqueue has been fenced, see xqueue.h.
+      if(procmap.getLoad(lastcore) > 1) {
+        schedulerWakeupAny();
+      }
+      return;
+    }
+
+    stats->wakemigrate++;
+  }
+
+  process::getInstance().getDeque()->push(thread);
+
+  // The push must be visible before we check sleepers, 
+  // see xidle.h. We are awake, so wake up a thief.
+  xatomic::memoryBarrier();
+  if(!schedulerWakeupAny() && procmap.getLoad(coreid) >= xdefines::POOL_GROW_THRESHOLD) {
+    schedulerGrow();
+  }
+}
+
+// Pick up a thread which current thread can switch to directly.
+// Only threads saved by THREAD_SWITCH can be picked, since a trapped thread
+// will resume from the signal context and never handle the pending event.
+static xthread * pickHandoffThread(process & proc) {
+  xdeque * deque = proc.getDeque();
+  xtimerwheel * wheel = processmap::getInstance().getTimers(proc.getCoreId());
+  xpoller * poller = processmap::getInstance().getPoller(proc.getCoreId());
+  xthread * thread;
+
+  // The scheduler should expire the timers and check the sockets first.
+  if(wheel->hasTimers() && wheel->isDue(xtimerwheel::currentTick())) {
+    return NULL;
+  }
+
+  if(poller->hasWaiters() && poller->isDue(xtimerwheel::now())) {
+    return NULL;
+  }
+
+  thread = deque->pop();
+
+  if(thread && thread->ctx.trapped) {
+    // Leave it to the scheduler.
+    deque->push(thread);
+    thread = NULL;
+  }
+
+  return thread;
+}
+
+// Current thread has posted its event and can't run any more.
+// Hand the core to a runnable thread of current process directly if there is
+// one, otherwise switch to the scheduler. Whoever runs next handles the event.
+static void threadSwitchOut(process & proc, xthread * current) {
+  xthread * next = pickHandoffThread(proc);
+
+  if(next) {
+    threadRunOnCore(next, proc.getCoreId());
+    proc.setCurrent(next);
+    proc.startSlice();
+  }
+  else {
+    next = proc.getScheduler();
+  }
+
+  THREAD_SWITCH(current, next);
+
+  // Now I am running again, maybe on another process. 
+  // If I was switched to by a thread directly, handle its event.
+  handleThreadEvents(process::getInstance());
+
+  // Preemption is disabled by the yielding functions.
+  current->nopreempt--;
+}
+
+// A new thread is running for the first time, handle the event of the previous
+// thread, since it may hand off the core to me directly.
+void threadStartRunning(void) {
+  handleThreadEvents(process::getInstance());
 
-  // We are trying to add this event to the scheduler's queue.
-  // So we have to acquire the scheduler's lock.
-  scheduler->lock();
+  // Preemption is disabled when the thread is spawned.
+  process::getInstance().getCurrent()->nopreempt--;
+}
 
-  listInsertTail(&event->toqueue, &scheduler->eventqueue);
+// Whether some other threads are waiting for current core.
+static bool hasLocalWork(process & proc) {
+  return proc.getPQueue()->hasWork() || processmap::getInstance().getAQueue(proc.getCoreId())->hasWork()
+         || proc.getDeque()->hasWork() || proc.getSQueue()->hasWork();
+}
+
+// Preempt current thread, which goes to the tail of the global queue, 
+// or its bounded core's private queue, so that others waiting on this core can run first.
+static void threadPreempt(process & proc, xthread * current) {
+  xqueue * queue;
+
+  if(current->isBounded()) {
+    queue = processmap::getInstance().getPQueue(current->getBoundCore());
+  }
+  else {
+    queue = proc.getSQueue();
+  }
 
-  scheduler->unlock();
+  proc.startSlice();
+  threadYieldToRunQueue(queue);
 }
 
+// Give up the core voluntarily if someone else is waiting for it, like sched_yield.
+void threadYield(void) {
+  process & proc = process::getInstance();
+
+  if(hasLocalWork(proc)) {
+    threadPreempt(proc, proc.getCurrent());
+  }
+}
+
+void threadPreemptDisable(void) {
+  xthread * current = process::getInstance().getCurrent();
+
+  if(current) {
+    current->nopreempt++;
+  }
+}
+
+// Leave a runtime critical section. We don't yield here even if the timeslice 
+// is over, since the runtime may be called by libc, e.g. malloc inside printf.
+void threadPreemptEnable(void) {
+  xthread * current = process::getInstance().getCurrent();
+
+  if(current) {
+    current->nopreempt--;
+  }
+}
+
+// The executable text of the application, where a thread can be preempted.
+static unsigned long apptextstart;
+static unsigned long apptextend;
+
+// The main program is always the first object.
+static int findAppText(struct dl_phdr_info * info, size_t size, void * data) {
+  for(int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) * phdr = &info->dlpi_phdr[i];
+
+    if(phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+      apptextstart = info->dlpi_addr + phdr->p_vaddr;
+      apptextend = apptextstart + phdr->p_memsz;
+      break;
+    }
+  }
+
+  return 1;
+}
+
+// Handler of the timer tick. It runs on the stack of the interrupted thread, 
+// so we can simply yield here: the thread will return from the handler when it 
+// is switched back, and sigreturn will restore all its registers.
+// User threads of a process share one kernel task, so libc can't tell them apart,
+// e.g. a recursive lock of a FILE would let another thread in. So a thread is only
+// preempted while it is running the application itself, otherwise we try again on
+// the next tick. A thread which stays in libraries is never preempted.
+static void handleTimerTick(int signum, siginfo_t * siginfo, void * context) {
+  process & proc = process::getInstance();
+  xthread * current = proc.getCurrent();
+  unsigned long pc = getRegister((ucontext_t *)context, REG_EIP);
+  int olderrno = errno;
+
+  // The scheduler is never preempted.
+  if(current == NULL || current == proc.getScheduler()) {
+    return;
+  }
+
+  if(!proc.sliceExpired()) {
+    return;
+  }
+
+  // Current thread is inside the runtime or a library, or we are switching 
+  // between threads (current is not updated yet or we are not on its stack).
+  if(current->nopreempt > 0 || !current->ctx.isOnStack(&olderrno)
+     || pc < apptextstart || pc >= apptextend) {
+    return;
+  }
+
+  if(hasLocalWork(proc)) {
+    threadPreempt(proc, current);
+  }
+  
+  errno = olderrno;
+}
+
+// Start a periodical timer for current process, which sends SIGALRM on each timeslice.
+// The timer is not inherited by children processes, so every scheduler starts its own one.
+static void startPreemptTimer(void) {
+  char * env = getenv("PROTO_TIMESLICE_US");
+  long timeslice = env ? atol(env) : xdefines::PREEMPT_TIMESLICE_USECS;
+  struct sigaction siga;
+  struct sigevent sev;
+  struct itimerspec its;
+  timer_t timerid;
+
+  if(timeslice <= 0) {
+    return;
+  }
+
+  dl_iterate_phdr(findAppText, NULL);
+
+  // The handler can be interrupted by the next tick after it yields, 
+  // so the timer of the next thread is not blocked.
+  sigemptyset(&siga.sa_mask);
+  siga.sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER;
+  siga.sa_sigaction = handleTimerTick;
+  if(sigaction(SIGALRM, &siga, NULL) == -1) {
+    PRFATAL("can't install the handler of preemption\n");
+  }
+
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_SIGNAL;
+  sev.sigev_signo = SIGALRM;
+  if(timer_create(CLOCK_MONOTONIC, &sev, &timerid) == -1) {
+    PRFATAL("can't create the timer of preemption\n");
+  }
+
+  its.it_value.tv_sec = timeslice / 1000000;
+  its.it_value.tv_nsec = (timeslice % 1000000) * 1000;
+  its.it_interval = its.it_value;
+  if(timer_settime(timerid, 0, &its, NULL) == -1) {
+    PRFATAL("can't start the timer of preemption\n");
+  }
+}
 
 // Current thread is yielding to specified runqueue. 
 void threadYieldToRunQueue(xqueue * to) {
@@ -288,20 +1108,16 @@ void threadYieldToRunQueue(xqueue * to) {
   assert(scheduler != NULL);
   assert(current != scheduler);
 
-  // Allocate a block of shared memery to 
-  xevent * event;
-  void * ptr = MALLOC_SHARED(sizeof(xevent));
-  event = (xevent *) new (ptr) xevent;
+  // No preemption until I am switched back, see threadSwitchOut.
+  current->nopreempt++;
 
-  event->type = E_EVENT_YIELD; 
+  // Ask the next thread to put me into the queue after switching.
+  xevent * event = proc.postEvent(E_EVENT_YIELD);
   event->args.YIELD.thread = current;
   event->args.YIELD.queue = to;
-
-  // Add this event to the scheduler's  event queue.
-  insertSchedulerEventQueue(scheduler, event);
  
   //fprintf(stderr, "%d yielding: Right before switch to scheduler\n", getpid()); 
-  THREAD_SWITCH(current, scheduler);
+  threadSwitchOut(proc, current);
 }
 
 // Initial thread is yielding. 
@@ -321,8 +1137,9 @@ void threadYieldInitially(xqueue * to) {
   THREAD_SWITCH(current, scheduler);
 }
 
-// Current thread is yielding to scheduler thread, here, current thread is still
-// holding the lock, then it is the duty of scheduler to release lock.
+// Current thread is yielding to scheduler thread (or to the next thread directly), 
+// here, current thread is still holding the lock, then it is the duty of the next
+// one to release lock.
 // Holding the lock in switching is to avoid possible race condition:
 // the same thread can not run on two processes. 
 // If not holding the lock, then it is possible that the target process is running 
@@ -339,18 +1156,80 @@ void threadYieldHoldingLock(spinlock * lock) {
   assert(scheduler != NULL);
   assert(current != scheduler);
  
-  void * ptr = MALLOC_SHARED(sizeof(xevent));
-  xevent * event = (xevent *) new (ptr) xevent;
+  current->nopreempt++;
 
-  event->type = E_EVENT_RELEASE_LOCK;
-
-  // We ask the scheduler to release the lock for me.
+  // We ask the next thread to release the lock for me.
+  xevent * event = proc.postEvent(E_EVENT_RELEASE_LOCK);
   event->args.RELEASELOCK.lock = lock; 
-  
-  // Add this event to the scheduler's  event queue.
-  insertSchedulerEventQueue(scheduler, event);
 
-  THREAD_SWITCH(current, scheduler);
+  threadSwitchOut(proc, current);
+}
+
+// Arm the timer of a thread which is going to wait on the object until the deadline.
+// Note: the lock of the object must be held, so that the timer can't be handled
+// before the thread is put into the waitlist.
+void threadArmTimer(xthread * thread, int type, void * object, unsigned long long deadline) {
+  int coreid = process::getInstance().getCoreId();
+  xtimer * timer = &thread->timer;
+
+  timer->type = type;
+  timer->object = object;
+  timer->timedout = false;
+  timer->seq++;
+
+  processmap::getInstance().getTimers(coreid)->add(timer, coreid, deadline);
+}
+
+// The thread is running again after a timed wait. Disarm its timer, 
+// and return whether the wait has timed out.
+bool threadCancelTimer(xthread * thread) {
+  processmap & procmap = processmap::getInstance();
+  xtimer * timer = &thread->timer;
+  int coreid;
+
+  // The timer can be moved to core 0 in the meantime, see schedulerRetire.
+  while((coreid = timer->core) >= 0) {
+    if(procmap.getTimers(coreid)->remove(timer, coreid)) {
+      break;
+    }
+  }
+
+  // A late handler must not take the thread for waiting in another wait.
+  timer->seq++;
+  return timer->timedout;
+}
+
+// Park current thread until the deadline, so that others can run on this core.
+void threadSleep(unsigned long long deadline) {
+  xthread * current = process::getInstance().getCurrent();
+
+  // Like usleep(0), a sleep that is already over is only a yield.
+  if(deadline <= xtimerwheel::now()) {
+    threadYield();
+    return;
+  }
+
+  // The thread lock keeps the timer from waking us up before we are switched out.
+  current->lock();
+  current->setThreadSleeping();
+  threadArmTimer(current, TIMER_SLEEP, NULL, deadline);
+  threadYieldHoldingLock(current->getLock());
+
+  threadCancelTimer(current);
+}
+
+// Current thread is entering a syscall which may block the process.
+// It stays on current process until the syscall returns, see threadSyscallExit.
+void threadSyscallEnter(void) {
+  process & proc = process::getInstance();
+
+  proc.getCurrent()->nopreempt++;
+  processmap::getInstance().enterSyscall(proc.getCoreId());
+}
+
+void threadSyscallExit(void) {
+  processmap::getInstance().exitSyscall(process::getInstance().getCoreId());
+  threadPreemptEnable();
 }
 
 // threadYieldToRunQueue
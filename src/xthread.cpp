@@ -34,10 +34,11 @@
 #include "xscheduler.h"
 #include "xmap.h"
 #include "processmap.h"
+#include "xthreadpool.h"
 
 void xthread::removeFromDeadQueue(void) {
   xqueue * dqueue = xrun::getInstance().getDeadQueue();
-  dqueue->dequeue();  
+  dqueue->remove(this);  
 }
 
 void xthread::putJoineeQueue(xthread * joinee) {
@@ -45,15 +46,6 @@ void xthread::putJoineeQueue(xthread * joinee) {
 }
 
 
-// Put all events into the specified list and re-initialize the event queue
-void xthread::getAllEvents(lnode * list) {
-  lock();
-
-  listRetrieveAllItems(list, &eventqueue);
-
-  unlock();
-}
-
 // Put myself into the global dead queue.
 void xthread::putDeadqueue(xthread * thread) {
   xqueue * dqueue = xrun::getInstance().getDeadQueue();
@@ -65,6 +57,9 @@ void xthread::spawn(void * actualFunc, void * arg) {
     PRLOG("%d: Spawning ....\n", getpid());
     // Make context
     ctx.makeContext((void *)&xthread::threadRun, actualFunc, arg);   
+
+    // No preemption until the new thread has handled the pending event, see threadStartRunning.
+    nopreempt = 1;
  
     // set the parent to current thread.
     parent = process::getInstance().getCurrent();
@@ -104,11 +99,8 @@ void xthread::freeThread(xthread * thread) {
   // Cleanup the xmap about this thread.
   xmap::getInstance().deregisterThread(tid);
  
-  // Free the stack for this thread.
-  thread->ctx.freeStack();
-
-  // Free the memory for this thread.
-  FREE_SHARED(thread);
+  // Keep the thread and its stack for the next spawn on this core.
+  xthreadpool::getInstance().free(process::getInstance().getCoreId(), thread);
 }
 
 /**
@@ -135,10 +127,6 @@ void xthread::cancel(xthread * current, int tid) {
  
 }
 
-bool xthread::hasPendingEvents(void) {
-  return (!isListEmpty(&eventqueue)); 
-}
-
 /**
  * pthread_join a thread with given tid.
  */
@@ -253,16 +241,10 @@ xthread * xthread::getJoiner(void) {
   return thread;
 }
 
-// Put a thread into a private queue
-static xqueue * getPrivateQueue(int coreid) {
-  xqueue * pqueue = processmap::getInstance().getPQueue(coreid);
-  return pqueue;
-}      
-
 // @brief: thread exit function
 // 1. Check whether the parent thread is waiting on my exit.
 //    Wakeup the parent thread and put the parent thread into
-//    the global queue. 
+//    the run queue. 
 // 2. Put myself into the dead queue. Thus this thread
 //    can be cleanedup by one thread to join me.
 //    According to posix standard, there is no require
@@ -271,6 +253,9 @@ void xthread::exit(void * retval) {
   xthread * thread = process::getInstance().getCurrent();
 
   PRDBG("NNNNNOW %d: exit function: tid %d", getpid(), thread->getTid()); 
+
+  // A dying thread is never preempted. 
+  threadPreemptDisable();
  
   // Acquire myself's lock in order to avoid the joiner to put into
   // my joinqueue in the same time. 
@@ -293,18 +278,9 @@ void xthread::exit(void * retval) {
     // Change the joiner status.
     joiner->status = THREAD_STATUS_RUNNING;
  
-    // if the joiner is bounded, we have to put it into specified private queue.
-    xqueue * queue;
-
-    if(joiner->isBounded()) {
-      queue = getPrivateQueue(joiner->getBoundCore());      
-    } 
-    else {
-      queue = process::getInstance().getSQueue();
-    }
-
-    // Put the joiner to the current run queue.
-    queue->enqueue(joiner);
+    // Put the joiner to the run queue. If the joiner is bounded, 
+    // it will be put into the private queue of its bounded core.
+    threadMakeRunnable(joiner);
 
     // Release the lock
     threadYieldHoldingLock(thread->getLock());
@@ -321,6 +297,9 @@ void xthread::exit(void * retval) {
 
 // I could use a class function, however, 
 void xthread::threadRun(void * threadFunc, void * arg) {
+
+  // The previous thread may be waiting for us to finish its yield.
+  threadStartRunning();
   
   // Run the actual thread function.
   void * retval = ((threadFunction*)threadFunc)(arg);
@@ -0,0 +1,172 @@
+// Test: many threads going through one barrier round after round, like the
+// time steps of a stencil code. Every thread checks that nobody has left the
+// last round or entered the next one while it was waiting, and exactly one
+// thread gets PTHREAD_BARRIER_SERIAL_THREAD in every round. See xbarr.h.
+// Then the same with the split-phase barrier of proto.h, where threads work
+// between arriving and waiting, and the main thread waits on a latch which
+// every thread counts down when it is done. A latch of count 0 must be open
+// at once, and stay open when it is counted down past zero.
+// Usage: runner [threads] [rounds]
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "proto.h"
+
+static int threads = 256;
+static int rounds = 1000;
+
+static pthread_barrier_t barrier;
+static proto_barrier_t splitbarrier;
+static proto_latch_t latch;
+static volatile unsigned long arrived;
+static volatile unsigned long serials;
+static volatile unsigned long errors;
+static volatile unsigned long finished;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void * worker(void * arg) {
+  for(int i = 0; i < rounds; i++) {
+    __sync_fetch_and_add(&arrived, 1);
+
+    int ret = pthread_barrier_wait(&barrier);
+    if(ret == PTHREAD_BARRIER_SERIAL_THREAD) {
+      __sync_fetch_and_add(&serials, 1);
+    }
+    else if(ret != 0) {
+      __sync_fetch_and_add(&errors, 1);
+    }
+
+    // Everybody has arrived for this round, and nobody can arrive for the
+    // next one before we pass the second barrier.
+    if(arrived != (unsigned long)threads * (i + 1)) {
+      __sync_fetch_and_add(&errors, 1);
+    }
+
+    pthread_barrier_wait(&barrier);
+  }
+  return NULL;
+}
+
+static void * splitWorker(void * arg) {
+  volatile unsigned long work = 0;
+
+  for(int i = 0; i < rounds; i++) {
+    proto_barrier_token_t token;
+
+    __sync_fetch_and_add(&arrived, 1);
+
+    int ret = proto_barrier_arrive(&splitbarrier, &token);
+    if(ret == PTHREAD_BARRIER_SERIAL_THREAD) {
+      __sync_fetch_and_add(&serials, 1);
+    }
+    else if(ret != 0) {
+      __sync_fetch_and_add(&errors, 1);
+    }
+
+    // Independent work, overlapped with the arrivals of others.
+    for(int j = 0; j < 1000; j++) {
+      work += j;
+    }
+
+    proto_barrier_wait(&splitbarrier, token);
+
+    // Others may have arrived for the next phase already.
+    if(arrived < (unsigned long)threads * (i + 1)) {
+      __sync_fetch_and_add(&errors, 1);
+    }
+  }
+
+  __sync_fetch_and_add(&finished, 1);
+  proto_latch_count_down(&latch, 1);
+  return NULL;
+}
+
+int main(int argc, char * argv[]) {
+  pthread_t * tids;
+  double start, elapsed;
+
+  if(argc > 1) {
+    threads = atoi(argv[1]);
+  }
+  if(argc > 2) {
+    rounds = atoi(argv[2]);
+  }
+
+  tids = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+
+  pthread_barrier_init(&barrier, NULL, threads);
+
+  start = now();
+  for(int i = 0; i < threads; i++) {
+    pthread_create(&tids[i], NULL, worker, NULL);
+  }
+  for(int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  elapsed = now() - start;
+
+  pthread_barrier_destroy(&barrier);
+
+  fprintf(stderr, "%d threads, %d rounds in %.3f seconds, %.1f us per barrier\n",
+          threads, rounds, elapsed, elapsed * 1000000.0 / (rounds * 2));
+
+  // One serial thread at the first barrier of every round.
+  if(errors != 0 || serials != (unsigned long)rounds) {
+    fprintf(stderr, "serial threads %lu, errors %lu\n", serials, errors);
+    return 1;
+  }
+
+  arrived = 0;
+  serials = 0;
+  proto_barrier_init(&splitbarrier, threads);
+  proto_latch_init(&latch, threads);
+
+  start = now();
+  for(int i = 0; i < threads; i++) {
+    pthread_create(&tids[i], NULL, splitWorker, NULL);
+  }
+
+  // Everybody has finished once the latch is open.
+  proto_latch_wait(&latch);
+  if(finished != (unsigned long)threads || proto_latch_try_wait(&latch) != 0) {
+    errors++;
+  }
+
+  for(int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  elapsed = now() - start;
+
+  proto_latch_destroy(&latch);
+  proto_barrier_destroy(&splitbarrier);
+
+  if(proto_latch_init(&latch, 0) != 0 || proto_latch_try_wait(&latch) != 0 
+     || proto_latch_wait(&latch) != 0) {
+    fprintf(stderr, "a latch of count 0 is not open\n");
+    errors++;
+  }
+  proto_latch_count_down(&latch, 2);
+  if(proto_latch_try_wait(&latch) != 0) {
+    fprintf(stderr, "a latch is closed after counting down past zero\n");
+    errors++;
+  }
+  proto_latch_destroy(&latch);
+  free(tids);
+
+  fprintf(stderr, "split-phase: %d threads, %d rounds in %.3f seconds, %.1f us per phase\n",
+          threads, rounds, elapsed, elapsed * 1000000.0 / rounds);
+
+  if(errors != 0 || serials != (unsigned long)rounds) {
+    fprintf(stderr, "serial threads %lu, errors %lu\n", serials, errors);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Benchmark: a work queue with many consumers on one condition variable.
+// The producer adds a batch of items and broadcasts. All consumers wake
+// up, but only one of them can hold the mutex at a time. With wait
+// morphing, woken consumers are moved onto the mutex's waitlist and run one
+// after another, instead of all becoming runnable just to block on the mutex.
+// Run it with the runtime, e.g. "make test".
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum { CONSUMERS = 64 };
+enum { BATCHES = 20000 };
+enum { BATCH = 16 };
+enum { WORK = 500 };
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static volatile unsigned long pending;
+static volatile unsigned long consumed;
+static volatile bool done;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void * consumer(void * arg) {
+  volatile unsigned long local = 0;
+
+  while(true) {
+    pthread_mutex_lock(&mutex);
+    while(pending == 0 && !done) {
+      pthread_cond_wait(&cond, &mutex);
+    }
+
+    if(pending == 0) {
+      pthread_mutex_unlock(&mutex);
+      break;
+    }
+
+    pending--;
+    consumed++;
+    pthread_mutex_unlock(&mutex);
+
+    for(int j = 0; j < WORK; j++) {
+      local++;
+    }
+  }
+
+  return NULL;
+}
+
+int main(int argc, char * argv[]) {
+  int consumers = (argc > 1) ? atoi(argv[1]) : CONSUMERS;
+  pthread_t * tids = (pthread_t *)malloc(sizeof(pthread_t) * consumers);
+  double start = now();
+  double elapsed;
+
+  for(int i = 0; i < consumers; i++) {
+    pthread_create(&tids[i], NULL, consumer, NULL);
+  }
+
+  for(int i = 0; i < BATCHES; i++) {
+    pthread_mutex_lock(&mutex);
+    pending += BATCH;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  pthread_mutex_lock(&mutex);
+  done = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  for(int i = 0; i < consumers; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  elapsed = now() - start;
+
+  if(consumed != (unsigned long)BATCHES * BATCH) {
+    fprintf(stderr, "wrong count %lu, expected %lu\n", consumed, (unsigned long)BATCHES * BATCH);
+    return 1;
+  }
+
+  fprintf(stderr, "%d consumers: %.0f items per second (%.3f s)\n",
+          consumers, consumed / elapsed, elapsed);
+  return 0;
+}
@@ -0,0 +1,103 @@
+// Microbenchmark: throughput of creating and joining threads.
+// Every round spawns a batch of threads, runs each of them once and joins
+// them all, like thread-per-task code does. We compare the old way of
+// getting a thread (a control block and a zeroed 1MB stack from the internal
+// heap, both freed on join) against the thread pool in xthreadpool.h.
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "realfuncs.h"
+#include "xthreadpool.h"
+
+enum { ROUNDS = 5000 };
+enum { BATCH = 16 };
+
+static xcontext mainctx;
+static xthread * running;
+static unsigned long finished;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Entry of all threads, like xthread::threadRun.
+static void threadRun(void * func, void * arg) {
+  finished++;
+  running->ctx.switchTo(&mainctx);
+}
+
+static void runThread(xthread * thread) {
+  running = thread;
+  mainctx.switchTo(&thread->ctx);
+}
+
+/* What xrun::spawn and xthread::freeThread did before. */
+static xthread * allocOld(int tid) {
+  xthread * thread = new (MALLOC_SHARED(sizeof(xthread))) xthread(tid);
+  void * stack = MALLOC_SHARED(xdefines::STACK_SIZE);
+
+  memset(stack, 0, xdefines::STACK_SIZE);
+  thread->ctx.setStack(stack, xdefines::STACK_SIZE);
+  return thread;
+}
+
+static void freeOld(xthread * thread) {
+  FREE_SHARED(thread->ctx.stack);
+  FREE_SHARED(thread);
+}
+
+static double bench(bool pooled) {
+  xthreadpool & pool = xthreadpool::getInstance();
+  xthread * threads[BATCH];
+  double start = now();
+
+  for(int i = 0; i < ROUNDS; i++) {
+    for(int j = 0; j < BATCH; j++) {
+      threads[j] = pooled ? pool.alloc(0, j, xdefines::STACK_SIZE) : allocOld(j);
+      threads[j]->ctx.makeContext((void *)&threadRun, NULL, NULL);
+    }
+
+    for(int j = 0; j < BATCH; j++) {
+      runThread(threads[j]);
+    }
+
+    for(int j = 0; j < BATCH; j++) {
+      if(pooled) {
+        pool.free(0, threads[j]);
+      }
+      else {
+        freeOld(threads[j]);
+      }
+    }
+  }
+
+  return now() - start;
+}
+
+static void report(const char * name, double elapsed) {
+  fprintf(stderr, "%-24s %10.0f create/join per second\n", name, ROUNDS * BATCH / elapsed);
+}
+
+int main(int argc, char * argv[]) {
+  init_real_functions();
+  xstacks::getInstance().initialize();
+  xthreadpool::getInstance().initialize();
+
+  double before = bench(false);
+  double after = bench(true);
+
+  if(finished != 2UL * ROUNDS * BATCH) {
+    fprintf(stderr, "only %lu threads have run\n", finished);
+    return 1;
+  }
+
+  report("zeroed stacks", before);
+  report("thread pool", after);
+  fprintf(stderr, "speedup: %.2fx\n", before / after);
+  return 0;
+}
@@ -0,0 +1,102 @@
+// Microbenchmark: latency of a user-level context switch.
+// Two contexts keep switching to each other, which is what a yield does:
+// user thread -> scheduler -> user thread.
+// We compare swapcontext (the old THREAD_SWITCH) against the routines
+// in xcontext.cpp, with and without switching the signal mask.
+
+#include <sys/time.h>
+#include <ucontext.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// xthread.h pulls in xcontext.h with the types it needs.
+#include "xthread.h"
+
+enum { ROUNDS = 1000000 };
+enum { BENCH_STACK_SIZE = 65536 };
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void report(const char * name, double elapsed) {
+  // Each round has two switches.
+  fprintf(stderr, "%-28s %8.1f ns/switch\n", name, elapsed * 1e9 / (ROUNDS * 2));
+}
+
+/* swapcontext */
+static ucontext_t umain, upeer;
+
+static void upeerRun(void) {
+  for(;;) {
+    swapcontext(&upeer, &umain);
+  }
+}
+
+static double benchUcontext(void) {
+  char * stack = (char *)malloc(BENCH_STACK_SIZE);
+
+  getcontext(&upeer);
+  upeer.uc_link = 0;
+  upeer.uc_stack.ss_sp = stack;
+  upeer.uc_stack.ss_size = BENCH_STACK_SIZE;
+  upeer.uc_stack.ss_flags = 0;
+  makecontext(&upeer, upeerRun, 0);
+
+  double start = now();
+  for(int i = 0; i < ROUNDS; i++) {
+    swapcontext(&umain, &upeer);
+  }
+  return now() - start;
+}
+
+/* proto_context_switch */
+static void * mainsp, * peersp;
+static sigset_t mainmask, peermask;
+static bool withmask;
+
+static void peerRun(void * arg1, void * arg2) {
+  if(arg1 != (void *)1 || arg2 != (void *)2) {
+    fprintf(stderr, "wrong arguments %p %p\n", arg1, arg2);
+    abort();
+  }
+
+  for(;;) {
+    if(withmask) {
+      sigprocmask(SIG_SETMASK, &mainmask, &peermask);
+    }
+    proto_context_switch(&peersp, mainsp);
+  }
+}
+
+static double benchFast(bool sigmask) {
+  char * stack = (char *)malloc(BENCH_STACK_SIZE);
+
+  withmask = sigmask;
+  sigprocmask(SIG_SETMASK, NULL, &peermask);
+  peersp = xcontext::makeFrame(stack + BENCH_STACK_SIZE, (void *)&peerRun, (void *)1, (void *)2);
+
+  double start = now();
+  for(int i = 0; i < ROUNDS; i++) {
+    if(withmask) {
+      sigprocmask(SIG_SETMASK, &peermask, &mainmask);
+    }
+    proto_context_switch(&mainsp, peersp);
+  }
+  return now() - start;
+}
+
+int main(int argc, char * argv[]) {
+  double before = benchUcontext();
+  double aftermask = benchFast(true);
+  double after = benchFast(false);
+
+  report("swapcontext", before);
+  report("xcontext with sigmask", aftermask);
+  report("xcontext", after);
+  fprintf(stderr, "speedup: %.2fx\n", before / after);
+  return 0;
+}
@@ -0,0 +1,188 @@
+// Test: a thread-per-connection echo server on the loopback interface.
+// Every connection has one server thread and one client thread, which
+// block in accept, connect, read and write all the time. Blocked threads
+// are parked on the pollers of the runtime, so a few processes can serve
+// many more connections than cores. Every echoed message is checked.
+// At the end, every client makes its socket nonblocking itself, and a read
+// must fail with EAGAIN instead of parking, like in an event loop. The
+// runtime keeps sockets nonblocking, but the user must see its own mode.
+// Run it with the runtime, e.g. "make test".
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum { CONNECTIONS = 256 };
+enum { MESSAGES = 1000 };
+enum { MESSAGE_SIZE = 64 };
+enum { STACK_SIZE = 65536 };
+
+static int listenfd;
+static struct sockaddr_in server;
+static pthread_attr_t attr;
+
+static volatile unsigned long echoed;
+static volatile unsigned long errors;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Read or write the whole buffer.
+static bool transfer(int fd, char * buf, size_t size, bool reading) {
+  size_t done = 0;
+
+  while(done < size) {
+    ssize_t ret = reading ? read(fd, buf + done, size - done) : write(fd, buf + done, size - done);
+
+    if(ret <= 0) {
+      return false;
+    }
+    done += ret;
+  }
+
+  return true;
+}
+
+static void * serve(void * arg) {
+  int fd = (int)(long)arg;
+  char buf[MESSAGE_SIZE];
+
+  while(transfer(fd, buf, sizeof(buf), true)) {
+    if(!transfer(fd, buf, sizeof(buf), false)) {
+      break;
+    }
+  }
+
+  close(fd);
+  return NULL;
+}
+
+static void * acceptor(void * arg) {
+  for(int i = 0; i < CONNECTIONS; i++) {
+    int fd = accept(listenfd, NULL, NULL);
+    pthread_t tid;
+
+    if(fd < 0) {
+      __sync_fetch_and_add(&errors, 1);
+      continue;
+    }
+
+    pthread_create(&tid, &attr, serve, (void *)(long)fd);
+  }
+
+  return NULL;
+}
+
+// The mode set by the user, by fcntl or by ioctl(FIONBIO).
+static bool checkNonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  int off = 0;
+  char c;
+
+  if(flags < 0 || (flags & O_NONBLOCK) || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+    return false;
+  }
+
+  if(!(fcntl(fd, F_GETFL) & O_NONBLOCK) || read(fd, &c, 1) != -1 || errno != EAGAIN) {
+    return false;
+  }
+
+  return ioctl(fd, FIONBIO, &off) == 0 && !(fcntl(fd, F_GETFL) & O_NONBLOCK);
+}
+
+static void * client(void * arg) {
+  long id = (long)arg;
+  char out[MESSAGE_SIZE];
+  char in[MESSAGE_SIZE];
+  int one = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if(fd < 0 || connect(fd, (struct sockaddr *)&server, sizeof(server)) != 0) {
+    __sync_fetch_and_add(&errors, 1);
+    return NULL;
+  }
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  for(int i = 0; i < MESSAGES; i++) {
+    snprintf(out, sizeof(out), "client %ld message %d", id, i);
+
+    if(!transfer(fd, out, sizeof(out), false) || !transfer(fd, in, sizeof(in), true)
+       || memcmp(in, out, sizeof(out)) != 0) {
+      __sync_fetch_and_add(&errors, 1);
+      break;
+    }
+
+    __sync_fetch_and_add(&echoed, 1);
+  }
+
+  // Nothing is left to read, so a nonblocking read can't wait.
+  if(!checkNonblocking(fd)) {
+    __sync_fetch_and_add(&errors, 1);
+  }
+
+  close(fd);
+  return NULL;
+}
+
+int main(int argc, char * argv[]) {
+  int connections = CONNECTIONS;
+  socklen_t len = sizeof(server);
+  pthread_t * clients = (pthread_t *)malloc(sizeof(pthread_t) * connections);
+  pthread_t accepting;
+  double start, elapsed;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, STACK_SIZE);
+
+  // Any free port on the loopback interface.
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.sin_port = 0;
+
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  if(listenfd < 0 || bind(listenfd, (struct sockaddr *)&server, sizeof(server)) != 0
+     || listen(listenfd, connections) != 0 || getsockname(listenfd, (struct sockaddr *)&server, &len) != 0) {
+    perror("can't listen on the loopback interface");
+    return 1;
+  }
+
+  start = now();
+
+  pthread_create(&accepting, &attr, acceptor, NULL);
+  for(long i = 0; i < connections; i++) {
+    pthread_create(&clients[i], &attr, client, (void *)i);
+  }
+
+  for(int i = 0; i < connections; i++) {
+    pthread_join(clients[i], NULL);
+  }
+  pthread_join(accepting, NULL);
+
+  elapsed = now() - start;
+  close(listenfd);
+
+  if(errors != 0 || echoed != (unsigned long)connections * MESSAGES) {
+    fprintf(stderr, "%lu errors, %lu of %lu messages echoed\n",
+            errors, echoed, (unsigned long)connections * MESSAGES);
+    return 1;
+  }
+
+  fprintf(stderr, "%d connections: %.0f round trips per second (%.3f s)\n",
+          connections, echoed / elapsed, elapsed);
+  return 0;
+}
@@ -0,0 +1,130 @@
+// Test: many threads reading and writing one file with pread and pwrite,
+// and reading it again at the current position with read. With PROTO_AIO
+// set, the calls are submitted to io_uring or helper processes and the
+// threads are parked meanwhile, see xaio.h. Every block is checked.
+// Run it with the runtime, e.g. "make test".
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum { THREADS = 32 };
+enum { ROUNDS = 400 };
+enum { BLOCK = 4096 };
+enum { BLOCKS = 1024 };
+
+static char path[64];
+static char wpath[64];
+static int rfd, wfd;
+static volatile unsigned long errors;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static char pattern(long block, int offset) {
+  return (char)(block * 7 + offset / 512);
+}
+
+static void * worker(void * arg) {
+  long id = (long)arg;
+  unsigned int seed = id + 1;
+  char * buf = (char *)malloc(BLOCK);
+  long total = 0, ret;
+  int fd;
+
+  for(int i = 0; i < ROUNDS; i++) {
+    long block = rand_r(&seed) % BLOCKS;
+
+    if(pread(rfd, buf, BLOCK, block * BLOCK) != BLOCK) {
+      __sync_fetch_and_add(&errors, 1);
+      continue;
+    }
+    for(int j = 0; j < BLOCK; j += 512) {
+      if(buf[j] != pattern(block, j)) {
+        __sync_fetch_and_add(&errors, 1);
+        break;
+      }
+    }
+
+    // Every thread owns one block of the other file.
+    memset(buf, (char)(id + i), BLOCK);
+    if(pwrite(wfd, buf, BLOCK, id * BLOCK) != BLOCK) {
+      __sync_fetch_and_add(&errors, 1);
+    }
+  }
+
+  // Read the whole file at the current position of a private fd.
+  fd = open(path, O_RDONLY);
+  while((ret = read(fd, buf, BLOCK)) > 0) {
+    total += ret;
+  }
+  if(total != (long)BLOCK * BLOCKS) {
+    __sync_fetch_and_add(&errors, 1);
+  }
+  close(fd);
+
+  free(buf);
+  return NULL;
+}
+
+int main(int argc, char * argv[]) {
+  pthread_t threads[THREADS];
+  char * buf = (char *)malloc(BLOCK);
+  double start, elapsed;
+
+  snprintf(path, sizeof(path), "/tmp/filebench.r.%d", getpid());
+  snprintf(wpath, sizeof(wpath), "/tmp/filebench.w.%d", getpid());
+  rfd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  wfd = open(wpath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if(rfd < 0 || wfd < 0) {
+    perror("open");
+    return 1;
+  }
+
+  for(long i = 0; i < BLOCKS; i++) {
+    for(int j = 0; j < BLOCK; j++) {
+      buf[j] = pattern(i, j);
+    }
+    if(write(rfd, buf, BLOCK) != BLOCK) {
+      perror("write");
+      return 1;
+    }
+  }
+
+  start = now();
+  for(long i = 0; i < THREADS; i++) {
+    pthread_create(&threads[i], NULL, worker, (void *)i);
+  }
+  for(int i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  elapsed = now() - start;
+
+  for(long i = 0; i < THREADS; i++) {
+    if(pread(wfd, buf, BLOCK, i * BLOCK) != BLOCK || buf[0] != (char)(i + ROUNDS - 1)) {
+      errors++;
+    }
+  }
+
+  close(rfd);
+  close(wfd);
+  unlink(path);
+  unlink(wpath);
+  free(buf);
+
+  fprintf(stderr, "%d file calls in %.3f seconds, %.1f us per call\n",
+          THREADS * ROUNDS * 2, elapsed, elapsed * 1000000.0 / (THREADS * ROUNDS * 2));
+
+  if(errors != 0) {
+    fprintf(stderr, "errors %lu\n", errors);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,146 @@
+// Test: synchronization through the raw futex syscall, like libstdc++ and
+// OpenMP runtimes do it. Threads take a futex-based lock (Drepper's mutex
+// with three states) many times, and the protected counter must be exact.
+// Then all threads call pthread_once, whose slow routine must run once while
+// the others wait for it, and a FUTEX_WAIT_BITSET with an absolute deadline
+// must time out. See xfutex.h.
+// Usage: runner [threads] [iterations]
+
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static int threads = 128;
+static int iterations = 10000;
+
+// 0 is unlocked, 1 is locked, 2 is locked with waiters.
+static volatile int word;
+static unsigned long counter;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static volatile unsigned long onceruns;
+static volatile int ready;
+static volatile unsigned long errors;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static long futex(volatile int * addr, int op, int val, const struct timespec * timeout, int val3) {
+  return syscall(SYS_futex, addr, op, val, timeout, NULL, val3);
+}
+
+static void lock(void) {
+  int c = __sync_val_compare_and_swap(&word, 0, 1);
+
+  if(c == 0) {
+    return;
+  }
+
+  if(c != 2) {
+    c = __sync_lock_test_and_set(&word, 2);
+  }
+
+  while(c != 0) {
+    futex(&word, FUTEX_WAIT_PRIVATE, 2, NULL, 0);
+    c = __sync_lock_test_and_set(&word, 2);
+  }
+}
+
+static void unlock(void) {
+  if(__sync_fetch_and_sub(&word, 1) != 1) {
+    word = 0;
+    futex(&word, FUTEX_WAKE_PRIVATE, 1, NULL, 0);
+  }
+}
+
+static void initOnce(void) {
+  __sync_fetch_and_add(&onceruns, 1);
+
+  // Long enough for everybody else to wait.
+  usleep(100000);
+  ready = 1;
+}
+
+static void * worker(void * arg) {
+  for(int i = 0; i < iterations; i++) {
+    lock();
+    counter++;
+    unlock();
+  }
+
+  pthread_once(&once, initOnce);
+  if(!ready) {
+    __sync_fetch_and_add(&errors, 1);
+  }
+  return NULL;
+}
+
+int main(int argc, char * argv[]) {
+  pthread_t * tids;
+  double start, elapsed;
+  struct timespec deadline;
+  volatile int idle = 0;
+
+  if(argc > 1) {
+    threads = atoi(argv[1]);
+  }
+  if(argc > 2) {
+    iterations = atoi(argv[2]);
+  }
+
+  tids = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+
+  start = now();
+  for(int i = 0; i < threads; i++) {
+    pthread_create(&tids[i], NULL, worker, NULL);
+  }
+  for(int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  elapsed = now() - start;
+
+  fprintf(stderr, "%d threads, %d iterations in %.3f seconds\n", threads, iterations, elapsed);
+
+  if(counter != (unsigned long)threads * iterations || onceruns != 1) {
+    fprintf(stderr, "counter %lu, expected %lu, once routine runs %lu\n",
+            counter, (unsigned long)threads * iterations, onceruns);
+    errors++;
+  }
+
+  // Nobody wakes us up, so we must come back with ETIMEDOUT after 100ms.
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_nsec += 100000000;
+  if(deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  start = now();
+  if(futex(&idle, FUTEX_WAIT_BITSET_PRIVATE, 0, &deadline, FUTEX_BITSET_MATCH_ANY) != -1
+     || errno != ETIMEDOUT) {
+    fprintf(stderr, "FUTEX_WAIT_BITSET didn't time out\n");
+    errors++;
+  }
+  elapsed = now() - start;
+  if(elapsed < 0.09) {
+    fprintf(stderr, "FUTEX_WAIT_BITSET returned after %.3f seconds\n", elapsed);
+    errors++;
+  }
+
+  free(tids);
+
+  if(errors != 0) {
+    fprintf(stderr, "errors %lu\n", errors);
+    return 1;
+  }
+  return 0;
+}
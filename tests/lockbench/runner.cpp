@@ -0,0 +1,153 @@
+// Microbenchmark: the internal spinlocks under contention.
+// Every process keeps taking the lock, touching a bit of shared data in the
+// critical section like a queue operation does, and doing a little private
+// work outside. We report the total throughput, and the ratio between the
+// slowest and the fastest process to show how fair a lock is.
+// The critical sections also check that the locks really exclude each other.
+
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spinlock.h"
+
+enum { MAX_PROCS = 64 };
+enum { RUN_MSECS = 300 };
+
+struct shared {
+  volatile unsigned long start;
+  volatile unsigned long stop;
+  unsigned long ops[MAX_PROCS * 16];
+
+  // Protected by the lock under test.
+  volatile unsigned long counter;
+  volatile unsigned long data[16];
+
+  spinlock   tas;
+  ttaslock   ttas;
+  ticketlock ticket;
+  mcslock    mcs;
+
+  // Every process has its own node, on a separate cache line.
+  mcsnode    nodes[MAX_PROCS * 8];
+};
+
+static shared * sh;
+
+// A uniform interface for all locks.
+template <class LOCK> class locker {
+public:
+  locker(LOCK * l, int id) : lock(l) { }
+  void acquire(void) { lock->acquire(); }
+  void release(void) { lock->release(); }
+private:
+  LOCK * lock;
+};
+
+template <> class locker<mcslock> {
+public:
+  locker(mcslock * l, int id) : lock(l), node(&sh->nodes[id * 8]) { }
+  void acquire(void) { lock->acquire(node); }
+  void release(void) { lock->release(node); }
+private:
+  mcslock * lock;
+  mcsnode * node;
+};
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+template <class LOCK> static void contend(LOCK * lock, int id) {
+  locker<LOCK> l(lock, id);
+  unsigned long ops = 0;
+
+  while(!sh->start) ;
+  while(!sh->stop) {
+    l.acquire();
+    unsigned long value = sh->counter;
+    for(int i = 0; i < 16; i++) {
+      sh->data[i] += value;
+    }
+    sh->counter = value + 1;
+    l.release();
+
+    for(volatile int i = 0; i < 100; i++) ;
+    ops++;
+  }
+  sh->ops[id * 16] = ops;
+}
+
+template <class LOCK> static bool run(const char * name, LOCK * lock, int nprocs) {
+  pid_t pids[MAX_PROCS];
+  unsigned long total = 0, least = ~0UL, most = 0;
+
+  sh->start = 0;
+  sh->stop = 0;
+  sh->counter = 0;
+
+  for(int i = 0; i < nprocs; i++) {
+    pids[i] = fork();
+    if(pids[i] == 0) {
+      contend(lock, i);
+      _exit(0);
+    }
+  }
+
+  double start = now();
+  sh->start = 1;
+  usleep(RUN_MSECS * 1000);
+  sh->stop = 1;
+
+  for(int i = 0; i < nprocs; i++) {
+    unsigned long ops;
+
+    waitpid(pids[i], NULL, 0);
+    ops = sh->ops[i * 16];
+    total += ops;
+    if(ops < least) least = ops;
+    if(ops > most) most = ops;
+  }
+  double elapsed = now() - start;
+
+  printf("%-8s procs %2d: %12.0f locks/s, fairness %.2f\n", name, nprocs,
+         total / elapsed, most ? (double)least / most : 0.0);
+
+  if(sh->counter != total) {
+    fprintf(stderr, "%s is broken: %lu locks but the counter is %lu\n", name, total, sh->counter);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char ** argv) {
+  int maxprocs = (argc > 1) ? atoi(argv[1]) : MAX_PROCS;
+  bool ok = true;
+
+  if(maxprocs < 2 || maxprocs > MAX_PROCS) {
+    fprintf(stderr, "usage: %s [max procs, 2 ~ %d]\n", argv[0], MAX_PROCS);
+    return 1;
+  }
+
+  sh = (shared *)mmap(NULL, sizeof(shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(sh == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  memset(sh, 0, sizeof(shared));
+
+  for(int nprocs = 2; nprocs <= maxprocs; nprocs *= 2) {
+    ok &= run("tas", &sh->tas, nprocs);
+    ok &= run("ttas", &sh->ttas, nprocs);
+    ok &= run("ticket", &sh->ticket, nprocs);
+    ok &= run("mcs", &sh->mcs, nprocs);
+  }
+
+  return ok ? 0 : 1;
+}
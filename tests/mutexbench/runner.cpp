@@ -0,0 +1,68 @@
+// Benchmark: a contended mutex with more threads than cores.
+// Every thread keeps taking the same mutex, updating a shared counter and 
+// doing a little work outside of the critical section. There are several 
+// threads per core, so the owner is often queued behind threads waiting for
+// it. A waiter which only spins can starve the owner of its core.
+// Run it with the runtime, e.g. "make test".
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum { THREADS_PER_CORE = 4 };
+enum { ITERATIONS = 20000 };
+enum { WORK = 200 };
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile unsigned long counter;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void * worker(void * arg) {
+  volatile unsigned long local = 0;
+
+  for(int i = 0; i < ITERATIONS; i++) {
+    pthread_mutex_lock(&mutex);
+    counter++;
+    pthread_mutex_unlock(&mutex);
+
+    for(int j = 0; j < WORK; j++) {
+      local++;
+    }
+  }
+
+  return NULL;
+}
+
+int main(int argc, char * argv[]) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = (argc > 1) ? atoi(argv[1]) : (int)(cores * THREADS_PER_CORE);
+  pthread_t * tids = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+  double start = now();
+  double elapsed;
+
+  for(int i = 0; i < threads; i++) {
+    pthread_create(&tids[i], NULL, worker, NULL);
+  }
+
+  for(int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  elapsed = now() - start;
+
+  if(counter != (unsigned long)threads * ITERATIONS) {
+    fprintf(stderr, "wrong counter %lu, expected %lu\n", counter, (unsigned long)threads * ITERATIONS);
+    return 1;
+  }
+
+  fprintf(stderr, "%d threads: %.0f lock/unlock per second (%.3f s)\n", 
+          threads, counter / elapsed, elapsed);
+  return 0;
+}
@@ -0,0 +1,131 @@
+// Benchmark: a read-mostly table behind a reader-writer lock.
+// Every thread looks up the table most of the time and updates it once in
+// a while. We compare pthread_rwlock_t against a plain mutex around the same
+// table. With per-core reader indicators, readers on different cores don't
+// touch a common cache line, so the rwlock should scale with the cores.
+// Writers keep two copies equal, and readers check that they never see
+// a half-done update.
+// Run it with the runtime, e.g. "make test".
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum { THREADS_PER_CORE = 2 };
+enum { ITERATIONS = 200000 };
+enum { WRITE_EVERY = 100 };
+enum { ENTRIES = 64 };
+
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile unsigned long table[ENTRIES];
+static volatile unsigned long copy[ENTRIES];
+static volatile unsigned long torn;
+static bool useMutex;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void readLock(void) {
+  if(useMutex) {
+    pthread_mutex_lock(&mutex);
+  }
+  else {
+    pthread_rwlock_rdlock(&rwlock);
+  }
+}
+
+static void writeLock(void) {
+  if(useMutex) {
+    pthread_mutex_lock(&mutex);
+  }
+  else {
+    pthread_rwlock_wrlock(&rwlock);
+  }
+}
+
+static void unlockTable(void) {
+  if(useMutex) {
+    pthread_mutex_unlock(&mutex);
+  }
+  else {
+    pthread_rwlock_unlock(&rwlock);
+  }
+}
+
+static void * worker(void * arg) {
+  unsigned int seed = (unsigned long)arg + 1;
+
+  for(int i = 0; i < ITERATIONS; i++) {
+    int entry;
+
+    seed = seed * 1103515245 + 12345;
+    entry = (seed >> 16) % ENTRIES;
+
+    if(i % WRITE_EVERY == 0) {
+      writeLock();
+      table[entry]++;
+      copy[entry]++;
+      unlockTable();
+    }
+    else {
+      readLock();
+      if(table[entry] != copy[entry]) {
+        torn++;
+      }
+      unlockTable();
+    }
+  }
+
+  return NULL;
+}
+
+static double run(int threads) {
+  pthread_t * tids = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+  double start = now();
+
+  for(int i = 0; i < threads; i++) {
+    pthread_create(&tids[i], NULL, worker, (void *)(unsigned long)i);
+  }
+
+  for(int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  free(tids);
+  return now() - start;
+}
+
+int main(int argc, char * argv[]) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = (argc > 1) ? atoi(argv[1]) : (int)(cores * THREADS_PER_CORE);
+  double ops = (double)threads * ITERATIONS;
+  unsigned long writes = 0;
+
+  useMutex = true;
+  double before = run(threads);
+
+  useMutex = false;
+  double after = run(threads);
+
+  for(int i = 0; i < ENTRIES; i++) {
+    writes += table[i];
+  }
+
+  if(torn != 0 || writes != 2UL * threads * (ITERATIONS / WRITE_EVERY)) {
+    fprintf(stderr, "broken: %lu torn reads, %lu writes\n", torn, writes);
+    return 1;
+  }
+
+  fprintf(stderr, "%d threads, %d%% writes\n", threads, 100 / WRITE_EVERY);
+  fprintf(stderr, "mutex:  %12.0f ops per second\n", ops / before);
+  fprintf(stderr, "rwlock: %12.0f ops per second\n", ops / after);
+  fprintf(stderr, "speedup: %.2fx\n", before / after);
+  return 0;
+}
@@ -0,0 +1,148 @@
+// Test: a bounded buffer between producers and consumers, guarded by two
+// counting semaphores for the free and filled slots, like the work queues
+// of a pipeline. Every item is consumed exactly once, which is checked with
+// the sum of all items, and both semaphores are back to their initial
+// values at the end. Then sem_timedwait on an empty semaphore must time out
+// after roughly its deadline. See xsem.h.
+// Usage: runner [threads] [items]
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define SLOTS 64
+
+static int threads = 128;
+static long items = 10000;
+
+static sem_t empty;
+static sem_t full;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static long ring[SLOTS];
+static unsigned long head;
+static unsigned long tail;
+static volatile unsigned long sum;
+static volatile unsigned long errors;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void * producer(void * arg) {
+  long id = (long)arg;
+
+  for(long i = 0; i < items; i++) {
+    if(sem_wait(&empty) != 0) {
+      __sync_fetch_and_add(&errors, 1);
+    }
+
+    pthread_mutex_lock(&mutex);
+    ring[tail++ % SLOTS] = id * items + i;
+    pthread_mutex_unlock(&mutex);
+
+    sem_post(&full);
+  }
+  return NULL;
+}
+
+static void * consumer(void * arg) {
+  for(long i = 0; i < items; i++) {
+    long item;
+
+    if(sem_wait(&full) != 0) {
+      __sync_fetch_and_add(&errors, 1);
+    }
+
+    pthread_mutex_lock(&mutex);
+    item = ring[head++ % SLOTS];
+    pthread_mutex_unlock(&mutex);
+
+    sem_post(&empty);
+    __sync_fetch_and_add(&sum, item);
+  }
+  return NULL;
+}
+
+int main(int argc, char * argv[]) {
+  pthread_t * tids;
+  double start, elapsed;
+  struct timespec deadline;
+  int value;
+
+  if(argc > 1) {
+    threads = atoi(argv[1]);
+  }
+  if(argc > 2) {
+    items = atol(argv[2]);
+  }
+
+  // Half of the threads produce, the other half consume.
+  threads &= ~1;
+  tids = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+
+  sem_init(&empty, 0, SLOTS);
+  sem_init(&full, 0, 0);
+
+  start = now();
+  for(int i = 0; i < threads; i += 2) {
+    pthread_create(&tids[i], NULL, producer, (void *)(long)(i / 2));
+    pthread_create(&tids[i + 1], NULL, consumer, NULL);
+  }
+  for(int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  elapsed = now() - start;
+
+  unsigned long total = (unsigned long)(threads / 2) * items;
+  fprintf(stderr, "%d threads, %lu items in %.3f seconds, %.2f us per item\n",
+          threads, total, elapsed, elapsed * 1000000.0 / total);
+
+  if(sum != total * (total - 1) / 2) {
+    fprintf(stderr, "sum %lu, expected %lu\n", sum, total * (total - 1) / 2);
+    errors++;
+  }
+
+  sem_getvalue(&empty, &value);
+  if(value != SLOTS) {
+    errors++;
+  }
+  sem_getvalue(&full, &value);
+  if(value != 0) {
+    errors++;
+  }
+
+  // Nobody posts, so we must come back with ETIMEDOUT after 100ms.
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += 100000000;
+  if(deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  start = now();
+  if(sem_timedwait(&full, &deadline) != -1 || errno != ETIMEDOUT) {
+    fprintf(stderr, "sem_timedwait didn't time out\n");
+    errors++;
+  }
+  elapsed = now() - start;
+  if(elapsed < 0.09) {
+    fprintf(stderr, "sem_timedwait returned after %.3f seconds\n", elapsed);
+    errors++;
+  }
+
+  sem_destroy(&full);
+  sem_destroy(&empty);
+  free(tids);
+
+  if(errors != 0) {
+    fprintf(stderr, "errors %lu\n", errors);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+// Test: a thread blocked in the kernel while another thread of the same core
+// is waiting to unblock it. With one core, the reader opens a FIFO, which
+// blocks the process until the writer opens the other end. The writer can only
+// run when a spare process adopts the core, see the syscall handoff in
+// xscheduler.cpp. With PROTO_SPARES=0 it hangs. Every message is checked.
+// Run it with the runtime on one core, e.g. "make test".
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum { ROUNDS = 1000 };
+
+static char path[64];
+static volatile unsigned long passed;
+static volatile unsigned long errors;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void * reader(void * arg) {
+  long round = (long)arg;
+  long value = -1;
+  int fd = open(path, O_RDONLY);
+
+  if(fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value) || value != round) {
+    __sync_fetch_and_add(&errors, 1);
+  }
+  else {
+    __sync_fetch_and_add(&passed, 1);
+  }
+
+  if(fd >= 0) {
+    close(fd);
+  }
+  return NULL;
+}
+
+static void * writer(void * arg) {
+  long round = (long)arg;
+  int fd = open(path, O_WRONLY);
+
+  if(fd < 0 || write(fd, &round, sizeof(round)) != sizeof(round)) {
+    __sync_fetch_and_add(&errors, 1);
+  }
+
+  if(fd >= 0) {
+    close(fd);
+  }
+  return NULL;
+}
+
+int main(int argc, char * argv[]) {
+  pthread_t threads[2];
+  double start, elapsed;
+
+  snprintf(path, sizeof(path), "/tmp/syscallbench.%d", getpid());
+  unlink(path);
+  if(mkfifo(path, 0600) != 0) {
+    perror("mkfifo");
+    return 1;
+  }
+
+  start = now();
+  for(long i = 0; i < ROUNDS; i++) {
+    // The reader goes first, so it blocks before the writer can run.
+    pthread_create(&threads[0], NULL, reader, (void *)i);
+    pthread_create(&threads[1], NULL, writer, (void *)i);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+  }
+  elapsed = now() - start;
+
+  unlink(path);
+
+  fprintf(stderr, "%d rounds in %.3f seconds, %.1f us per handoff\n", 
+          ROUNDS, elapsed, elapsed * 1000000.0 / ROUNDS);
+
+  if(errors != 0 || passed != ROUNDS) {
+    fprintf(stderr, "passed %lu, errors %lu\n", passed, errors);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,160 @@
+// Test: timed waits of mutexes and condition variables on the timer wheels.
+// A wait on a held mutex must time out after roughly its deadline, a wait on
+// a condition variable which is signalled in time must be cancelled, and after
+// an idle gap with no timer armed, waits must time out after their deadlines
+// again, neither at once nor late. A free mutex is taken by
+// pthread_mutex_timedlock without looking at the deadline. See xtimerwheel.h.
+// Usage: runner [gap seconds]
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t held = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static volatile int signalled;
+static volatile unsigned long errors;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void after(struct timespec * deadline, long msecs) {
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += msecs / 1000;
+  deadline->tv_nsec += (msecs % 1000) * 1000000;
+  if(deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+// It should come back after msecs, and not much later.
+static void checkElapsed(const char * what, double start, long msecs) {
+  double elapsed = now() - start;
+
+  if(elapsed < msecs / 1000.0 - 0.01 || elapsed > msecs / 1000.0 + 0.5) {
+    fprintf(stderr, "%s returned after %.3f seconds, expected %.3f\n", what, elapsed, msecs / 1000.0);
+    errors++;
+  }
+}
+
+// The main thread holds the mutex.
+static void * mutexWaiter(void * arg) {
+  struct timespec deadline;
+  double start = now();
+
+  after(&deadline, 100);
+  if(pthread_mutex_timedlock(&held, &deadline) != ETIMEDOUT) {
+    fprintf(stderr, "pthread_mutex_timedlock didn't time out\n");
+    errors++;
+  }
+  checkElapsed("pthread_mutex_timedlock", start, 100);
+  return NULL;
+}
+
+static void * signaller(void * arg) {
+  usleep(10000);
+
+  pthread_mutex_lock(&mutex);
+  signalled = 1;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&mutex);
+  return NULL;
+}
+
+static void timeoutMutex(void) {
+  pthread_t tid;
+
+  pthread_mutex_lock(&held);
+  pthread_create(&tid, NULL, mutexWaiter, NULL);
+  pthread_join(tid, NULL);
+  pthread_mutex_unlock(&held);
+}
+
+static void timeoutCond(void) {
+  struct timespec deadline;
+  double start = now();
+  int ret;
+
+  pthread_mutex_lock(&mutex);
+  after(&deadline, 100);
+  do {
+    ret = pthread_cond_timedwait(&cond, &mutex, &deadline);
+  } while(ret == 0);
+  pthread_mutex_unlock(&mutex);
+
+  if(ret != ETIMEDOUT) {
+    fprintf(stderr, "pthread_cond_timedwait returned %d\n", ret);
+    errors++;
+  }
+  checkElapsed("pthread_cond_timedwait", start, 100);
+}
+
+// The timer is removed when the signal comes long before the deadline.
+static void cancelCond(void) {
+  struct timespec deadline;
+  pthread_t tid;
+  double start = now();
+  int ret = 0;
+
+  signalled = 0;
+  pthread_create(&tid, NULL, signaller, NULL);
+
+  pthread_mutex_lock(&mutex);
+  after(&deadline, 5000);
+  while(!signalled && ret == 0) {
+    ret = pthread_cond_timedwait(&cond, &mutex, &deadline);
+  }
+  pthread_mutex_unlock(&mutex);
+  pthread_join(tid, NULL);
+
+  if(ret != 0 || now() - start > 1.0) {
+    fprintf(stderr, "pthread_cond_timedwait wasn't woken up in time, returned %d\n", ret);
+    errors++;
+  }
+}
+
+int main(int argc, char * argv[]) {
+  struct timespec invalid;
+  int gap = 1;
+
+  if(argc > 1) {
+    gap = atoi(argv[1]);
+  }
+
+  // POSIX doesn't check the deadline when the mutex is free.
+  invalid.tv_sec = 0;
+  invalid.tv_nsec = -1;
+  if(pthread_mutex_timedlock(&held, &invalid) != 0) {
+    fprintf(stderr, "pthread_mutex_timedlock failed on a free mutex\n");
+    errors++;
+  }
+  else {
+    pthread_mutex_unlock(&held);
+  }
+
+  timeoutMutex();
+  timeoutCond();
+  cancelCond();
+
+  // No timer is armed on most wheels in the meantime.
+  sleep(gap);
+
+  timeoutMutex();
+  timeoutCond();
+
+  if(errors != 0) {
+    fprintf(stderr, "errors %lu\n", errors);
+    return 1;
+  }
+  fprintf(stderr, "timed waits are fine\n");
+  return 0;
+}
@@ -0,0 +1,152 @@
+// Microbenchmark: the old global run queue (spinlock + list) against
+// per-core work-stealing deques.
+// Every process keeps picking a runnable "thread", doing a little work and
+// putting it back, just like the scheduler loop. All threads start on
+// process 0, so the other processes have to find work through the shared
+// queue or by stealing.
+
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// process.h pulls in xqueue.h and xdeque.h in the right order.
+#include "process.h"
+
+enum { MAX_PROCS = 64 };
+enum { THREADS_PER_PROC = 16 };
+enum { RUN_MSECS = 500 };
+
+struct shared {
+  volatile unsigned long start;
+  volatile unsigned long stop;
+  unsigned long ops[MAX_PROCS * 16];
+  xqueue squeue;
+  xdeque deques[MAX_PROCS];
+};
+
+// xqueue wakes up sleeping schedulers, but there is no scheduler here.
+extern "C" void schedulerWakeup(int coreid) { }
+
+static shared * sh;
+static xthread * threads;
+static int nprocs;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Pretend to run the thread for a short while.
+static void work(void) {
+  for(volatile int i = 0; i < 50; i++) ;
+}
+
+static void runGlobalQueue(int id) {
+  unsigned long ops = 0;
+
+  while(!sh->start) ;
+  while(!sh->stop) {
+    xthread * thread = sh->squeue.dequeue();
+    if(thread) {
+      work();
+      sh->squeue.enqueue(thread);
+      ops++;
+    }
+  }
+  sh->ops[id * 16] = ops;
+}
+
+static void runDeques(int id) {
+  unsigned long ops = 0;
+  unsigned int seed = id + 1;
+  xdeque * mine = &sh->deques[id];
+
+  while(!sh->start) ;
+  while(!sh->stop) {
+    xthread * thread = mine->pop();
+    if(thread == NULL) {
+      seed = seed * 1103515245 + 12345;
+      int victim = (seed >> 16) % nprocs;
+      if(victim != id) {
+        thread = sh->deques[victim].steal();
+      }
+    }
+    if(thread) {
+      work();
+      mine->push(thread);
+      ops++;
+    }
+  }
+  sh->ops[id * 16] = ops;
+}
+
+static double run(const char * name, void (*body)(int)) {
+  pid_t pids[MAX_PROCS];
+  unsigned long total = 0;
+
+  sh->start = 0;
+  sh->stop = 0;
+
+  for(int i = 0; i < nprocs; i++) {
+    pids[i] = fork();
+    if(pids[i] == 0) {
+      body(i);
+      _exit(0);
+    }
+  }
+
+  sh->start = 1;
+  usleep(RUN_MSECS * 1000);
+  sh->stop = 1;
+
+  for(int i = 0; i < nprocs; i++) {
+    waitpid(pids[i], NULL, 0);
+    total += sh->ops[i * 16];
+  }
+
+  double rate = total / (RUN_MSECS / 1000.0);
+  printf("%-14s procs %2d: %12.0f picks/s\n", name, nprocs, rate);
+  return rate;
+}
+
+int main(int argc, char ** argv) {
+  nprocs = (argc > 1) ? atoi(argv[1]) : 8;
+  if(nprocs < 1 || nprocs > MAX_PROCS) {
+    fprintf(stderr, "usage: %s [procs <= %d]\n", argv[0], MAX_PROCS);
+    return 1;
+  }
+
+  int nthreads = nprocs * THREADS_PER_PROC;
+  sh = (shared *)mmap(NULL, sizeof(shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  threads = (xthread *)mmap(NULL, sizeof(xthread) * nthreads, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(sh == MAP_FAILED || threads == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  // Only the queue node of each thread is used here.
+  new (&sh->squeue) xqueue;
+  for(int i = 0; i < nprocs; i++) {
+    new (&sh->deques[i]) xdeque;
+  }
+
+  for(int i = 0; i < nthreads; i++) {
+    listInit(&threads[i].toqueue);
+    sh->squeue.enqueue(&threads[i]);
+  }
+  double before = run("global squeue", runGlobalQueue);
+
+  for(int i = 0; i < nthreads; i++) {
+    sh->squeue.dequeue();
+    sh->deques[0].push(&threads[i]);
+  }
+  double after = run("work-stealing", runDeques);
+
+  printf("speedup: %.2fx\n", after / before);
+  return 0;
+}